@@ -0,0 +1,41 @@
+#ifndef __ARGIR__ACPI_H
+#define __ARGIR__ACPI_H
+
+#include <stdint.h>
+#include "mb2.h"
+
+/**
+ * Root System Description Pointer (ACPI 6.3 Section 5.2.5.3)
+ * The 2.0+ fields are only valid if `revision` >= 2.
+ */
+struct acpi_rsdp {
+    char signature[8]; /** "RSD PTR " */
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+/**
+ * Common header of every system description table
+ */
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length; /** Including this header */
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+void acpi_init(uint64_t mb2_info);
+
+#endif /* __ARGIR__ACPI_H */
@@ -4,5 +4,12 @@
 #define KERNEL_LMA (0x200000)
 #define KERNEL_VMA (0xffffffff80000000ull)
 #define LFB_VMA (0xffffffff40200000ull) /** Only available after physmem init */
+#define SMP_TRAMPOLINE_ADDR (0x8000) /** APs start in real mode here */
+#define PHYSMAP_VMA (0xffff800000000000ull) /** Only available after paging init */
+
+/** Address of `physaddr` in the physmap (direct map of all RAM) */
+#define PHYS_TO_VIRT(physaddr) ((void *)((uint64_t)(physaddr) + PHYSMAP_VMA))
+/** Physical address of `virtaddr`, which must be in the physmap */
+#define VIRT_TO_PHYS(virtaddr) ((uint64_t)(virtaddr) - PHYSMAP_VMA)
 
 #endif /** __ARGIR__ADDR_H */
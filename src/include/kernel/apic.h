@@ -0,0 +1,102 @@
+#ifndef __ARGIR__APIC_H
+#define __ARGIR__APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "percpu.h"
+
+/**
+ *  Local APIC (xAPIC or x2APIC) and IOAPIC
+ */
+#define MSR_APIC_BASE (0x1b)
+#define APIC_BASE_BSP (1 << 8)
+#define APIC_BASE_EXTD (1 << 10) /** x2APIC mode */
+#define APIC_BASE_EN (1 << 11)
+#define CPUID_ECX_X2APIC (1 << 21)
+
+// Local APIC registers (xAPIC MMIO offsets, x2APIC MSR = 0x800 + (reg >> 4))
+#define LAPIC_ID (0x20)
+#define LAPIC_VERSION (0x30)
+#define LAPIC_TPR (0x80)
+#define LAPIC_EOI (0xb0)
+#define LAPIC_SVR (0xf0)
+#define LAPIC_ICR_LO (0x300)
+#define LAPIC_ICR_HI (0x310)
+#define LAPIC_LVT_TIMER (0x320)
+#define LAPIC_LVT_PERFMON (0x340)
+#define LAPIC_LVT_LINT0 (0x350)
+#define LAPIC_LVT_LINT1 (0x360)
+#define LAPIC_LVT_ERROR (0x370)
+#define LAPIC_TIMER_INIT (0x380)
+#define LAPIC_TIMER_CURRENT (0x390)
+#define LAPIC_TIMER_DIVIDE (0x3e0)
+#define X2APIC_MSR(reg) (0x800 + ((reg) >> 4))
+
+// ICR bits
+#define LAPIC_ICR_INIT (0x5 << 8)
+#define LAPIC_ICR_NMI (0x4 << 8)
+#define LAPIC_ICR_STARTUP (0x6 << 8)
+#define LAPIC_ICR_PENDING (1 << 12) /** Delivery status, xAPIC only */
+#define LAPIC_ICR_ASSERT (1 << 14)
+#define LAPIC_ICR_LEVEL (1 << 15)
+#define LAPIC_ICR_ALL_BUT_SELF (3 << 18) /** Destination shorthand */
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_NMI (0x4 << 8) /** Delivery mode */
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_ONESHOT (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIVIDE_16 (0x3)
+
+#define MSR_TSC_DEADLINE (0x6e0)
+
+/** Spurious interrupts land here, they must not be EOI'd */
+#define APIC_SPURIOUS_VECTOR (0xff)
+
+// IOAPIC registers, through IOREGSEL/IOWIN
+#define IOAPIC_REGSEL (0x00)
+#define IOAPIC_WIN (0x10)
+#define IOAPIC_VERSION (0x01)
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+
+// IOAPIC redirection entry bits
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define MAX_IOAPICS (8)
+#define ISA_IRQS_COUNT (16)
+
+/// True once the local APIC and IOAPICs are up and the PIC is retired
+bool apic_enabled;
+/// Local APIC access: MSRs in x2APIC mode, MMIO otherwise
+bool lapic_x2apic;
+volatile uint32_t *lapic_mmio;
+
+/// APIC IDs of every enabled CPU in the MADT (the BSP is one of them)
+uint32_t apic_cpu_ids[MAX_CPUS];
+size_t apic_cpus_count;
+
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+uint32_t lapic_id();
+void lapic_init();
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_lo);
+/**
+ * Signal end of interrupt to the local APIC. A single MSR write in x2APIC mode.
+ */
+static inline void lapic_eoi()
+{
+    if (lapic_x2apic) {
+        wrmsr(X2APIC_MSR(LAPIC_EOI), 0);
+    } else {
+        lapic_mmio[LAPIC_EOI / 4] = 0;
+    }
+}
+
+bool ioapic_route_irq(unsigned int irq, uint8_t vector, uint32_t apic_id);
+void ioapic_mask_irq(unsigned int irq);
+bool apic_init();
+
+#endif /* __ARGIR__APIC_H */
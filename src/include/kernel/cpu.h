@@ -7,7 +7,9 @@
 /**
  *  Global Descriptor Table
  */
-#define GDT_ENTRIES_COUNT (3)
+#define GDT_ENTRIES_COUNT (5) /** Null, code, data, then the TSS takes two */
+#define GDT_TSS_INDEX (3)
+#define GDT_TSS_SELECTOR (GDT_TSS_INDEX * 8)
 
 /**
  * Generic segment descriptor (long mode)
@@ -73,9 +75,38 @@ struct dtr {
     volatile uint64_t base;
 } __attribute__((packed));
 
+/**
+ * Task-state segment (long mode), only used for its stack pointers
+ * AMD64 APM p.361
+ */
+struct tss {
+    uint32_t reserved_1;
+    uint64_t rsp[3]; /** Stack for a switch to ring n, unused with no ring 3 */
+    uint64_t reserved_2;
+    uint64_t ist[7]; /** IST1-7, ist[0] is IST1 */
+    uint64_t reserved_3;
+    uint16_t reserved_4;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+#define TSS_TYPE_AVAILABLE (0x9)
+
+/**
+ * Interrupt stack table slots. Exceptions that can hit with a broken stack get
+ * a known-good one of their own on every CPU.
+ */
+#define IST_NONE (0) /** Stay on the interrupted stack */
+#define IST_DOUBLE_FAULT (1)
+#define IST_NMI (2)
+#define IST_MACHINE_CHECK (3)
+#define IST_STACKS (3)
+#define IST_STACK_SIZE (0x4000)
+
 struct gen_seg_desc gdt[GDT_ENTRIES_COUNT] __attribute__((align(4096)));
 
-void gdt_load();
+void tss_init(struct tss *tss);
+void tss_free(struct tss *tss);
+void gdt_load(struct gen_seg_desc *table, struct tss *tss);
 void gdt_init();
 
 /**
@@ -111,9 +142,108 @@ struct gate_desc {
 struct gate_desc idt[IDT_ENTRIES_COUNT] __attribute__((align(4096)));
 
 /**
- * Register an interrupt handler with address `base`.
+ * Register an interrupt handler with address `base`, running on interrupt
+ * stack `ist` (or IST_NONE).
  */
-void set_interrupt_desc(size_t index, uint64_t base);
+void set_interrupt_desc(size_t index, uint64_t base, uint8_t ist);
+void idt_load();
 void idt_init();
 
+/**
+ *  CPUID & model-specific registers
+ */
+#define CPUID_FEATURES (0x1) /** EBX[31:24] is the initial APIC ID */
+#define CPUID_ECX_TSC_DEADLINE (1 << 24) /** LAPIC timer TSC-deadline mode */
+#define CPUID_EDX_PAT (1 << 16) /** Page attribute table */
+#define CPUID_PERFMON (0xa) /** Architectural performance monitoring */
+#define CPUID_EXT_FEATURES (0x80000001)
+#define CPUID_EXT_EDX_NX (1 << 20) /** No-execute page protection */
+#define CPUID_EXT_EDX_PAGE1GB (1 << 26) /** 1G pages */
+#define CPUID_EXT_POWER (0x80000007)
+#define CPUID_EXT_EDX_INVARIANT_TSC (1 << 8) /** Constant rate in all states */
+
+#define MSR_EFER (0xc0000080)
+#define EFER_LME (1 << 8)
+#define EFER_NXE (1 << 11)
+#define MSR_GS_BASE (0xc0000101)
+
+// Page attribute table, Intel SDM Vol. 3A Section 11.12
+#define MSR_PAT (0x277)
+#define PAT_UC (0)
+#define PAT_WC (1)
+#define PAT_WT (4)
+#define PAT_WP (5)
+#define PAT_WB (6)
+#define PAT_UC_MINUS (7) /** UC, unless an MTRR says WC */
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+// Architectural PMU, Intel SDM Vol. 3B Chapter 20
+#define MSR_PMC0 (0xc1) /** Writes are 32 bits, sign-extended */
+#define MSR_PERFEVTSEL0 (0x186)
+#define MSR_PERF_GLOBAL_STATUS (0x38e) /** Version 2+ */
+#define MSR_PERF_GLOBAL_CTRL (0x38f)
+#define MSR_PERF_GLOBAL_OVF_CTRL (0x390)
+#define PERFEVTSEL_CYCLES (0x3c) /** UnHalted Core Cycles, umask 0 */
+#define PERFEVTSEL_OS (1 << 17)
+#define PERFEVTSEL_INT (1 << 20) /** Interrupt on overflow */
+#define PERFEVTSEL_EN (1 << 22)
+
+/** Page fault error code bits */
+#define PF_PRESENT (1 << 0) /** Page was present, i.e. a protection violation */
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
+#define PF_IFETCH (1 << 4)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+#define CR0_WP (1 << 16) /** Honour read-only pages in ring 0 too */
+
+static inline uint64_t read_cr0()
+{
+    uint64_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0)
+{
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0) : "memory");
+}
+
+/**
+ * Linear address that caused the last page fault.
+ */
+static inline uint64_t read_cr2()
+{
+    uint64_t cr2;
+    __asm__ volatile("movq %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" ::"a"((uint32_t)value),
+                     "d"((uint32_t)(value >> 32)), "c"(msr));
+}
+
 #endif /* __ARGIR__CPU_H */
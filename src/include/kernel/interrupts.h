@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/** Hardware IRQs 0-15 are delivered at vectors IRQ_BASE + irq */
+#define IRQ_BASE (0x20)
+
 struct interrupt_frame {
     uint64_t r15;
     uint64_t r14;
@@ -16,15 +19,53 @@ struct interrupt_frame {
     uint64_t rdi;
     uint64_t rsi;
     uint64_t rbp;
-    uint64_t rsp;
     uint64_t rbx;
     uint64_t rdx;
     uint64_t rcx;
     uint64_t rax;
     uint64_t int_no;
     uint64_t err_code;
+    // Pushed by the CPU
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
 } __attribute__((packed)); /** Redundant? This should have no padding anyway */
 
+/**
+ * What isr_irq_common saves for vectors IRQ_BASE and up: the caller-saved
+ * registers, plus rbp so the interrupted stack can be walked.
+ */
+struct irq_frame {
+    uint64_t rbp;
+    uint64_t r11;
+    uint64_t r10;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t rcx;
+    uint64_t rax;
+    uint64_t vector;
+    // Pushed by the CPU
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+} __attribute__((packed));
+
+/**
+ * Handler for vectors IRQ_BASE and up. Runs with interrupts off, before the
+ * EOI, so a level-triggered device should be acknowledged in here.
+ */
+typedef void (*irq_handler_t)(unsigned int vector, void *ctx);
+
+#define IRQ_BENCH_VECTOR (0xef) /** Only registered while irq_benchmark runs */
+#define IRQ_BENCH_ROUNDS (1000)
+
 static inline void interrupts_enable()
 {
     __asm__("sti");
@@ -44,6 +85,11 @@ static inline bool interrupts_enabled()
     return (flags >> 9u) & 0x1;
 }
 
+void irq_eoi(unsigned int int_no);
+bool irq_register(unsigned int vector, irq_handler_t handler, void *ctx);
+void irq_unregister(unsigned int vector);
+struct irq_frame *irq_current_frame();
+void irq_benchmark();
 void interrupts_init();
 
 #endif /* __ARGIR__INTERRUPTS_H */
@@ -13,6 +13,8 @@ struct mb2_memory_map_entry {
 #define MB_TAG_TYPE_TERMINATOR (0)
 #define MB_TAG_TYPE_MEMORY_MAP (6)
 #define MB_TAG_TYPE_FRAMEBUFFER (8)
+#define MB_TAG_TYPE_ACPI_OLD (14) /** Copy of the ACPI 1.0 RSDP */
+#define MB_TAG_TYPE_ACPI_NEW (15) /** Copy of the ACPI 2.0+ RSDP */
 
 struct mb2_tag {
     uint32_t type;
@@ -33,6 +35,10 @@ struct mb2_tag {
             uint32_t entry_version;
             struct mb2_memory_map_entry entries[0];
         } __attribute__((packed)) memory_map;
+
+        struct mb2_tag_acpi {
+            uint8_t rsdp[0];
+        } __attribute__((packed)) acpi;
     };
 } __attribute__((packed));
 
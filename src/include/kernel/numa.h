@@ -0,0 +1,34 @@
+#ifndef __ARGIR__NUMA_H
+#define __ARGIR__NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMA_MAX_NODES (8)
+#define NUMA_MAX_RANGES (32)
+#define NUMA_MAX_CPUS (256)
+
+/** SLIT distances: a node to itself, and the default to any other node */
+#define NUMA_LOCAL_DISTANCE (10)
+#define NUMA_REMOTE_DISTANCE (20)
+
+/**
+ * A range of physical memory that belongs to a node.
+ * Nodes are numbered 0..numa_nodes_count-1, not by ACPI proximity domain.
+ */
+struct numa_mem_range {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t node;
+};
+
+/// Memory affinity from the SRAT, sorted by base
+struct numa_mem_range numa_mem_ranges[NUMA_MAX_RANGES];
+size_t numa_mem_ranges_count;
+size_t numa_nodes_count;
+
+uint8_t numa_distance(unsigned int from, unsigned int to);
+unsigned int numa_apic_node(uint32_t apic_id);
+void numa_init();
+
+#endif /* __ARGIR__NUMA_H */
@@ -1,16 +1,46 @@
 #ifndef __ARGIR__PAGING_H
 #define __ARGIR__PAGING_H
 
+#include <stdbool.h>
 #include "addr.h"
 #include "mb2.h"
 #include "pmem.h"
 
 #define PAGE_SIZE (0x1000) /** 4K */
 #define HUGEPAGE_SIZE (0x200000) /** 2M */
+#define GIGAPAGE_SIZE (0x40000000) /** 1G */
 
-// Limit of the linear address space after `paging_init`
-uint64_t linear_limit;
+// PD or PT entry bits
+#define PDE_HUGE (1 << 7)
+#define PTE_PRESENT (1 << 0)
+#define PTE_READWRITE (1 << 1)
+#define PTE_PWT (1 << 3) /** Write-through */
+#define PTE_PCD (1 << 4) /** Cache disable */
+#define PTE_PAT (1 << 7) /** PAT index bit 2, 4K pages */
+#define PDE_PAT (1 << 12) /** Same thing in a 2M or 1G page */
+#define PTE_GLOBAL (1 << 8)
+#define PTE_NX (1ull << 63)
 
+/**
+ * Memory types for paging_map_range, i.e. which PAT entry a page uses. The
+ * PAT keeps its power-on layout apart from entry 4, which is write-combining
+ * (see paging_pat_init). Without a PAT, WC is dropped and it's up to the
+ * MTRRs.
+ */
+#define PTE_CACHE_WB (0)
+#define PTE_CACHE_WT (PTE_PWT)
+#define PTE_CACHE_UC_MINUS (PTE_PCD)
+#define PTE_CACHE_UC (PTE_PCD | PTE_PWT)
+#define PTE_CACHE_WC (PTE_PAT)
+
+void paging_map_range(uint64_t virtaddr, uint64_t physaddr, size_t len,
+                      uint64_t flags);
+void paging_unmap_range(uint64_t virtaddr, size_t len);
+bool paging_translate(uint64_t virtaddr, uint64_t *physaddr);
+void *paging_map_mmio(uint64_t physaddr, size_t len);
+void paging_map_lfb(uint64_t cache);
+void paging_pat_init();
+bool paging_shootdown_nmi();
 void paging_init(struct mb2_info *mb2_info);
 
 #endif /* __ARGIR__PAGING_H */
@@ -0,0 +1,50 @@
+#ifndef __ARGIR__PERCPU_H
+#define __ARGIR__PERCPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define MAX_CPUS (16)
+
+/**
+ * Per-CPU data area, reachable through GS base on its own CPU.
+ */
+struct percpu {
+    struct percpu *self; /** Must stay first, this_cpu() loads it from %gs:0 */
+    size_t id; /** Index into percpu_areas, 0 is the BSP */
+    uint32_t apic_id;
+    volatile bool online;
+    void *stack_top;
+    struct gen_seg_desc gdt[GDT_ENTRIES_COUNT] __attribute__((aligned(16)));
+    struct tss tss __attribute__((aligned(16)));
+};
+
+struct percpu percpu_areas[MAX_CPUS];
+/// CPUs that have been brought online, the BSP included
+size_t percpu_count;
+
+static inline struct percpu *this_cpu()
+{
+    struct percpu *cpu;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * Index of the CPU we're running on.
+ */
+static inline size_t this_cpu_id()
+{
+    size_t id;
+    __asm__ volatile("movq %%gs:%c1, %0"
+                     : "=r"(id)
+                     : "i"(offsetof(struct percpu, id)));
+    return id;
+}
+
+void percpu_load(struct percpu *cpu);
+void percpu_init();
+
+#endif /* __ARGIR__PERCPU_H */
@@ -0,0 +1,16 @@
+#ifndef __ARGIR__PIT_H
+#define __ARGIR__PIT_H
+
+/**
+ *  Programmable Interval Timer (8253/8254)
+ */
+#define PIT_FREQUENCY (1193182) /** Input clock, Hz */
+#define PIT_PORT_CHANNEL0 (0x40)
+#define PIT_PORT_CHANNEL2 (0x42)
+#define PIT_PORT_CMD (0x43)
+#define PIT_PORT_GATE (0x61) /** Channel 2 gate (bit 0) and output (bit 5) */
+
+void pit_set_periodic(unsigned int hz);
+void pit_wait_us(unsigned int us);
+
+#endif /* __ARGIR__PIT_H */
@@ -2,21 +2,101 @@
 #define __ARGIR__PMEM_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include "mb2.h"
+#include "numa.h"
 #include "paging.h"
 
+/** Largest buddy block is 2^PMEM_MAX_ORDER pages (4M) */
+#define PMEM_MAX_ORDER (10)
+
+/** pmem_page flags */
+#define PMEM_PAGE_FREE (1 << 0) /** Head of a free buddy block */
+#define PMEM_PAGE_MOVING (1 << 1) /** Free, being moved to another node */
+
+/**
+ * Page frame descriptor, one for every 4K page of usable RAM.
+ */
+struct pmem_page {
+    struct pmem_page *next; /** Free list links (only valid if free) */
+    struct pmem_page *prev;
+    uint32_t pfn; /** Page frame number, i.e. physaddr >> 12 */
+    uint8_t order; /** Buddy order (of the head page, free or allocated) */
+    uint8_t flags;
+    uint16_t refcount; /** Extra references to an allocated page, 0 = one owner */
+};
+
 struct pmem_block {
     uint64_t base;
     uint64_t limit;
+    struct pmem_page *pages; /** Descriptors for [base, limit) */
+    uint32_t node; /** NUMA node, blocks never straddle nodes */
+};
+
+/** Per-CPU page cache size and refill/drain batch, in pages */
+#define PMEM_PCP_SIZE (64)
+#define PMEM_PCP_BATCH (16)
+
+struct pmem_pcp_stats {
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+    uint64_t refills;
+    uint64_t refill_pages;
+    uint64_t drains;
+    uint64_t drain_pages;
+};
+
+/**
+ * Per-CPU magazine of free order-0 pages, sitting in front of the buddy
+ * allocator. Only ever touched by its own CPU with interrupts off.
+ */
+struct pmem_pcp {
+    uint64_t pages[PMEM_PCP_SIZE];
+    size_t count;
+    struct pmem_pcp_stats stats;
 };
 
-#define MAX_PMEM_ENTRIES (128) /** 128 * 16B = 2K, enough for now? */
+/**
+ * Buddy allocator state for one NUMA node.
+ */
+struct pmem_node {
+    struct pmem_page *free_lists[PMEM_MAX_ORDER + 1];
+    size_t free_count; /** Free 4K pages */
+    unsigned int fallback[NUMA_MAX_NODES]; /** Nodes to try, nearest first */
+};
+
+/** Pre-zeroed page pool size, and how many pages to zero per idle call */
+#define PMEM_ZERO_POOL_SIZE (64)
+#define PMEM_ZERO_POOL_BATCH (8)
+
+#define MAX_PMEM_ENTRIES (128) /** 128 * 32B = 4K, enough for now? */
 /// Memory map from MB2 boot info, sorted and merged
 struct pmem_block pmem_block_map[MAX_PMEM_ENTRIES];
 size_t pmem_blocks_count;
 
 void *pmem_alloc_page();
+void *pmem_alloc_pages(unsigned int order);
+void *pmem_alloc_pages_node(unsigned int node, unsigned int order);
+void *pmem_alloc_range(size_t n_pages);
+void *pmem_alloc_zeroed_page();
+void pmem_zero_pool_fill();
+void pmem_free_page(void *page);
+void pmem_free_pages(void *page, unsigned int order);
 void pmem_free_range(uint64_t base, uint64_t limit);
+unsigned int pmem_page_order(void *physaddr);
+void pmem_page_get(void *physaddr);
+void pmem_page_put(void *physaddr);
+bool pmem_page_shared(void *physaddr);
+size_t pmem_free_pages_count();
+size_t pmem_node_free_pages_count(unsigned int node);
+unsigned int pmem_page_node(void *physaddr);
+void pmem_set_cpu_node(size_t cpu, unsigned int node);
+unsigned int pmem_cpu_node(size_t cpu);
+void pmem_numa_init();
+void pmem_pcp_get_stats(struct pmem_pcp_stats *stats);
+void pmem_print_stats();
 void pmem_init(struct mb2_info *mb2_info);
 
 #endif /* __ARGIR__PMEM_H */
@@ -0,0 +1,41 @@
+#ifndef __ARGIR__PRINTK_H
+#define __ARGIR__PRINTK_H
+
+#include <stdint.h>
+#include <stdarg.h>
+
+/**
+ *  Kernel log. Messages are formatted into a lock-free per-CPU ring of
+ *  TSC-stamped records and drained later, merged back into TSC order, by
+ *  whoever gets the drain lock: the CPU's kworker normally, the caller for
+ *  serious messages and before printk_async_init. The framebuffer and the
+ *  serial port are the sinks. printf is printk at PRINTK_INFO.
+ */
+#define PRINTK_EMERG (0)
+#define PRINTK_ERR (1)
+#define PRINTK_WARN (2)
+#define PRINTK_INFO (3)
+#define PRINTK_DEBUG (4)
+
+#define PRINTK_SYNC_LEVEL (PRINTK_ERR) /** This or worse is out before printk returns */
+#define PRINTK_FB_LEVEL (PRINTK_INFO) /** Anything chattier is serial only */
+
+#define PRINTK_LINE_MAX (512) /** Longer messages get truncated */
+#define PRINTK_RECORD_TEXT (116) /** Longer messages take several records */
+#define PRINTK_RING_RECORDS (128) /** Per CPU, must be a power of two */
+
+struct printk_record {
+    uint64_t tsc; /** The same for every record of a message */
+    uint8_t level;
+    uint8_t cpu;
+    uint16_t len;
+    char text[PRINTK_RECORD_TEXT]; /** Not NUL-terminated */
+};
+
+int vprintk(int level, const char *fmt, va_list ap);
+int printk(int level, const char *fmt, ...);
+void printk_flush();
+void printk_async_init();
+void panic(const char *fmt, ...) __attribute__((noreturn));
+
+#endif /* __ARGIR__PRINTK_H */
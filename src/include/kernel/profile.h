@@ -0,0 +1,37 @@
+#ifndef __ARGIR__PROFILE_H
+#define __ARGIR__PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "interrupts.h"
+
+/**
+ *  Sampling profiler: every N cycles, record where each CPU was and the
+ *  frame-pointer chain above it. Dumped over serial for tools/profile.py.
+ */
+#define PROFILE_SAMPLES (2048) /** Per CPU, later ones are counted and dropped */
+#define PROFILE_MAX_DEPTH (16)
+#define PROFILE_STACK_SPAN (0x10000) /** Frames further up are junk */
+#define PROFILE_PERIOD_CYCLES (100000) /** Default, ~30 kHz at 3 GHz */
+#define PROFILE_MIN_PERIOD_CYCLES (10000)
+#define PROFILE_VECTOR (0xf1) /** Starts sampling on CPUs that are already up */
+
+enum profile_mode {
+    PROFILE_OFF,
+    PROFILE_PMU, /** Counter overflow NMI, sees interrupts-off code too */
+    PROFILE_TIMER, /** Kernel timer, only sees code with interrupts on */
+};
+
+struct profile_sample {
+    uint64_t depth;
+    uint64_t pcs[PROFILE_MAX_DEPTH]; /** pcs[0] is the sampled rip, then callers */
+};
+
+bool profile_nmi(struct interrupt_frame *frame);
+void profile_cpu_online();
+bool profile_start(uint64_t period_cycles);
+void profile_stop();
+void profile_dump();
+void profile_init();
+
+#endif /* __ARGIR__PROFILE_H */
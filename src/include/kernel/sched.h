@@ -0,0 +1,63 @@
+#ifndef __ARGIR__SCHED_H
+#define __ARGIR__SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "percpu.h"
+#include "timer.h"
+
+/** How long a thread runs before it's preempted, if anything else is ready */
+#define SCHED_TIMESLICE_NS (20 * NSEC_PER_MSEC)
+/** Wakes an idle CPU to pick up (or steal) new work */
+#define SCHED_RESCHED_VECTOR (0xf0)
+#define SCHED_STACK_SIZE (0x4000) /** 16K */
+
+/** Thread priorities, lower runs first */
+#define SCHED_PRIO_HIGH (0)
+#define SCHED_PRIO_NORMAL (1)
+#define SCHED_PRIO_LOW (2)
+#define SCHED_PRIORITIES (3)
+
+/** CPU affinity masks, bit n is percpu_areas[n] */
+#define SCHED_CPU(n) (1u << (n))
+#define SCHED_CPUS_ALL (0xffffffffu)
+
+enum thread_state {
+    THREAD_READY, /** In a run queue */
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_BLOCKED, /** Until sched_wake */
+    THREAD_DEAD, /** Waiting for its stack to be freed */
+};
+
+struct thread {
+    uint64_t rsp; /** Saved while switched out. Must stay first (switch.s) */
+    void *stack_top;
+    size_t id;
+    const char *name;
+    enum thread_state state;
+    unsigned int priority;
+    uint32_t affinity;
+    size_t cpu; /** Whose run queue this thread is on (or last ran on) */
+    struct timer wakeup; /** Ends sched_sleep_ns */
+    bool wake_pending; /** sched_wake came before sched_block */
+    struct thread *next;
+};
+
+struct thread *thread_create(const char *name, void (*entry)(void *),
+                             void *arg, unsigned int priority,
+                             uint32_t affinity);
+void thread_exit() __attribute__((noreturn));
+struct thread *thread_current();
+
+void schedule();
+void sched_yield();
+void sched_sleep_ns(uint64_t ns);
+void sched_block();
+void sched_wake(struct thread *thread);
+void sched_irq_exit();
+void sched_start() __attribute__((noreturn));
+void sched_init();
+
+#endif /* __ARGIR__SCHED_H */
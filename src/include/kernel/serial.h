@@ -0,0 +1,40 @@
+#ifndef __ARGIR__SERIAL_H
+#define __ARGIR__SERIAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ *  16550 UART on COM1, polled. Carries the kernel log (see printk) and
+ *  machine-readable output (profiles, traces) that doesn't belong on the
+ *  screen.
+ */
+#define SERIAL_COM1 (0x3f8)
+#define SERIAL_CLOCK (115200) /** Baud rate at divisor 1 */
+#define SERIAL_BAUD (115200)
+
+// Register offsets from the base port
+#define SERIAL_DATA (0) /** Divisor latch low with DLAB set */
+#define SERIAL_IER (1) /** Divisor latch high with DLAB set */
+#define SERIAL_FCR (2)
+#define SERIAL_LCR (3)
+#define SERIAL_MCR (4)
+#define SERIAL_LSR (5)
+
+#define SERIAL_LCR_8N1 (0x03)
+#define SERIAL_LCR_DLAB (1 << 7)
+#define SERIAL_LSR_THRE (1 << 5) /** Transmit holding register empty */
+
+bool serial_present;
+
+void serial_putc(char c);
+void serial_write(const char *str);
+void serial_write_hex(uint64_t value);
+void serial_write_dec(uint64_t value, unsigned int min_digits);
+void serial_claim();
+void serial_release();
+bool serial_claimed();
+void serial_panic();
+bool serial_init();
+
+#endif /* __ARGIR__SERIAL_H */
@@ -0,0 +1,60 @@
+#ifndef __ARGIR__SLAB_H
+#define __ARGIR__SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "percpu.h"
+#include "spinlock.h"
+
+/** Per-CPU object cache size and refill/drain batch, in objects */
+#define KMEM_CPU_CACHE_SIZE (16)
+#define KMEM_CPU_CACHE_BATCH (8)
+
+/** Largest kmalloc size class, anything bigger comes straight from pmem */
+#define KMALLOC_MAX_CLASS (1024)
+
+/**
+ * Header at the start of every slab (one 4K page).
+ */
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *freelist; /** Free objects in this slab */
+    size_t inuse; /** Objects handed out (incl. sitting in per-CPU caches) */
+};
+
+struct kmem_cache_cpu {
+    void *objs[KMEM_CPU_CACHE_SIZE];
+    size_t count;
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t size; /** Object size incl. padding and free pointer */
+    size_t align;
+    size_t free_offset; /** Where the free pointer lives in a free object */
+    size_t objs_offset; /** Offset of the first object in a slab */
+    size_t objs_per_slab;
+    void (*ctor)(void *obj);
+    struct spinlock lock; /** Protects the slab lists */
+    struct slab *partial; /** Slabs with at least one free object */
+    struct slab *full;
+    size_t slabs_count;
+    struct kmem_cache *next; /** All caches, for stats */
+    struct kmem_cache_cpu cpu[MAX_CPUS];
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+void kmem_print_stats();
+void kmem_init();
+
+#endif /* __ARGIR__SLAB_H */
@@ -0,0 +1,23 @@
+#ifndef __ARGIR__SMP_H
+#define __ARGIR__SMP_H
+
+#include <stdint.h>
+#include "percpu.h"
+
+#define SMP_AP_STACK_SIZE (0x4000) /** 16K, same as the BSP's boot stack */
+
+/**
+ * Handed to each AP through the trampoline page. Layout must match
+ * smp_trampoline_data in smp_trampoline.S.
+ */
+struct smp_trampoline_data {
+    uint32_t cr3; /** Has to fit in 32 bits, we load it from protected mode */
+    uint32_t efer; /** EFER bits to set on top of whatever's there */
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+} __attribute__((packed));
+
+void smp_init();
+
+#endif /* __ARGIR__SMP_H */
@@ -0,0 +1,19 @@
+#ifndef __ARGIR__SOFTIRQ_H
+#define __ARGIR__SOFTIRQ_H
+
+#include <stdbool.h>
+
+/**
+ *  Softirqs: per-CPU bottom halves, run with interrupts on at the end of the
+ *  interrupt that raised them
+ */
+#define SOFTIRQ_INPUT (0) /** Scancode decoding */
+#define SOFTIRQ_COUNT (32)
+#define SOFTIRQ_MAX_ROUNDS (8) /** Then leave the rest for the next interrupt */
+
+void softirq_register(unsigned int nr, void (*handler)(void));
+void softirq_raise(unsigned int nr);
+bool softirq_active();
+void softirq_run();
+
+#endif /* __ARGIR__SOFTIRQ_H */
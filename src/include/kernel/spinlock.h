@@ -0,0 +1,73 @@
+#ifndef __ARGIR__SPINLOCK_H
+#define __ARGIR__SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+static inline void spin_lock(struct spinlock *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain load so we don't hammer the cache line
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+/**
+ * Take `lock` only if it's free right now. Returns true if we got it.
+ */
+static inline bool spin_trylock(struct spinlock *lock)
+{
+    return !__atomic_load_n(&lock->locked, __ATOMIC_RELAXED) &&
+           !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(struct spinlock *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Disable interrupts on this CPU, returning the previous RFLAGS.
+ */
+static inline uint64_t irq_save()
+{
+    uint64_t flags;
+    __asm__ volatile("pushf\n\t"
+                     "pop %0\n\t"
+                     "cli"
+                     : "=r"(flags)
+                     :
+                     : "memory");
+    return flags;
+}
+
+/**
+ * Restore interrupt state saved by `irq_save`.
+ */
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & (1 << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+static inline uint64_t spin_lock_irqsave(struct spinlock *lock)
+{
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *lock, uint64_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* __ARGIR__SPINLOCK_H */
@@ -0,0 +1,51 @@
+#ifndef __ARGIR__STATIC_KEY_H
+#define __ARGIR__STATIC_KEY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "interrupts.h"
+
+/**
+ *  Static keys: branches that are a 5-byte nop while the key is off, and get
+ *  patched into a jmp when it's turned on. For checks on hot paths that are
+ *  almost always false, like tracepoints.
+ */
+#define STATIC_KEY_SYNC_VECTOR (0xf2) /** Serializes other CPUs while patching */
+
+struct static_key {
+    bool enabled;
+};
+
+/// One per static_branch site, collected between _static_keys_start/end
+struct static_key_entry {
+    uint64_t code; /** The nop */
+    uint64_t target; /** Where the jmp goes */
+    struct static_key *key;
+};
+
+/**
+ * False until `key` is enabled, for the cost of a nop.
+ */
+static inline __attribute__((always_inline)) bool
+static_branch(struct static_key *key)
+{
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection .static_keys, \"aw\"\n\t"
+                 ".balign 8\n\t"
+                 ".quad 1b, %l[enabled], %c0\n\t"
+                 ".popsection"
+                 :
+                 : "i"(key)
+                 :
+                 : enabled);
+    return false;
+enabled:
+    return true;
+}
+
+void static_key_enable(struct static_key *key);
+void static_key_disable(struct static_key *key);
+bool static_key_int3(struct interrupt_frame *frame);
+void static_key_init();
+
+#endif /* __ARGIR__STATIC_KEY_H */
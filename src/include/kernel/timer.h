@@ -0,0 +1,50 @@
+#ifndef __ARGIR__TIMER_H
+#define __ARGIR__TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "interrupts.h"
+
+#define NSEC_PER_USEC (1000ull)
+#define NSEC_PER_MSEC (1000000ull)
+#define NSEC_PER_SEC (1000000000ull)
+
+/**
+ * The local APIC timer fires here. It shares the vector with PIT IRQ0, which
+ * only drives it when there's no APIC.
+ */
+#define TIMER_VECTOR (IRQ_BASE + 0)
+#define TIMER_FALLBACK_HZ (100) /** PIT tick rate without an APIC timer */
+#define TIMER_CALIBRATE_US (10000) /** 10ms */
+
+/** Where timer interrupts come from */
+enum timer_mode {
+    TIMER_PIT_PERIODIC, /** No APIC: tick and check */
+    TIMER_LAPIC_ONESHOT,
+    TIMER_TSC_DEADLINE,
+};
+
+/**
+ * One-shot callback at `deadline` (ktime_get_ns). Runs on the CPU that armed
+ * it, in interrupt context.
+ */
+struct timer {
+    uint64_t deadline;
+    void (*fn)(void *arg);
+    void *arg;
+    size_t cpu; /** Whose queue it's on, if armed */
+    bool armed;
+    struct timer *next;
+};
+
+uint64_t ktime_get_ns();
+uint64_t tsc_to_ns(uint64_t cycles);
+void udelay(uint64_t us);
+void timer_setup(struct timer *timer, void (*fn)(void *), void *arg);
+void timer_arm(struct timer *timer, uint64_t deadline);
+void timer_cancel(struct timer *timer);
+void timer_init_cpu();
+void timer_init();
+
+#endif /* __ARGIR__TIMER_H */
@@ -0,0 +1,53 @@
+#ifndef __ARGIR__TRACE_H
+#define __ARGIR__TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "static_key.h"
+
+/**
+ *  Tracepoints: TSC-stamped events in a per-CPU ring, exported over serial as
+ *  Chrome trace JSON (chrome://tracing, ui.perfetto.dev). Off, each one is a
+ *  nop.
+ */
+#define TRACE_EVENTS (512) /** Per CPU, the oldest get overwritten */
+
+// Chrome trace event phases
+#define TRACE_BEGIN ('B')
+#define TRACE_END ('E')
+#define TRACE_INSTANT ('i')
+
+struct trace_event {
+    uint64_t tsc;
+    const char *name;
+    uint64_t arg;
+    char phase;
+};
+
+struct static_key trace_key;
+
+void trace_record(const char *name, char phase, uint64_t arg);
+
+#define trace_begin(name)                                                      \
+    do {                                                                       \
+        if (static_branch(&trace_key))                                         \
+            trace_record((name), TRACE_BEGIN, 0);                              \
+    } while (0)
+
+#define trace_end(name)                                                        \
+    do {                                                                       \
+        if (static_branch(&trace_key))                                         \
+            trace_record((name), TRACE_END, 0);                                \
+    } while (0)
+
+#define trace_instant(name, arg)                                               \
+    do {                                                                       \
+        if (static_branch(&trace_key))                                         \
+            trace_record((name), TRACE_INSTANT, (arg));                        \
+    } while (0)
+
+void trace_start();
+void trace_stop();
+void trace_dump();
+
+#endif /* __ARGIR__TRACE_H */
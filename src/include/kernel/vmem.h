@@ -2,8 +2,38 @@
 #define __ARGIR__VMEM_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Lower-half window that vmem hands out regions from */
+#define VMEM_BASE (0x0000001000000000ull) /** 64G */
+#define VMEM_LIMIT (0x0000800000000000ull) /** End of the lower half */
+
+/** vmem_region flags */
+#define VMEM_STACK (1 << 0) /** Grows down, so the guard below is an overflow */
+
+/**
+ * A reserved range of virtual memory. Pages are only backed by physical memory
+ * once they're written (reads see the shared zero page), and may be shared
+ * copy-on-write with a clone. Every region is surrounded by unmapped guard
+ * pages.
+ */
+struct vmem_region {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t flags;
+    size_t resident; /** Pages backed by physical memory (maybe shared) */
+    struct vmem_region *next;
+};
 
 void *vmem_alloc(size_t n);
+void *vmem_alloc_stack(size_t n);
+void vmem_populate(void *top, size_t n);
+void vmem_free(void *ptr);
+void *vmem_clone(void *ptr);
+bool vmem_handle_fault(uint64_t faultaddr, uint64_t err_code);
+void vmem_report_fault(uint64_t faultaddr);
+size_t vmem_resident_pages(void);
 void vmem_init(void);
 
 #endif /* __ARGIR__VMEM_H */
@@ -0,0 +1,21 @@
+#ifndef __ARGIR__WORKQUEUE_H
+#define __ARGIR__WORKQUEUE_H
+
+#include <stdbool.h>
+
+/**
+ * Deferred work, run in thread context by the kworker thread of the CPU it
+ * was queued on. Handlers may sleep, block and take their time.
+ */
+struct work {
+    void (*fn)(void *);
+    void *arg;
+    bool pending; /** Queued and not yet started */
+    struct work *next;
+};
+
+void work_init(struct work *work, void (*fn)(void *), void *arg);
+bool work_queue(struct work *work);
+void workqueue_init();
+
+#endif /* __ARGIR__WORKQUEUE_H */
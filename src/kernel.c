@@ -11,11 +11,46 @@
 #include "kernel/pci.h"
 #include "kernel/pmem.h"
 #include "kernel/paging.h"
+#include "kernel/vmem.h"
+#include "kernel/acpi.h"
+#include "kernel/numa.h"
+#include "kernel/percpu.h"
+#include "kernel/printk.h"
+#include "kernel/smp.h"
+#include "kernel/sched.h"
+#include "kernel/workqueue.h"
+#include "kernel/serial.h"
+#include "kernel/profile.h"
+#include "kernel/static_key.h"
+#include "kernel/trace.h"
 
 #ifndef __ARGIR_BUILD_COMMIT__
 #define __ARGIR_BUILD_COMMIT__ "balls"
 #endif
 
+/// Sample the rest of boot once the timer is up, see tools/profile.py
+#ifndef __ARGIR_PROFILE_BOOT__
+#define __ARGIR_PROFILE_BOOT__ 0
+#endif
+
+/// Trace every boot phase, dumped over serial once we're up, see tools/trace.py
+#ifndef __ARGIR_TRACE_BOOT__
+#define __ARGIR_TRACE_BOOT__ 0
+#endif
+
+/// Time interrupt entry and the like, for before/after comparisons
+#ifndef __ARGIR_BENCH_BOOT__
+#define __ARGIR_BENCH_BOOT__ 0
+#endif
+
+/// Run `call` as a boot phase, a trace span named after it
+#define BOOT_PHASE(call)                                                       \
+    do {                                                                       \
+        trace_begin(#call);                                                    \
+        call;                                                                  \
+        trace_end(#call);                                                      \
+    } while (0)
+
 uint32_t mb2_magic;
 uint32_t mb2_info;
 
@@ -33,24 +68,52 @@ void kernel_main(void)
     // Calculate higher-half MB2 boot info address
     uint64_t mb2_info_vma = (uint64_t)mb2_info + KERNEL_VMA;
 
-    terminal_init(NULL, 800, 600, 3200, 1); // Dummy null output for printfs
-    pmem_init(mb2_info_vma);
-    paging_init(mb2_info_vma);
-    vmem_init();
+    percpu_init(); // GS base first, everything below uses this_cpu_id()
+    if (__ARGIR_TRACE_BOOT__) {
+        trace_start();
+    }
+    // Dummy null output for printfs
+    BOOT_PHASE(terminal_init(NULL, 800, 600, 3200, 1));
+    BOOT_PHASE(pmem_init(mb2_info_vma));
+    BOOT_PHASE(paging_init(mb2_info_vma));
+    BOOT_PHASE(vmem_init());
+    BOOT_PHASE(acpi_init(mb2_info_vma));
+    BOOT_PHASE(numa_init());
     print_build_info();
+    BOOT_PHASE(serial_init());
 
-    gdt_init();
-    interrupts_init();
-    keyboard_init();
-
-    // Ready to go
-    interrupts_enable();
-
-    for (;;) {
-        keyboard_main();
-
-        __asm__ volatile("hlt");
+    BOOT_PHASE(gdt_init());
+    BOOT_PHASE(interrupts_init());
+    BOOT_PHASE(timer_init());
+    if (__ARGIR_BENCH_BOOT__) {
+        BOOT_PHASE(terminal_benchmark());
+    }
+    static_key_init();
+    profile_init();
+    if (__ARGIR_PROFILE_BOOT__) {
+        profile_start(PROFILE_PERIOD_CYCLES);
     }
+    BOOT_PHASE(sched_init());
+    BOOT_PHASE(smp_init());
+    BOOT_PHASE(workqueue_init());
+    terminal_async_init();
+    printk_async_init();
+    BOOT_PHASE(keyboard_init());
+    if (__ARGIR_BENCH_BOOT__) {
+        BOOT_PHASE(irq_benchmark());
+    }
+    pmem_print_stats();
+    if (__ARGIR_PROFILE_BOOT__) {
+        profile_stop();
+        profile_dump();
+    }
+    if (__ARGIR_TRACE_BOOT__) {
+        trace_stop();
+        trace_dump();
+    }
+
+    // Ready to go, the boot stack becomes the BSP's idle thread
+    sched_start();
 }
 
 static void print_build_info()
@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/acpi.h"
+#include "kernel/addr.h"
+#include "kernel/mb2.h"
+#include "kernel/paging.h"
+
+// Either the RSDT (32-bit entries) or XSDT (64-bit entries)
+static struct acpi_sdt_header *acpi_root = NULL;
+static size_t acpi_root_entry_size = 0;
+
+static bool acpi_checksum(const void *table, size_t length)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += ((const uint8_t *)table)[i];
+    }
+    return sum == 0;
+}
+
+/**
+ * Make sure [physaddr, physaddr + length) is reachable through the physmap.
+ * Firmware tables don't live in RAM we manage, so they aren't mapped yet.
+ */
+static void *acpi_map(uint64_t physaddr, size_t length)
+{
+    uint64_t base = physaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    for (uint64_t page = base; page < physaddr + length; page += PAGE_SIZE) {
+        uint64_t mapped;
+        if (!paging_translate((uint64_t)PHYS_TO_VIRT(page), &mapped)) {
+            paging_map_range((uint64_t)PHYS_TO_VIRT(page), page, PAGE_SIZE,
+                             PTE_NX);
+        }
+    }
+    return PHYS_TO_VIRT(physaddr);
+}
+
+/**
+ * Map the whole table at `physaddr`, header first to find out its length.
+ */
+static struct acpi_sdt_header *acpi_map_table(uint64_t physaddr)
+{
+    struct acpi_sdt_header *header =
+        acpi_map(physaddr, sizeof(struct acpi_sdt_header));
+    return acpi_map(physaddr, header->length);
+}
+
+/**
+ * Find the table with the 4-character `signature`, e.g. "APIC" for the MADT.
+ * Returns NULL if there's no such table or its checksum is bad.
+ */
+struct acpi_sdt_header *acpi_find_table(const char *signature)
+{
+    if (acpi_root == NULL) {
+        return NULL;
+    }
+
+    size_t n = (acpi_root->length - sizeof(*acpi_root)) / acpi_root_entry_size;
+    uint8_t *entries = (uint8_t *)(acpi_root + 1);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t physaddr = acpi_root_entry_size == 8 ?
+                                *(uint64_t *)(entries + i * 8) :
+                                *(uint32_t *)(entries + i * 4);
+        struct acpi_sdt_header *table = acpi_map_table(physaddr);
+        if (table->signature[0] != signature[0] ||
+            table->signature[1] != signature[1] ||
+            table->signature[2] != signature[2] ||
+            table->signature[3] != signature[3]) {
+            continue;
+        }
+        if (!acpi_checksum(table, table->length)) {
+            printf("ACPI: bad checksum on %s\n", signature);
+            return NULL;
+        }
+        return table;
+    }
+
+    return NULL;
+}
+
+/**
+ * Find the root table via the copy of the RSDP that the bootloader leaves in
+ * the boot info. Needs the physmap.
+ */
+void acpi_init(uint64_t mb2_info)
+{
+    struct mb2_tag *tag = mb2_find_tag(mb2_info, MB_TAG_TYPE_ACPI_NEW);
+    if (tag == NULL) {
+        tag = mb2_find_tag(mb2_info, MB_TAG_TYPE_ACPI_OLD);
+    }
+    if (tag == NULL) {
+        printf("ACPI: no RSDP in boot info.\n");
+        return;
+    }
+
+    struct acpi_rsdp *rsdp = (struct acpi_rsdp *)tag->acpi.rsdp;
+    if (rsdp->revision >= 2 && rsdp->xsdt_addr != 0) {
+        acpi_root = acpi_map_table(rsdp->xsdt_addr);
+        acpi_root_entry_size = 8;
+    } else {
+        acpi_root = acpi_map_table(rsdp->rsdt_addr);
+        acpi_root_entry_size = 4;
+    }
+
+    if (!acpi_checksum(acpi_root, acpi_root->length)) {
+        printf("ACPI: bad root table checksum.\n");
+        acpi_root = NULL;
+        return;
+    }
+    printf("ACPI: revision %u, %s at 0x%x\n", rsdp->revision,
+           acpi_root_entry_size == 8 ? "XSDT" : "RSDT", VIRT_TO_PHYS(acpi_root));
+}
@@ -0,0 +1,312 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/acpi.h"
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/paging.h"
+
+/// MADT entry types (ACPI 6.3 Section 5.2.12)
+#define MADT_LAPIC (0)
+#define MADT_IOAPIC (1)
+#define MADT_ISO (2) /** Interrupt source override */
+#define MADT_LAPIC_ADDR (5)
+#define MADT_X2APIC (9)
+#define MADT_CPU_ENABLED (1 << 0)
+
+// ISO flags
+#define MADT_ISO_POLARITY_MASK (0x3)
+#define MADT_ISO_POLARITY_LOW (0x3)
+#define MADT_ISO_TRIGGER_MASK (0xc)
+#define MADT_ISO_TRIGGER_LEVEL (0xc)
+
+struct madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    uint8_t entries[0];
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+    union {
+        struct {
+            uint8_t acpi_id;
+            uint8_t apic_id;
+            uint32_t flags;
+        } __attribute__((packed)) lapic;
+
+        struct {
+            uint8_t id;
+            uint8_t reserved;
+            uint32_t addr;
+            uint32_t gsi_base;
+        } __attribute__((packed)) ioapic;
+
+        struct {
+            uint8_t bus;
+            uint8_t source;
+            uint32_t gsi;
+            uint16_t flags;
+        } __attribute__((packed)) iso;
+
+        struct {
+            uint16_t reserved;
+            uint64_t addr;
+        } __attribute__((packed)) lapic_addr;
+
+        struct {
+            uint16_t reserved;
+            uint32_t x2apic_id;
+            uint32_t flags;
+            uint32_t acpi_uid;
+        } __attribute__((packed)) x2apic;
+    };
+} __attribute__((packed));
+
+bool apic_enabled = false;
+bool lapic_x2apic = false;
+volatile uint32_t *lapic_mmio = NULL;
+size_t apic_cpus_count = 0;
+
+static uint64_t lapic_physaddr = 0;
+
+struct ioapic {
+    volatile uint32_t *mmio;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+static struct ioapic ioapics[MAX_IOAPICS];
+static size_t ioapics_count = 0;
+
+/// ISA IRQ -> GSI, with polarity/trigger from the overrides (identity,
+/// edge-triggered, active high unless overridden)
+static uint32_t apic_isa_gsi[ISA_IRQS_COUNT];
+static uint32_t apic_isa_flags[ISA_IRQS_COUNT];
+
+uint32_t lapic_read(uint32_t reg)
+{
+    if (lapic_x2apic) {
+        return rdmsr(X2APIC_MSR(reg));
+    }
+    return lapic_mmio[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value)
+{
+    if (lapic_x2apic) {
+        wrmsr(X2APIC_MSR(reg), value);
+    } else {
+        lapic_mmio[reg / 4] = value;
+    }
+}
+
+uint32_t lapic_id()
+{
+    uint32_t id = lapic_read(LAPIC_ID);
+    return lapic_x2apic ? id : id >> 24;
+}
+
+/**
+ * Enable this CPU's local APIC, in x2APIC mode if the CPU has it.
+ */
+void lapic_init()
+{
+    uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_EN;
+    if (lapic_x2apic) {
+        base |= APIC_BASE_EXTD;
+    }
+    wrmsr(MSR_APIC_BASE, base);
+
+    // Accept everything, and set the spurious vector to get going
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+/**
+ * Send an IPI described by `icr_lo` (vector, delivery mode, ...) to the CPU
+ * with APIC ID `apic_id`, and wait for the local APIC to accept it.
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_lo)
+{
+    if (lapic_x2apic) {
+        // One 64-bit write, no delivery status to wait on
+        wrmsr(X2APIC_MSR(LAPIC_ICR_LO), ((uint64_t)apic_id << 32) | icr_lo);
+        return;
+    }
+
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr_lo);
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+static uint32_t ioapic_read(struct ioapic *ioapic, uint32_t reg)
+{
+    ioapic->mmio[IOAPIC_REGSEL / 4] = reg;
+    return ioapic->mmio[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(struct ioapic *ioapic, uint32_t reg, uint32_t value)
+{
+    ioapic->mmio[IOAPIC_REGSEL / 4] = reg;
+    ioapic->mmio[IOAPIC_WIN / 4] = value;
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi)
+{
+    for (size_t i = 0; i < ioapics_count; i++) {
+        struct ioapic *ioapic = ioapics + i;
+        if (gsi >= ioapic->gsi_base &&
+            gsi < ioapic->gsi_base + ioapic->gsi_count) {
+            return ioapic;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Deliver ISA `irq` as `vector` to the CPU with APIC ID `apic_id`, and unmask
+ * it. Returns false if no IOAPIC handles it.
+ */
+bool ioapic_route_irq(unsigned int irq, uint8_t vector, uint32_t apic_id)
+{
+    if (irq >= ISA_IRQS_COUNT) {
+        return false;
+    }
+    uint32_t gsi = apic_isa_gsi[irq];
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (ioapic == NULL) {
+        return false;
+    }
+
+    // Fixed delivery, physical destination
+    uint32_t pin = gsi - ioapic->gsi_base;
+    uint32_t lo = vector;
+    if ((apic_isa_flags[irq] & MADT_ISO_POLARITY_MASK) ==
+        MADT_ISO_POLARITY_LOW) {
+        lo |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((apic_isa_flags[irq] & MADT_ISO_TRIGGER_MASK) ==
+        MADT_ISO_TRIGGER_LEVEL) {
+        lo |= IOAPIC_LEVEL;
+    }
+    ioapic_write(ioapic, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    ioapic_write(ioapic, IOAPIC_REDTBL(pin) + 1, apic_id << 24);
+    ioapic_write(ioapic, IOAPIC_REDTBL(pin), lo);
+    return true;
+}
+
+void ioapic_mask_irq(unsigned int irq)
+{
+    if (irq >= ISA_IRQS_COUNT) {
+        return;
+    }
+    uint32_t gsi = apic_isa_gsi[irq];
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (ioapic != NULL) {
+        uint32_t reg = IOAPIC_REDTBL(gsi - ioapic->gsi_base);
+        ioapic_write(ioapic, reg, ioapic_read(ioapic, reg) | IOAPIC_MASKED);
+    }
+}
+
+static void apic_add_cpu(uint32_t apic_id)
+{
+    if (apic_cpus_count < MAX_CPUS) {
+        apic_cpu_ids[apic_cpus_count++] = apic_id;
+    }
+}
+
+static void apic_add_ioapic(uint64_t physaddr, uint32_t gsi_base)
+{
+    if (ioapics_count >= MAX_IOAPICS) {
+        return;
+    }
+    struct ioapic *ioapic = ioapics + ioapics_count;
+    ioapics_count += 1;
+    ioapic->mmio = paging_map_mmio(physaddr, PAGE_SIZE);
+    ioapic->gsi_base = gsi_base;
+    ioapic->gsi_count = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xff) + 1;
+
+    // Start with everything masked
+    for (uint32_t pin = 0; pin < ioapic->gsi_count; pin++) {
+        ioapic_write(ioapic, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    }
+}
+
+static void apic_parse_madt(struct madt *madt)
+{
+    lapic_physaddr = madt->lapic_addr;
+    for (size_t irq = 0; irq < ISA_IRQS_COUNT; irq++) {
+        apic_isa_gsi[irq] = irq;
+        apic_isa_flags[irq] = 0;
+    }
+
+    uint8_t *limit = (uint8_t *)madt + madt->header.length;
+    struct madt_entry *entry = (struct madt_entry *)madt->entries;
+    for (; (uint8_t *)entry < limit && entry->length > 0;
+         entry = (struct madt_entry *)((uint8_t *)entry + entry->length)) {
+        switch (entry->type) {
+        case MADT_LAPIC:
+            if (entry->lapic.flags & MADT_CPU_ENABLED) {
+                apic_add_cpu(entry->lapic.apic_id);
+            }
+            break;
+        case MADT_X2APIC:
+            if (entry->x2apic.flags & MADT_CPU_ENABLED) {
+                apic_add_cpu(entry->x2apic.x2apic_id);
+            }
+            break;
+        case MADT_IOAPIC:
+            apic_add_ioapic(entry->ioapic.addr, entry->ioapic.gsi_base);
+            break;
+        case MADT_ISO:
+            if (entry->iso.bus == 0 && entry->iso.source < ISA_IRQS_COUNT) {
+                apic_isa_gsi[entry->iso.source] = entry->iso.gsi;
+                apic_isa_flags[entry->iso.source] = entry->iso.flags;
+            }
+            break;
+        case MADT_LAPIC_ADDR:
+            lapic_physaddr = entry->lapic_addr.addr;
+            break;
+        }
+    }
+}
+
+/**
+ * Bring up the BSP's local APIC and every IOAPIC described by the MADT, with
+ * all IOAPIC inputs masked. Returns false (leaving the PIC in charge) if
+ * there's no MADT or no IOAPIC. Needs ACPI.
+ */
+bool apic_init()
+{
+    struct madt *madt = (struct madt *)acpi_find_table("APIC");
+    if (madt == NULL) {
+        printf("APIC: no MADT, sticking with the PIC.\n");
+        return false;
+    }
+    apic_parse_madt(madt);
+    if (ioapics_count == 0) {
+        printf("APIC: no IOAPIC, sticking with the PIC.\n");
+        return false;
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    lapic_x2apic = ecx & CPUID_ECX_X2APIC;
+    if (!lapic_x2apic) {
+        lapic_mmio = paging_map_mmio(lapic_physaddr, PAGE_SIZE);
+    }
+    lapic_init();
+    apic_enabled = true;
+
+    printf("APIC: %s, %u CPU(s), %u IOAPIC(s), BSP APIC ID %u\n",
+           lapic_x2apic ? "x2APIC" : "xAPIC", apic_cpus_count, ioapics_count,
+           lapic_id());
+    return true;
+}
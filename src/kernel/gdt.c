@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <string.h>
 #include <kernel/cpu.h>
+#include <kernel/percpu.h>
+#include <kernel/vmem.h>
 
 extern void gdt_rst(void);
 
@@ -13,6 +16,11 @@ static inline void sgdt(struct dtr *gdtr)
     __asm__ volatile("sgdt %0" : "=m"(gdtr->limit));
 }
 
+static inline void ltr(uint16_t selector)
+{
+    __asm__ volatile("ltr %0" : : "r"(selector));
+}
+
 void set_gen_segment_desc(size_t index, uint32_t base, uint32_t limit,
                           uint8_t type, uint8_t s, uint8_t dpl, uint8_t p,
                           uint8_t avl, uint8_t db, uint8_t g)
@@ -76,19 +84,89 @@ void set_data_segment_desc(size_t index, uint32_t base, uint32_t limit,
     entry->g = g & 1;
 }
 
+/**
+ * Write a 64-bit TSS descriptor for `tss` into `table[index]`. It's a system
+ * descriptor, so it takes up two slots.
+ * AMD64 APM p.90
+ */
+static void set_tss_desc(struct gen_seg_desc *table, size_t index,
+                         struct tss *tss)
+{
+    uint64_t base = (uint64_t)tss;
+    uint32_t limit = sizeof(*tss) - 1;
+    struct gen_seg_desc *entry = table + index;
+    entry->base_lo = base & 0xffff;
+    entry->base_mid = (base >> 16u) & 0xff;
+    entry->base_hi = (base >> 24u) & 0xff;
+    entry->limit_lo = limit & 0xffff;
+    entry->limit_hi_gran = (limit >> 16u) & 0x0f;
+    entry->access = (1u << 7u) | TSS_TYPE_AVAILABLE; // Present, DPL 0
+    // Upper half: base[63:32], then reserved
+    uint32_t *upper = (uint32_t *)(table + index + 1);
+    upper[0] = base >> 32u;
+    upper[1] = 0;
+}
+
+/**
+ * Give `tss` its interrupt stacks. They're populated up front, since they're
+ * exactly what we run on when the usual stack can't take a fault.
+ */
+void tss_init(struct tss *tss)
+{
+    memset(tss, 0, sizeof(*tss));
+    tss->iomap_base = sizeof(*tss); // No I/O permission bitmap
+    for (size_t i = 0; i < IST_STACKS; i++) {
+        void *top = vmem_alloc_stack(IST_STACK_SIZE);
+        vmem_populate(top, IST_STACK_SIZE);
+        tss->ist[i] = (uint64_t)top;
+    }
+}
+
+void tss_free(struct tss *tss)
+{
+    for (size_t i = 0; i < IST_STACKS; i++) {
+        if (tss->ist[i] != 0) {
+            vmem_free((void *)tss->ist[i]);
+            tss->ist[i] = 0;
+        }
+    }
+}
+
+/**
+ * Copy the GDT built by gdt_init into `table` (this CPU's own copy), add a
+ * descriptor for this CPU's `tss`, load both and reload the segment
+ * registers.
+ */
+void gdt_load(struct gen_seg_desc *table, struct tss *tss)
+{
+    memcpy(table, gdt, sizeof(gdt));
+    set_tss_desc(table, GDT_TSS_INDEX, tss);
+
+    struct dtr gdtr = {
+        .limit = (sizeof(struct gen_seg_desc) * GDT_ENTRIES_COUNT) - 1,
+        .base = (uint64_t)table,
+    };
+    lgdt(&gdtr);
+
+    gdt_rst();
+    ltr(GDT_TSS_SELECTOR);
+}
+
 void gdt_init()
 {
     set_gen_segment_desc(0, 0, 0, 0, 0, 0, 0, 0, 0, 0); // null segment
     set_code_segment_desc(1, 0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0);
     set_data_segment_desc(2, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0);
+    // GDT_TSS_INDEX is filled in per CPU by gdt_load
+
+    struct percpu *cpu = this_cpu();
+    tss_init(&cpu->tss);
 
     struct dtr gdtr = {
         .limit = (sizeof(struct gen_seg_desc) * GDT_ENTRIES_COUNT) - 1,
-        .base = (uint64_t)&gdt[0],
+        .base = (uint64_t)cpu->gdt,
     };
-    lgdt(&gdtr);
-
-    gdt_rst();
+    gdt_load(cpu->gdt, &cpu->tss);
 
     // Check loaded GDTR
     struct dtr loaded_gdtr = {
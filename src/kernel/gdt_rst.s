@@ -5,8 +5,8 @@ gdt_rst:
     mov $0x10, %ax
     mov %ax, %ds
     mov %ax, %es
-    mov %ax, %fs
-    mov %ax, %gs
+    # Leave %fs/%gs alone: loading a selector zeroes the hidden base, and GS
+    # base points at this CPU's percpu area
     mov %ax, %ss
     sub $16, %rsp
     movq $8, 8(%rsp)
@@ -11,13 +11,13 @@ static inline void sidt(struct dtr *idtr)
     __asm__ volatile("sidt %0" : "=m"(idtr->limit));
 }
 
-void set_interrupt_desc(size_t index, uint64_t base)
+void set_interrupt_desc(size_t index, uint64_t base, uint8_t ist)
 {
     struct gate_desc *entry = &idt[index];
     entry->offset_lo = (base >> 0u) & 0xffff;
     entry->offset_hi = (base >> 16u) & 0xffffffffffffll;
     entry->selector = IDT_CODE_SEGMENT;
-    entry->ist = 0; // Legacy stack-switching mechanism
+    entry->ist = ist & 0x7; // 0 keeps the legacy stack-switching mechanism
     entry->reserved_1 = 0;
     entry->type = SSDT_INTERRUPT_GATE;
     entry->zero = 0;
@@ -26,13 +26,26 @@ void set_interrupt_desc(size_t index, uint64_t base)
     entry->reserved_2 = 0;
 }
 
-void idt_init()
+/**
+ * Point this CPU at the IDT. There's only one, shared by every CPU: it's
+ * never written after interrupts_init.
+ */
+void idt_load()
 {
     struct dtr idtr = {
         .limit = ((sizeof(struct gate_desc)) * IDT_ENTRIES_COUNT - 1) & 0xffff,
         .base = idt,
     };
     lidt(&idtr);
+}
+
+void idt_init()
+{
+    struct dtr idtr = {
+        .limit = ((sizeof(struct gate_desc)) * IDT_ENTRIES_COUNT - 1) & 0xffff,
+        .base = idt,
+    };
+    idt_load();
 
     // Check loaded IDTR
     struct dtr loaded_idtr = {
@@ -1,65 +1,285 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include "kernel/apic.h"
 #include "kernel/cpu.h"
 #include "kernel/interrupts.h"
+#include "kernel/paging.h"
+#include "kernel/percpu.h"
 #include "kernel/pic.h"
+#include "kernel/printk.h"
+#include "kernel/profile.h"
+#include "kernel/sched.h"
+#include "kernel/softirq.h"
+#include "kernel/spinlock.h"
+#include "kernel/static_key.h"
+#include "kernel/trace.h"
+#include "kernel/vmem.h"
+#include "kernel/workqueue.h"
 #include "kernel/colours.h"
 
 #define IDT_DEFAULT_ISR_HANDLER(n)                                             \
     extern void isr##n(void);                                                  \
-    set_interrupt_desc(n, isr##n);
+    set_interrupt_desc(n, isr##n, IST_NONE);
 
-extern void isr_systick(void);
-extern void isr_stub(void);
-extern void keyboard_irq_handler(void);
+/// For exceptions that mustn't trust the stack they interrupted
+#define IDT_IST_ISR_HANDLER(n, ist)                                            \
+    extern void isr##n(void);                                                  \
+    set_interrupt_desc(n, isr##n, ist);
+
+#define ISR_IRQ_STUB_SIZE (16) /** Must match isr.s */
+
+extern uint8_t isr_irq_stubs[];
+extern void isr_spurious(void);
+
+struct irq_entry {
+    irq_handler_t handler;
+    void *ctx;
+};
+
+static struct irq_entry irq_table[IDT_ENTRIES_COUNT];
+static struct spinlock irq_table_lock;
+
+/// Innermost IRQ each CPU is handling, see irq_current_frame
+static struct irq_frame *irq_frames[MAX_CPUS];
+
+/// Hits on vectors nobody registered, reported later by irq_unhandled_work
+static uint32_t irq_unhandled[IDT_ENTRIES_COUNT];
+static struct work irq_unhandled_work;
+
+/**
+ * Acknowledge interrupt `int_no` at whichever controller is in charge.
+ */
+void irq_eoi(unsigned int int_no)
+{
+    if (apic_enabled) {
+        lapic_eoi();
+    } else {
+        pic_eoi(int_no);
+    }
+}
+
+static void exc_divide_error(struct interrupt_frame *frame)
+{
+    panic("divide-by-zero, rip 0x%x\n", frame->rip);
+}
+
+static void exc_nmi(struct interrupt_frame *frame)
+{
+    // NMIs that arrive while we're in here collapse into one, so ask
+    // everyone who might have sent one
+    bool handled = paging_shootdown_nmi();
+    handled |= profile_nmi(frame);
+    if (handled) {
+        return;
+    }
+    printf(BG_BIANCO(FG_ROSSO(" NMI ")) " on CPU %u, rip 0x%x\n",
+           (uint64_t)this_cpu_id(), frame->rip);
+}
+
+/// Breakpoints are ignored, unless they're a static key being patched
+static void exc_breakpoint(struct interrupt_frame *frame)
+{
+    static_key_int3(frame);
+}
+
+static void exc_invalid_opcode(struct interrupt_frame *frame)
+{
+    panic("invalid opcode, rip 0x%x\n", frame->rip);
+}
+
+/**
+ * Runs on IST_DOUBLE_FAULT, so a stack overflow (the #PF for the guard page
+ * can't be delivered on the same stack) ends up here rather than in a triple
+ * fault.
+ */
+static void exc_double_fault(struct interrupt_frame *frame)
+{
+    printk(PRINTK_EMERG,
+           BG_BIANCO(FG_ROSSO(" FAULT ")) " Double fault (0x%x) on CPU %u, "
+                                          "rip 0x%x rsp 0x%x\n",
+           frame->err_code, (uint64_t)this_cpu_id(), frame->rip, frame->rsp);
+    vmem_report_fault(frame->rsp);
+    panic("double fault\n");
+}
+
+static void exc_machine_check(struct interrupt_frame *frame)
+{
+    panic("machine check, rip 0x%x\n", frame->rip);
+}
+
+static void exc_general_protection(struct interrupt_frame *frame)
+{
+    panic("general protection fault (0x%x), rip 0x%x\n", frame->err_code,
+          frame->rip);
+}
+
+static void exc_page_fault(struct interrupt_frame *frame)
+{
+    uint64_t faultaddr = read_cr2();
+    if (vmem_handle_fault(faultaddr, frame->err_code)) {
+        return;
+    }
+    printk(PRINTK_EMERG,
+           BG_BIANCO(FG_ROSSO(" FAULT ")) " Page fault at 0x%x (%s, %s%s) "
+                                          "rip 0x%x\n",
+           faultaddr,
+           (frame->err_code & PF_PRESENT) ? "protection" : "not present",
+           (frame->err_code & PF_WRITE) ? "write" : "read",
+           (frame->err_code & PF_IFETCH) ? ", ifetch" : "", frame->rip);
+    vmem_report_fault(faultaddr);
+    panic("page fault\n");
+}
+
+/// Exceptions without a handler are ignored
+static void (*const exception_handlers[32])(struct interrupt_frame *) = {
+    [0] = exc_divide_error,        // #DE
+    [2] = exc_nmi,                 // NMI
+    [3] = exc_breakpoint,          // #BP
+    [6] = exc_invalid_opcode,      // #UD
+    [8] = exc_double_fault,        // #DF
+    [13] = exc_general_protection, // #GP
+    [14] = exc_page_fault,         // #PF
+    [18] = exc_machine_check,      // #MC
+};
 
 /**
- * Generic ISR.
- * TODO: Use separate ISRs instead of single ISR + branching.
+ * Common entry for exceptions, from isr_exception_common.
  */
-void isr_handler(struct interrupt_frame *frame)
-{
-    switch (frame->int_no) {
-    case 0: // #DE
-        printf(BG_BIANCO(FG_ROSSO(" FAULT ")) " Divide-by-zero\n");
-        break;
-    case 6: // #UD (Invalid Opcode)
-        printf(BG_BIANCO(FG_ROSSO(" FAULT ")) " Invalid opcode\n");
-        break;
-    case 8: // #DF (Double Fault)
-        printf(BG_BIANCO(FG_ROSSO(" FAULT ")) " Double fault (0x%x)",
-               frame->err_code);
-        __asm__ volatile("1: jmp 1b");
-        break;
-    case 13: // #GP (General Protection Fault)
-        printf(
-            BG_BIANCO(FG_ROSSO(" FAULT ")) " General protection fault (0x%x)\n",
-            frame->err_code);
-        break;
-    case 14: // #PF (Page Fault)
-        printf(BG_BIANCO(FG_ROSSO(" FAULT ")) " Page fault (0x%x)\n",
-               frame->err_code);
-        break;
-    case 33: // 0x21
-        keyboard_irq_handler();
-        break;
+void exception_dispatch(struct interrupt_frame *frame)
+{
+    void (*handler)(struct interrupt_frame *) =
+        exception_handlers[frame->int_no];
+    if (handler != NULL) {
+        handler(frame);
+    }
+}
+
+/**
+ * Common entry for vectors IRQ_BASE and up, from isr_irq_common. The EOI goes
+ * out after the handler but before softirqs and sched_irq_exit, which may
+ * switch threads.
+ */
+void irq_dispatch(uint64_t vector, struct irq_frame *frame)
+{
+    struct irq_frame **current = irq_frames + this_cpu_id();
+    struct irq_frame *outer = *current;
+    *current = frame;
+
+    struct irq_entry *entry = irq_table + vector;
+    trace_begin("irq");
+    if (entry->handler != NULL) {
+        entry->handler(vector, entry->ctx);
+    } else {
+        // No printing in here, a worker does that
+        __atomic_fetch_add(irq_unhandled + vector, 1, __ATOMIC_RELAXED);
+        work_queue(&irq_unhandled_work);
+    }
+
+    trace_end("irq");
+
+    // Only once the handler has dealt with the device, or a level-triggered
+    // line fires again straight away. `int` doesn't set an in-service bit, so
+    // there's nothing to acknowledge for the benchmark vector.
+    if (vector != IRQ_BENCH_VECTOR) {
+        irq_eoi(vector);
+    }
+
+    // Softirqs and thread switches aren't part of this IRQ's handler
+    *current = outer;
+    softirq_run();
+    sched_irq_exit();
+}
+
+/**
+ * Registers of whatever the IRQ being handled on this CPU interrupted, or NULL
+ * outside IRQ handlers.
+ */
+struct irq_frame *irq_current_frame()
+{
+    return irq_frames[this_cpu_id()];
+}
+
+static void irq_report_unhandled(void *arg)
+{
+    (void)arg;
+    for (size_t vector = IRQ_BASE; vector < IDT_ENTRIES_COUNT; vector++) {
+        uint32_t count =
+            __atomic_exchange_n(irq_unhandled + vector, 0, __ATOMIC_RELAXED);
+        if (count != 0) {
+            printf("Unhandled interrupt 0x%x (%u times)\n", (uint64_t)vector,
+                   (uint64_t)count);
+        }
+    }
+}
+
+/**
+ * Call `handler(vector, ctx)` whenever `vector` fires. Returns false if the
+ * vector isn't an IRQ vector or is already taken.
+ */
+bool irq_register(unsigned int vector, irq_handler_t handler, void *ctx)
+{
+    if (vector < IRQ_BASE || vector >= IDT_ENTRIES_COUNT ||
+        vector == APIC_SPURIOUS_VECTOR) {
+        return false;
     }
 
-    // Send an EOI iff (!!) this ISR was triggered by an IRQ
-    // IRQ 0-7 from PIC1 = [0x20, 0x28)
-    // IRQ 8-15 from PIC2 = [0x28, 0x30)
-    if (frame->int_no >= 0x20 && frame->int_no < 0x30) {
-        pic_eoi(frame->int_no);
+    bool ok = false;
+    uint64_t flags = spin_lock_irqsave(&irq_table_lock);
+    if (irq_table[vector].handler == NULL) {
+        irq_table[vector].ctx = ctx;
+        __atomic_store_n(&irq_table[vector].handler, handler,
+                         __ATOMIC_RELEASE);
+        ok = true;
     }
+    spin_unlock_irqrestore(&irq_table_lock, flags);
+    return ok;
+}
+
+void irq_unregister(unsigned int vector)
+{
+    if (vector >= IRQ_BASE && vector < IDT_ENTRIES_COUNT) {
+        uint64_t flags = spin_lock_irqsave(&irq_table_lock);
+        __atomic_store_n(&irq_table[vector].handler, NULL, __ATOMIC_RELEASE);
+        spin_unlock_irqrestore(&irq_table_lock, flags);
+    }
+}
+
+static void irq_bench_handler(unsigned int vector, void *ctx)
+{
+    (void)vector;
+    (*(volatile uint64_t *)ctx) += 1;
 }
 
 /**
- * Stub handler.
+ * Time a round trip through the lean IRQ path against the full exception
+ * path (int3, whose handler only checks for static key patching), in TSC
+ * cycles.
  */
-void isr_stub_handler(struct interrupt_frame *frame)
+void irq_benchmark()
 {
-    printf("IRQ stub handler called! (int_no: 0x%x)\n", frame->int_no);
+    volatile uint64_t hits = 0;
+    if (!irq_register(IRQ_BENCH_VECTOR, irq_bench_handler, (void *)&hits)) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < IRQ_BENCH_ROUNDS; i++) {
+        __asm__ volatile("int %0" ::"i"(IRQ_BENCH_VECTOR) : "memory");
+    }
+    uint64_t irq_cycles = (rdtsc() - start) / IRQ_BENCH_ROUNDS;
+
+    start = rdtsc();
+    for (size_t i = 0; i < IRQ_BENCH_ROUNDS; i++) {
+        __asm__ volatile("int3" ::: "memory");
+    }
+    uint64_t exception_cycles = (rdtsc() - start) / IRQ_BENCH_ROUNDS;
+    irq_restore(flags);
+
+    irq_unregister(IRQ_BENCH_VECTOR);
+    printf("IRQ entry/exit: %u cycles (caller-saved), %u cycles (full frame)\n",
+           irq_cycles, exception_cycles);
 }
 
 void interrupts_init()
@@ -68,20 +288,22 @@ void interrupts_init()
     for (size_t i = 0; i < IDT_ENTRIES_COUNT; i++)
         memset(&idt[i], 0, sizeof(struct gate_desc));
 
-    // Remap PIC, leaves all IRQs masked.
+    // Remap PIC, leaves all IRQs masked. With APICs, it stays that way.
     pic_remap();
 
+    work_init(&irq_unhandled_work, irq_report_unhandled, NULL);
+
     // Intel-reserved interrupts
     printf("Installing ISRs...\n");
     IDT_DEFAULT_ISR_HANDLER(0); // #DE (Div-by-zero)
     IDT_DEFAULT_ISR_HANDLER(1); // #DB (Debug trap)
-    IDT_DEFAULT_ISR_HANDLER(2); // NMI
+    IDT_IST_ISR_HANDLER(2, IST_NMI); // NMI
     IDT_DEFAULT_ISR_HANDLER(3); // #BP (Breakpoint)
     IDT_DEFAULT_ISR_HANDLER(4); // #OF (Overflow)
     IDT_DEFAULT_ISR_HANDLER(5); // #BR (Out-of-bounds)
     IDT_DEFAULT_ISR_HANDLER(6); // #UD (Undefined instruction)
     IDT_DEFAULT_ISR_HANDLER(7); // #NM (Device not available)
-    IDT_DEFAULT_ISR_HANDLER(8); // #DF (Double Fault)
+    IDT_IST_ISR_HANDLER(8, IST_DOUBLE_FAULT); // #DF (Double Fault)
     IDT_DEFAULT_ISR_HANDLER(9);
     IDT_DEFAULT_ISR_HANDLER(10);
     IDT_DEFAULT_ISR_HANDLER(11);
@@ -91,7 +313,7 @@ void interrupts_init()
     IDT_DEFAULT_ISR_HANDLER(15);
     IDT_DEFAULT_ISR_HANDLER(16);
     IDT_DEFAULT_ISR_HANDLER(17);
-    IDT_DEFAULT_ISR_HANDLER(18);
+    IDT_IST_ISR_HANDLER(18, IST_MACHINE_CHECK); // #MC (Machine check)
     IDT_DEFAULT_ISR_HANDLER(19);
     IDT_DEFAULT_ISR_HANDLER(20);
     IDT_DEFAULT_ISR_HANDLER(21);
@@ -105,16 +327,22 @@ void interrupts_init()
     IDT_DEFAULT_ISR_HANDLER(29);
     IDT_DEFAULT_ISR_HANDLER(30);
     IDT_DEFAULT_ISR_HANDLER(31);
-    set_interrupt_desc(32, isr_systick); // IRQ0: Timer
-    IDT_DEFAULT_ISR_HANDLER(33); // IRQ1: PS/2 Keyboard
 
-    // Redirect the rest of the IDT entries to the isr stub handler as a sane default
-    for (size_t i = 34; i < 256; i++) {
-        set_interrupt_desc(i, isr_stub);
+    // IRQs and IPIs all get their own stub, see irq_register
+    for (size_t i = IRQ_BASE; i < IDT_ENTRIES_COUNT; i++) {
+        set_interrupt_desc(
+            i, (uint64_t)(isr_irq_stubs + (i - IRQ_BASE) * ISR_IRQ_STUB_SIZE),
+            IST_NONE);
     }
+    set_interrupt_desc(APIC_SPURIOUS_VECTOR, (uint64_t)isr_spurious, IST_NONE);
 
-    // Unmask the hardware IRQs we want to know about
-    pic_enable_all_irqs();
+    // Unmask the hardware IRQs we want to know about, sending them to the BSP.
+    // The PIT (IRQ0) is left to timer_init, it's only needed without an APIC.
+    if (apic_init()) {
+        ioapic_route_irq(1, IRQ_BASE + 1, lapic_id());
+    } else {
+        pic_irq_on(1);
+    }
 
     idt_init();
 }
@@ -1,12 +1,12 @@
 .align 4
 .code64
 .section .text
+# All GPRs but %rsp, which the CPU saved for us already
 .macro PUSHA
     push %rax
     push %rcx
     push %rdx
     push %rbx
-    push %rsp
     push %rbp
     push %rsi
     push %rdi
@@ -32,30 +32,21 @@
     pop %rdi
     pop %rsi
     pop %rbp
-    pop %rsp
     pop %rbx
     pop %rdx
     pop %rcx
     pop %rax
 .endm
 
+###############################################################################
+#   Exceptions (vectors 0-31): full register frame for exception_dispatch     #
+###############################################################################
 .macro ISR_WRAPPER int_no
     .global isr\int_no
     isr\int_no:
         push $0             # Push a dummy err code so we can use the same interrupt frame struct
         push $\int_no       # Interrupt number
-        PUSHA
-
-        # SysV ABI: Clear the string direction flag on interrupt
-        cld
-
-        # Call the generic ISR
-        mov %rsp, %rdi      # 1st arg <- sp (pointer to interrupt frame)
-        call isr_handler
-
-        POPA
-        add $16, %rsp       # We also pushed: dummy err code, interrupt number
-        iretq
+        jmp isr_exception_common
 .endm
 
 .macro ISR_WRAPPER_WITH_ERR int_no
@@ -63,39 +54,20 @@
     isr\int_no\():
         # !!! CPU pushes an error code here !!!
         push $\int_no       # int_no
-        PUSHA
-
-        # SysV ABI: Clear the string direction flag on interrupt
-        cld
-
-        mov %rsp, %rdi      # 1st arg <- sp (pointer to interrupt frame)
-        call isr_handler
-
-        POPA
-        add $16, %rsp       # The processor pushed an err code, we pushed an interrupt number
-        iretq
+        jmp isr_exception_common
 .endm
 
-.global isr_systick
-isr_systick:
-    # Systick is IRQ0, so send an EOI (¡muy importante!)
-    mov $0x20, %rdi
-    call pic_eoi
-    iretq
-
-.global isr_stub
-isr_stub:
-    push $0xff              # dummy err code
-    push $0xff              # dummy int_no
+isr_exception_common:
     PUSHA
 
+    # SysV ABI: Clear the string direction flag on interrupt
     cld
 
-    mov %rsp, %rdi
-    call isr_stub_handler
+    mov %rsp, %rdi          # 1st arg <- sp (pointer to interrupt frame)
+    call exception_dispatch
 
     POPA
-    add $16, %rsp
+    add $16, %rsp           # err code (ours or the CPU's), interrupt number
     iretq
 
 ISR_WRAPPER 0
@@ -130,4 +102,58 @@ ISR_WRAPPER 28
 ISR_WRAPPER 29
 ISR_WRAPPER 30
 ISR_WRAPPER 31
-ISR_WRAPPER 33              # IRQ1
+
+###############################################################################
+#   IRQs and IPIs (vectors 32-255): caller-saved registers only              #
+###############################################################################
+# One stub per vector, ISR_IRQ_STUB_SIZE bytes apart starting at
+# isr_irq_stubs, that pushes its vector for irq_dispatch. Handlers are plain C
+# functions, so the callee-saved registers are theirs to preserve (and a
+# thread switch on the way out saves them too).
+.set ISR_IRQ_STUB_SIZE, 16
+.global isr_irq_stubs
+.align ISR_IRQ_STUB_SIZE
+isr_irq_stubs:
+.set vector, 32
+.rept 256 - 32
+    .align ISR_IRQ_STUB_SIZE
+    push $vector
+    jmp isr_irq_common
+    .set vector, vector + 1
+.endr
+
+isr_irq_common:
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+    push %rbp               # For stack walks, also keeps the call 16-byte aligned
+
+    cld
+
+    mov 80(%rsp), %rdi      # 1st arg <- vector
+    mov %rsp, %rsi          # 2nd arg <- struct irq_frame
+    call irq_dispatch
+
+    pop %rbp
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    add $8, %rsp            # Vector
+    iretq
+
+# APIC spurious interrupt: nothing to do, and no EOI either
+.global isr_spurious
+isr_spurious:
+    iretq
@@ -3,10 +3,18 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <ringbuf.h>
+#include <kernel/interrupts.h>
 #include <kernel/io.h>
 #include <kernel/keyboard.h>
+#include <kernel/terminal.h>
+#include <kernel/softirq.h>
+#include <kernel/workqueue.h>
 
 #define KB_SCAN2_BREAK (0xf0) /* TODO: Put in keycode map */
+#define KB_SCAN2_EXTENDED (0xe0)
+#define KB_SCAN2_EXT_PGUP (0x7d) /* After KB_SCAN2_EXTENDED */
+#define KB_SCAN2_EXT_PGDN (0x7a)
+#define KB_SCROLLBACK_LINES (16) /* Per PgUp/PgDn */
 
 #define KB_NUL (0)
 #define KB_FKEYS (0x100)
@@ -82,21 +90,64 @@ static uint32_t kb_ps2_scancode2_shift[] = {
     KB_NUL, KB_NUL, KB_F7
 };
 
-static struct u8_ringbuf keybuf;
-static struct u8_ringbuf *kbuf = &keybuf;
+#define KB_RING_SIZE (256)
+
+/// Raw scancodes from the IRQ, waiting for the softirq to decode them. Both
+/// run on the CPU IRQ1 is routed to.
+static uint8_t scan_storage[KB_RING_SIZE];
+static struct spsc_ring scan_ring;
+/// Decoded characters, waiting for keyboard_work to echo them on that CPU
+static uint8_t key_storage[KB_RING_SIZE];
+static struct spsc_ring key_ring;
+
+static struct work keyboard_work;
 
 static volatile bool break_next = false;
+static volatile bool extended_next = false;
 static volatile bool shift_next = false;
 static volatile bool caps_lock = false;
 
-void keyboard_irq_handler()
+/**
+ * Hard IRQ: just grab the scancode and leave the rest to the softirq.
+ */
+static void keyboard_irq_handler(unsigned int vector, void *ctx)
 {
+    (void)vector;
+    (void)ctx;
     uint8_t code = inb(PS2_PORT_DATA);
+    spsc_ring_push(&scan_ring, &code);
+    softirq_raise(SOFTIRQ_INPUT);
+}
 
+static void keyboard_push(uint8_t c)
+{
+    spsc_ring_push(&key_ring, &c);
+    work_queue(&keyboard_work);
+}
+
+static void keyboard_decode(uint8_t code)
+{
     if (code == KB_SCAN2_BREAK) {
         break_next = true;
         goto done;
     }
+    if (code == KB_SCAN2_EXTENDED) {
+        extended_next = true;
+        goto done;
+    }
+
+    // PgUp/PgDn page through the terminal's scrollback
+    if (extended_next) {
+        extended_next = false;
+        if (code == KB_SCAN2_EXT_PGUP || code == KB_SCAN2_EXT_PGDN) {
+            if (!break_next) {
+                terminal_view_scroll(code == KB_SCAN2_EXT_PGUP ?
+                                         KB_SCROLLBACK_LINES :
+                                         -KB_SCROLLBACK_LINES);
+            }
+            goto input_finished;
+        }
+    }
 
     // Check OOB
     if (code * sizeof(*kb_ps2_scancode2) > sizeof(kb_ps2_scancode2)) {
@@ -127,7 +178,7 @@ void keyboard_irq_handler()
     }
 
     if (key == KB_ENTER && !break_next) {
-        u8_rb_fifo_push(kbuf, '\n');
+        keyboard_push('\n');
         goto input_finished;
     }
 
@@ -138,7 +189,7 @@ void keyboard_irq_handler()
             key -= 0x20;
         }
         if (!break_next) {
-            u8_rb_fifo_push(kbuf, key & 0xff);
+            keyboard_push(key & 0xff);
         }
         goto input_finished;
     }
@@ -152,6 +203,35 @@ done:
     return;
 }
 
+/**
+ * Softirq: decode whatever the IRQ queued up, then hand the characters to a
+ * worker.
+ */
+static void keyboard_softirq()
+{
+    uint8_t code;
+    while (spsc_ring_pop(&scan_ring, &code)) {
+        keyboard_decode(code);
+    }
+}
+
+/**
+ * Worker: echo typed characters. Printing can be slow, keep it out of
+ * interrupt context.
+ */
+static void keyboard_echo(void *arg)
+{
+    (void)arg;
+    uint8_t chars[32];
+    size_t n;
+    while ((n = spsc_ring_pop_bulk(&key_ring, chars, sizeof(chars))) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            putchar(chars[i]);
+        }
+        terminal_flush();
+    }
+}
+
 static void ps2_wait_write(uint16_t port, uint8_t data)
 {
     uint8_t ret;
@@ -181,7 +261,11 @@ static void ps2_flush_output()
 
 void keyboard_init()
 {
-    u8_rb_fifo_init(kbuf);
+    spsc_ring_init(&scan_ring, scan_storage, 1, KB_RING_SIZE);
+    spsc_ring_init(&key_ring, key_storage, 1, KB_RING_SIZE);
+    work_init(&keyboard_work, keyboard_echo, NULL);
+    softirq_register(SOFTIRQ_INPUT, keyboard_softirq);
+    irq_register(IRQ_BASE + 1, keyboard_irq_handler, NULL);
 
     // 8042 initialisation
     uint8_t ret;
@@ -280,10 +364,3 @@ void keyboard_init()
 
     printf("Initialised keyboard.\n");
 }
-
-void keyboard_main()
-{
-    while (u8_rb_fifo_has_data(kbuf)) {
-        putchar(u8_rb_fifo_pop(kbuf));
-    }
-}
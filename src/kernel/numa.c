@@ -0,0 +1,240 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algo.h>
+#include "kernel/acpi.h"
+#include "kernel/cpu.h"
+#include "kernel/numa.h"
+#include "kernel/pmem.h"
+
+/// SRAT entry types (ACPI 6.3 Section 5.2.16)
+#define SRAT_LAPIC_AFFINITY (0)
+#define SRAT_MEMORY_AFFINITY (1)
+#define SRAT_X2APIC_AFFINITY (2)
+#define SRAT_ENABLED (1 << 0)
+
+struct srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    uint8_t entries[0];
+} __attribute__((packed));
+
+struct srat_entry {
+    uint8_t type;
+    uint8_t length;
+    union {
+        struct {
+            uint8_t domain_lo;
+            uint8_t apic_id;
+            uint32_t flags;
+            uint8_t sapic_eid;
+            uint8_t domain_hi[3];
+            uint32_t clock_domain;
+        } __attribute__((packed)) lapic;
+
+        struct {
+            uint32_t domain;
+            uint16_t reserved0;
+            uint64_t base;
+            uint64_t length;
+            uint32_t reserved1;
+            uint32_t flags;
+            uint64_t reserved2;
+        } __attribute__((packed)) memory;
+
+        struct {
+            uint16_t reserved0;
+            uint32_t domain;
+            uint32_t x2apic_id;
+            uint32_t flags;
+            uint32_t clock_domain;
+            uint32_t reserved1;
+        } __attribute__((packed)) x2apic;
+    };
+} __attribute__((packed));
+
+struct slit {
+    struct acpi_sdt_header header;
+    uint64_t localities;
+    uint8_t distances[0]; /** localities * localities, by proximity domain */
+} __attribute__((packed));
+
+size_t numa_mem_ranges_count = 0;
+size_t numa_nodes_count = 1;
+
+// ACPI proximity domain of each node
+static uint32_t numa_node_domain[NUMA_MAX_NODES];
+static uint8_t numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+struct numa_cpu {
+    uint32_t apic_id;
+    uint32_t node;
+};
+static struct numa_cpu numa_cpus[NUMA_MAX_CPUS];
+static size_t numa_cpus_count = 0;
+
+/**
+ * Node for ACPI proximity `domain`, allocating a new one if we haven't seen it.
+ */
+static unsigned int numa_domain_node(uint32_t domain)
+{
+    for (size_t i = 0; i < numa_nodes_count; i++) {
+        if (numa_node_domain[i] == domain) {
+            return i;
+        }
+    }
+    if (numa_nodes_count >= NUMA_MAX_NODES) {
+        printf("NUMA: too many nodes, folding domain %u into node 0\n",
+               domain);
+        return 0;
+    }
+    numa_node_domain[numa_nodes_count] = domain;
+    return numa_nodes_count++;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    if (numa_cpus_count >= NUMA_MAX_CPUS) {
+        return;
+    }
+    numa_cpus[numa_cpus_count].apic_id = apic_id;
+    numa_cpus[numa_cpus_count].node = numa_domain_node(domain);
+    numa_cpus_count += 1;
+}
+
+static int numa_range_cmp(const void *pa, const void *pb)
+{
+    const struct numa_mem_range *a = pa;
+    const struct numa_mem_range *b = pb;
+    if (a->base > b->base) {
+        return 1;
+    } else if (a->base < b->base) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+static void numa_parse_srat(struct srat *srat)
+{
+    uint8_t *limit = (uint8_t *)srat + srat->header.length;
+    struct srat_entry *entry = (struct srat_entry *)srat->entries;
+    for (; (uint8_t *)entry < limit && entry->length > 0;
+         entry = (struct srat_entry *)((uint8_t *)entry + entry->length)) {
+        switch (entry->type) {
+        case SRAT_LAPIC_AFFINITY:
+            if (entry->lapic.flags & SRAT_ENABLED) {
+                uint32_t domain = entry->lapic.domain_lo |
+                                  (entry->lapic.domain_hi[0] << 8) |
+                                  (entry->lapic.domain_hi[1] << 16) |
+                                  (entry->lapic.domain_hi[2] << 24);
+                numa_add_cpu(entry->lapic.apic_id, domain);
+            }
+            break;
+        case SRAT_X2APIC_AFFINITY:
+            if (entry->x2apic.flags & SRAT_ENABLED) {
+                numa_add_cpu(entry->x2apic.x2apic_id, entry->x2apic.domain);
+            }
+            break;
+        case SRAT_MEMORY_AFFINITY:
+            if (!(entry->memory.flags & SRAT_ENABLED) ||
+                entry->memory.length == 0 ||
+                numa_mem_ranges_count >= NUMA_MAX_RANGES) {
+                break;
+            }
+            struct numa_mem_range *range =
+                numa_mem_ranges + numa_mem_ranges_count;
+            numa_mem_ranges_count += 1;
+            range->base = entry->memory.base;
+            range->limit = entry->memory.base + entry->memory.length;
+            range->node = numa_domain_node(entry->memory.domain);
+            break;
+        }
+    }
+
+    qsort(numa_mem_ranges, numa_mem_ranges_count, sizeof(*numa_mem_ranges),
+          numa_range_cmp);
+}
+
+static void numa_parse_slit(struct slit *slit)
+{
+    for (size_t from = 0; from < numa_nodes_count; from++) {
+        for (size_t to = 0; to < numa_nodes_count; to++) {
+            uint64_t i = numa_node_domain[from];
+            uint64_t j = numa_node_domain[to];
+            if (i < slit->localities && j < slit->localities) {
+                numa_distances[from][to] =
+                    slit->distances[i * slit->localities + j];
+            }
+        }
+    }
+}
+
+/**
+ * Relative distance between two nodes, as in the SLIT (10 = local).
+ */
+uint8_t numa_distance(unsigned int from, unsigned int to)
+{
+    if (from >= numa_nodes_count || to >= numa_nodes_count) {
+        return NUMA_REMOTE_DISTANCE;
+    }
+    return numa_distances[from][to];
+}
+
+/**
+ * Node of the CPU with local (x2)APIC ID `apic_id`. Defaults to node 0.
+ */
+unsigned int numa_apic_node(uint32_t apic_id)
+{
+    for (size_t i = 0; i < numa_cpus_count; i++) {
+        if (numa_cpus[i].apic_id == apic_id) {
+            return numa_cpus[i].node;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the memory and CPU topology from the SRAT (and SLIT, if there is one)
+ * and hand it to the physical memory manager. Without an SRAT everything is
+ * on node 0. Needs ACPI.
+ */
+void numa_init()
+{
+    numa_node_domain[0] = 0;
+    numa_nodes_count = 0;
+    struct srat *srat = (struct srat *)acpi_find_table("SRAT");
+    if (srat != NULL) {
+        numa_parse_srat(srat);
+    }
+    if (numa_nodes_count == 0) {
+        numa_nodes_count = 1;
+    }
+
+    for (size_t from = 0; from < NUMA_MAX_NODES; from++) {
+        for (size_t to = 0; to < NUMA_MAX_NODES; to++) {
+            numa_distances[from][to] =
+                from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+    struct slit *slit = (struct slit *)acpi_find_table("SLIT");
+    if (slit != NULL) {
+        numa_parse_slit(slit);
+    }
+
+    printf("NUMA: %u node(s), %u memory range(s), %u CPU(s)\n",
+           numa_nodes_count, numa_mem_ranges_count, numa_cpus_count);
+    for (size_t i = 0; i < numa_mem_ranges_count; i++) {
+        struct numa_mem_range *range = numa_mem_ranges + i;
+        printf("NUMA: node %u [0x%x, 0x%x)\n", range->node, range->base,
+               range->limit);
+    }
+
+    pmem_numa_init();
+
+    // We're the BSP, the APs will be placed as they come up
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    pmem_set_cpu_node(0, numa_apic_node(ebx >> 24));
+}
@@ -1,9 +1,14 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <memory.h>
 #include "kernel/addr.h"
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
 #include "kernel/paging.h"
+#include "kernel/percpu.h"
+#include "kernel/spinlock.h"
 #include "kernel/terminal.h"
 
 /// Page table utils
@@ -23,27 +28,73 @@
     ((linear_addr >> (PAGE_OFFSET_BITS + PTE_BITS)) & 0x1ff)
 #define PT_INDEX(linear_addr) ((linear_addr >> PAGE_OFFSET_BITS) & 0x1ff)
 #define PAGE_OFF(linear_addr) ((linear_addr & 0xfff))
-// Get actual physical address from a PML4/PDPT/PD/PT entry (ignore lower 12-bits)
-#define PML4E_TO_ADDR(addr) (addr & 0xfffffffffffff000ull)
+// Get actual physical address from a PML4/PDPT/PD/PT entry (ignore flag bits)
+#define PML4E_TO_ADDR(addr) (addr & 0x000ffffffffff000ull)
 #define PML4E_TO_HIGH_ADDR(addr) (PML4E_TO_ADDR(addr) + KERNEL_VMA)
-// PD or PT entry bits
-#define PDE_HUGE (1 << 7)
-#define PTE_PRESENT (1 << 0)
-#define PTE_READWRITE (1 << 1)
+// Index into the table at `level` (1 = PT, 2 = PD, 3 = PDPT, 4 = PML4)
+#define LEVEL_INDEX(linear_addr, level)                                        \
+    ((linear_addr >> (PAGE_OFFSET_BITS + PTE_BITS * ((level)-1))) & 0x1ff)
 
 #define TO_LOWER_HALF(virtaddr) ((uint64_t)virtaddr - KERNEL_VMA)
 
+/// Number of 4K page tables used to map the kernel image with per-section
+/// permissions (each covers 2M). The rest of the kernel window is hugepages.
+#define KERNEL_IMAGE_PTS (4)
+
+extern uint8_t _rodata_start[];
+extern uint8_t _data_start[];
+extern uint8_t _kernel_end[];
+
 uint64_t kernel_pml4[512] __attribute__((aligned(PAGE_SIZE)));
 uint64_t kernel_pdpt0[512] __attribute__((aligned(PAGE_SIZE)));
 /// -2G
-uint64_t kernel_pd0[512] __attribute__((aligned(PAGE_SIZE)));
-uint64_t kernel_pd0_pt[512 * 512]
-    __attribute__((aligned(PAGE_SIZE))); // [0, 1G); kernel code
-uint64_t kernel_pd1[512] __attribute__((aligned(PAGE_SIZE)));
-uint64_t kernel_pd1_pt[512 * 512]
-    __attribute__((aligned(PAGE_SIZE))); // [1G, 2G); kernel code
+uint64_t kernel_pd0[512] __attribute__((aligned(PAGE_SIZE))); // [0, 1G)
+uint64_t kernel_low_pt[512]
+    __attribute__((aligned(PAGE_SIZE))); // [0, 2M); low mem + temp map
+uint64_t kernel_image_pt[KERNEL_IMAGE_PTS * 512]
+    __attribute__((aligned(PAGE_SIZE))); // [2M, ...); kernel image
+/// -1G, only needed if we can't use a 1G page here
+uint64_t kernel_pd1[512] __attribute__((aligned(PAGE_SIZE))); // [1G, 2G)
+
+// CPU supports 1G pages
+static bool paging_gbpages = false;
+// Page tables can be reached through the physmap
+static bool paging_physmap_ready = false;
+// NX bit to set on non-executable mappings (0 if unsupported)
+static uint64_t paging_nx = 0;
+static bool paging_pat = false;
+
+/// Where the framebuffer lives, for paging_map_lfb
+static uint64_t paging_lfb_phys = 0;
+static size_t paging_lfb_size = 0;
+
+/// Bytes mapped by one entry in a table at each level
+static const uint64_t paging_level_size[5] = {
+    0, PAGE_SIZE, HUGEPAGE_SIZE, GIGAPAGE_SIZE, 512ull * GIGAPAGE_SIZE
+};
+
+/// Pending TLB invalidations, collected while (un)mapping a range
+#define PAGING_FLUSH_MAX (32)
+struct paging_flush {
+    uint64_t addrs[PAGING_FLUSH_MAX];
+    size_t count;
+    bool full; /** Too many to invlpg one by one, flush everything */
+};
 
-uint64_t linear_limit = 0;
+/// A batch being flushed on the other CPUs, see paging_shootdown
+static struct spinlock paging_shootdown_lock;
+static struct paging_flush paging_shootdown_batch;
+static bool paging_shootdown_pending[MAX_CPUS];
+static uint32_t paging_shootdown_acks = 0;
+
+/// State threaded through the page table walk of paging_(un)map_range
+struct paging_range {
+    uint64_t virtaddr;
+    uint64_t physaddr;
+    uint64_t limit; /** Virtual limit */
+    uint64_t flags;
+    struct paging_flush flush;
+};
 
 /**
  * Invalidate TLB entry for `virtaddr`.
@@ -54,20 +105,106 @@ static inline void invlpg(uint64_t virtaddr)
 }
 
 /**
- * Reload PML4 in CR3.
+ * Flush the entire TLB, including global pages, by toggling CR4.PGE.
  */
-static void paging_flush_tlb()
+static void paging_flush_tlb_global()
 {
-    uint64_t pml4;
-    __asm__ volatile("movq %%cr3, %0" : "=r"(pml4));
-    __asm__ volatile("movq %0, %%cr3" ::"r"(pml4) : "memory");
+    uint64_t cr4;
+    __asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4 & ~(1ull << 7)) : "memory");
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4) : "memory");
+}
+
+static void paging_flush_add(struct paging_flush *flush, uint64_t virtaddr)
+{
+    if (flush->full) {
+        return;
+    }
+    if (flush->count >= PAGING_FLUSH_MAX) {
+        flush->full = true;
+        return;
+    }
+    flush->addrs[flush->count++] = virtaddr;
+}
+
+static void paging_flush_local(const struct paging_flush *flush)
+{
+    if (flush->full) {
+        paging_flush_tlb_global();
+    } else {
+        for (size_t i = 0; i < flush->count; i++) {
+            invlpg(flush->addrs[i]);
+        }
+    }
+}
+
+/**
+ * Flush `flush` on every other online CPU, and wait until they all have.
+ * It goes out as an NMI rather than on a vector: page tables are edited under
+ * vmem_lock with interrupts off, and the CPU we'd be waiting on may well be
+ * spinning on that lock the same way. Interrupts are off.
+ */
+static void paging_shootdown(const struct paging_flush *flush)
+{
+    size_t self = this_cpu_id();
+    // Whoever holds this is waiting on us too, but NMIs still get in
+    spin_lock(&paging_shootdown_lock);
+    paging_shootdown_batch = *flush;
+    size_t cpus = percpu_count;
+    __atomic_store_n(&paging_shootdown_acks, 0, __ATOMIC_RELAXED);
+    for (size_t cpu = 0; cpu < cpus; cpu++) {
+        if (cpu != self) {
+            __atomic_store_n(paging_shootdown_pending + cpu, true,
+                             __ATOMIC_RELEASE);
+            lapic_send_ipi(percpu_areas[cpu].apic_id, LAPIC_ICR_NMI);
+        }
+    }
+    while (__atomic_load_n(&paging_shootdown_acks, __ATOMIC_ACQUIRE) <
+           cpus - 1) {
+        __asm__ volatile("pause");
+    }
+    spin_unlock(&paging_shootdown_lock);
+}
+
+/**
+ * NMI handler half of paging_shootdown. Returns false if there wasn't one
+ * for this CPU.
+ */
+bool paging_shootdown_nmi()
+{
+    size_t cpu = this_cpu_id();
+    if (!__atomic_exchange_n(paging_shootdown_pending + cpu, false,
+                             __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    paging_flush_local(&paging_shootdown_batch);
+    __atomic_fetch_add(&paging_shootdown_acks, 1, __ATOMIC_RELEASE);
+    return true;
 }
 
+static void paging_flush_commit(struct paging_flush *flush)
+{
+    if (flush->count == 0 && !flush->full) {
+        return;
+    }
+    // Stay on this CPU while we work out who the others are
+    uint64_t flags = irq_save();
+    paging_flush_local(flush);
+    if (percpu_count > 1) {
+        paging_shootdown(flush);
+    }
+    irq_restore(flags);
+    flush->count = 0;
+    flush->full = false;
+}
+
+/// The temp map is only used to bootstrap the physmap, after which every page
+/// table is reachable at PHYS_TO_VIRT(physaddr).
 #define TEMP_MAP_ADDR (KERNEL_VMA) // Reclaim first 4K, mapped as part of kernel
 
 static void paging_unmap_temp()
 {
-    kernel_pd0_pt[0] = 0;
+    kernel_low_pt[0] = 0;
     invlpg(TEMP_MAP_ADDR);
 }
 
@@ -78,66 +215,312 @@ static void *paging_temp_map(uint64_t physaddr)
 {
     paging_unmap_temp();
 
-    kernel_pd0_pt[0] = PML4E_TO_ADDR(physaddr) | PTE_PRESENT |
+    kernel_low_pt[0] = PML4E_TO_ADDR(physaddr) | PTE_PRESENT |
                        PTE_READWRITE; // first 4K page of kernel
     invlpg(TEMP_MAP_ADDR);
-    return TEMP_MAP_ADDR;
+    return (void *)TEMP_MAP_ADDR;
 }
 
 /**
- * Map a 4K page starting at virtual memory address `virtaddr` to physical memory address `physaddr`.
- * NOTE: Doesn't invalidate pages or flush TLB, so do it yourself.
+ * Get a pointer to the page table at `physaddr`.
+ * Once the physmap is up this costs nothing. Before that it goes through the
+ * temp map, so only the most recently returned table is accessible!
  */
-static void paging_map_page(uint64_t virtaddr, uint64_t physaddr)
-{
-    uint64_t *pdpt;
-    uint64_t *pd;
-    uint64_t *pt;
-    if (!(kernel_pml4[PML4_INDEX(virtaddr)] & PTE_PRESENT)) {
-        // Allocate and init an empty PDPT for this PML4E
-        pdpt = pmem_alloc_page();
-        // Point this PML4E -> newly alloc'd PDPT
-        kernel_pml4[PML4_INDEX(virtaddr)] =
-            (uint64_t)pdpt | PTE_PRESENT | PTE_READWRITE;
-        // Map the pdpt to a virt addr so we can access it
-        uint64_t *v_pdpt = paging_temp_map(pdpt);
-        memset(v_pdpt, 0, 512 * (sizeof *v_pdpt));
-    }
-    pdpt = paging_temp_map(kernel_pml4[PML4_INDEX(virtaddr)]);
-    if (!(pdpt[PDPT_INDEX(virtaddr)] & PTE_PRESENT)) {
-        // Allocate and init an empty PD for this PDPTE
-        pd = pmem_alloc_page();
-        // Point this PDPTE -> newly alloc'd PD
-        pdpt[PDPT_INDEX(virtaddr)] = (uint64_t)pd | PTE_PRESENT | PTE_READWRITE;
-        // Map the pd to a virt addr so we can access it
-        uint64_t *v_pd = paging_temp_map(pd);
-        memset(v_pd, 0, 512 * (sizeof *v_pd));
-        // Remap the PDPT as we will need to access it again
-        pdpt = paging_temp_map(kernel_pml4[PML4_INDEX(virtaddr)]);
-    }
-    pd = paging_temp_map(pdpt[PDPT_INDEX(virtaddr)]);
-    // Ensure PD entry has been allocated
-    if (!(pd[PD_INDEX(virtaddr)] & PTE_PRESENT)) {
-        if (pd[PD_INDEX(virtaddr)] & PDE_HUGE) {
-            // Fatal? Trying to map a 4K page where a hugepage (2M) is already mapped
+static uint64_t *paging_table(uint64_t physaddr)
+{
+    if (paging_physmap_ready) {
+        return PHYS_TO_VIRT(PML4E_TO_ADDR(physaddr));
+    }
+    return paging_temp_map(physaddr);
+}
+
+/**
+ * Return the physaddr of the table pointed to by entry `index` of the table at
+ * physaddr `table`, allocating and zeroing it first if it isn't present.
+ */
+static uint64_t paging_next_table(uint64_t table, size_t index)
+{
+    uint64_t *v_table = paging_table(table);
+    uint64_t entry = v_table[index];
+    if (entry & PTE_PRESENT) {
+        if (entry & PDE_HUGE) {
+            // Fatal? Trying to map a smaller page where a hugepage is already mapped
             __asm__ volatile("mov $0xbaaaaaadbeeeeeef, %rax\n\t"
                              "1: jmp 1b");
         }
-        // Allocate and init an empty PT for this PDE
-        pt = pmem_alloc_page();
-        // Point this PDE -> newly alloc'd PT
-        pd[PD_INDEX(virtaddr)] = (uint64_t)pt | PTE_PRESENT | PTE_READWRITE;
-        // Map the pd to a virt addr so we can access it
-        uint64_t *v_pt = paging_temp_map(pt);
-        memset(v_pt, 0, 512 * (sizeof *v_pt));
-        // Remap the PD as we will need to access it again
-        // This is a bit convoluted: PDPT is no longer available,
-        // so we have to consecutively map it from a known mapped address (PML4).
-        pdpt = paging_temp_map(kernel_pml4[PML4_INDEX(virtaddr)]);
-        pd = paging_temp_map(pdpt[PDPT_INDEX(virtaddr)]);
+        return PML4E_TO_ADDR(entry);
+    }
+
+    // Allocate and init an empty table for this entry
+    uint64_t next = (uint64_t)pmem_alloc_page();
+    v_table[index] = next | PTE_PRESENT | PTE_READWRITE;
+    uint64_t *v_next = paging_table(next);
+    memset(v_next, 0, 512 * (sizeof *v_next));
+    return next;
+}
+
+/**
+ * Map a 4K, 2M or 1G page starting at virtual memory address `virtaddr` to
+ * physical memory address `physaddr`. Both must be aligned to `page_size`.
+ * NOTE: Doesn't invalidate pages or flush TLB, so do it yourself.
+ */
+static void paging_map(uint64_t virtaddr, uint64_t physaddr,
+                       uint64_t page_size, uint64_t flags)
+{
+    uint64_t pdpt = paging_next_table(TO_LOWER_HALF(kernel_pml4),
+                                      PML4_INDEX(virtaddr));
+    if (page_size == GIGAPAGE_SIZE) {
+        uint64_t *v_pdpt = paging_table(pdpt);
+        v_pdpt[PDPT_INDEX(virtaddr)] = physaddr | flags | PDE_HUGE;
+        return;
+    }
+
+    uint64_t pd = paging_next_table(pdpt, PDPT_INDEX(virtaddr));
+    if (page_size == HUGEPAGE_SIZE) {
+        uint64_t *v_pd = paging_table(pd);
+        v_pd[PD_INDEX(virtaddr)] = physaddr | flags | PDE_HUGE;
+        return;
     }
-    pt = paging_temp_map(pd[PD_INDEX(virtaddr)]);
-    pt[PT_INDEX(virtaddr)] = physaddr | PTE_PRESENT | PTE_READWRITE;
+
+    uint64_t pt = paging_next_table(pd, PD_INDEX(virtaddr));
+    uint64_t *v_pt = paging_table(pt);
+    v_pt[PT_INDEX(virtaddr)] = physaddr | flags;
+}
+
+/**
+ * Largest page size we can use to map `virtaddr` -> `physaddr` given that
+ * there are `len` bytes left to map.
+ */
+static uint64_t paging_best_page_size(uint64_t virtaddr, uint64_t physaddr,
+                                      uint64_t len)
+{
+    if (paging_gbpages && len >= GIGAPAGE_SIZE &&
+        (virtaddr % GIGAPAGE_SIZE) == 0 && (physaddr % GIGAPAGE_SIZE) == 0) {
+        return GIGAPAGE_SIZE;
+    }
+    if (len >= HUGEPAGE_SIZE && (virtaddr % HUGEPAGE_SIZE) == 0 &&
+        (physaddr % HUGEPAGE_SIZE) == 0) {
+        return HUGEPAGE_SIZE;
+    }
+    return PAGE_SIZE;
+}
+
+/**
+ * Return the table pointed to by `entry`, allocating an empty one if needed.
+ * Physmap only.
+ */
+static uint64_t *paging_child_table(uint64_t *entry)
+{
+    if (!(*entry & PTE_PRESENT)) {
+        uint64_t table = (uint64_t)pmem_alloc_zeroed_page();
+        *entry = table | PTE_PRESENT | PTE_READWRITE;
+    }
+    return PHYS_TO_VIRT(PML4E_TO_ADDR(*entry));
+}
+
+/**
+ * Replace the huge page at `entry` (in a table at `level`) with a table of
+ * the next size down that maps exactly the same memory.
+ */
+static void paging_split(uint64_t *entry, int level, struct paging_flush *flush,
+                         uint64_t virtaddr)
+{
+    uint64_t size = paging_level_size[level - 1];
+    // Bit 12 of a huge page is PDE_PAT, not part of the address
+    uint64_t physaddr =
+        PML4E_TO_ADDR(*entry) & ~(paging_level_size[level] - 1);
+    uint64_t flags = (*entry & ~0x000ffffffffff000ull) & ~PDE_HUGE;
+    if (level - 1 > 1) {
+        flags |= PDE_HUGE | (*entry & PDE_PAT);
+    } else if (*entry & PDE_PAT) {
+        flags |= PTE_PAT;
+    }
+
+    uint64_t table = (uint64_t)pmem_alloc_page();
+    uint64_t *v_table = PHYS_TO_VIRT(table);
+    for (size_t i = 0; i < 512; i++) {
+        v_table[i] = (physaddr + i * size) | flags;
+    }
+    *entry = table | PTE_PRESENT | PTE_READWRITE;
+    paging_flush_add(flush, virtaddr);
+}
+
+static void paging_map_level(uint64_t *table, int level, struct paging_range *r)
+{
+    uint64_t size = paging_level_size[level];
+    for (size_t i = LEVEL_INDEX(r->virtaddr, level);
+         i < 512 && r->virtaddr < r->limit; i++) {
+        uint64_t *entry = table + i;
+        bool present = *entry & PTE_PRESENT;
+        bool huge = level > 1 && (*entry & PDE_HUGE);
+
+        // Use a page at this level if it fits, and we're not about to throw
+        // away a table that's already hanging off this entry
+        bool leaf = level == 1;
+        if (level <= 3 && (!present || huge)) {
+            leaf = paging_best_page_size(r->virtaddr, r->physaddr,
+                                         r->limit - r->virtaddr) == size;
+        }
+
+        if (leaf) {
+            if (present) {
+                paging_flush_add(&r->flush, r->virtaddr);
+            }
+            uint64_t flags = r->flags;
+            if (level > 1 && (flags & PTE_PAT)) {
+                // PTE_PAT is PDE_HUGE in a huge page, it moves to bit 12
+                flags = (flags & ~PTE_PAT) | PDE_HUGE | PDE_PAT;
+            } else if (level > 1) {
+                flags |= PDE_HUGE;
+            }
+            *entry = r->physaddr | flags;
+            r->virtaddr += size;
+            r->physaddr += size;
+            continue;
+        }
+
+        if (huge) {
+            paging_split(entry, level, &r->flush, r->virtaddr);
+        }
+        paging_map_level(paging_child_table(entry), level - 1, r);
+    }
+}
+
+static void paging_unmap_level(uint64_t *table, int level,
+                               struct paging_range *r)
+{
+    uint64_t size = paging_level_size[level];
+    for (size_t i = LEVEL_INDEX(r->virtaddr, level);
+         i < 512 && r->virtaddr < r->limit; i++) {
+        uint64_t *entry = table + i;
+        uint64_t base = r->virtaddr & ~(size - 1);
+        if (!(*entry & PTE_PRESENT)) {
+            r->virtaddr = base + size;
+            continue;
+        }
+
+        if (level == 1 || (*entry & PDE_HUGE)) {
+            // The range is whole pages, so a PTE always goes entirely
+            if (level == 1 ||
+                (r->virtaddr == base && r->limit - base >= size)) {
+                *entry = 0;
+                paging_flush_add(&r->flush, base);
+                r->virtaddr = base + size;
+                continue;
+            }
+            // Only part of this hugepage is going away
+            paging_split(entry, level, &r->flush, base);
+        }
+        paging_unmap_level(PHYS_TO_VIRT(PML4E_TO_ADDR(*entry)), level - 1, r);
+    }
+}
+
+/**
+ * Map `len` bytes at `virtaddr` to `physaddr` using the largest pages that
+ * alignment allows. Each table on the way is filled in one go, and any
+ * entries that were replaced are invalidated in one batch at the end.
+ * `flags` are PTE_* bits, PTE_PRESENT is implied, plus a PTE_CACHE_* type.
+ * PTE_NX and PTE_PAT are dropped if the CPU doesn't support them.
+ */
+void paging_map_range(uint64_t virtaddr, uint64_t physaddr, size_t len,
+                      uint64_t flags)
+{
+    if (!paging_nx) {
+        flags &= ~PTE_NX;
+    }
+    if (!paging_pat) {
+        flags &= ~PTE_PAT;
+    }
+
+    struct paging_range r = {
+        .virtaddr = virtaddr - PAGE_OFF(virtaddr),
+        .physaddr = physaddr - PAGE_OFF(physaddr),
+        .limit = virtaddr + len,
+        .flags = flags | PTE_PRESENT,
+    };
+    paging_map_level(kernel_pml4, 4, &r);
+    paging_flush_commit(&r.flush);
+}
+
+/**
+ * Unmap `len` bytes at `virtaddr`, splitting hugepages that are only partly
+ * covered. The TLB is flushed once at the end.
+ * NOTE: Page tables are kept around even if they end up empty.
+ */
+void paging_unmap_range(uint64_t virtaddr, size_t len)
+{
+    struct paging_range r = {
+        .virtaddr = virtaddr - PAGE_OFF(virtaddr),
+        .limit = (virtaddr + len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1),
+    };
+    paging_unmap_level(kernel_pml4, 4, &r);
+    paging_flush_commit(&r.flush);
+}
+
+/**
+ * Look up the physical address `virtaddr` is mapped to.
+ * Returns false if it isn't mapped.
+ */
+bool paging_translate(uint64_t virtaddr, uint64_t *physaddr)
+{
+    uint64_t *table = kernel_pml4;
+    for (int level = 4; level >= 1; level--) {
+        uint64_t entry = table[LEVEL_INDEX(virtaddr, level)];
+        if (!(entry & PTE_PRESENT)) {
+            return false;
+        }
+        if (level == 1 || (level <= 3 && (entry & PDE_HUGE))) {
+            uint64_t size = paging_level_size[level];
+            *physaddr = (PML4E_TO_ADDR(entry) & ~(size - 1)) +
+                        (virtaddr & (size - 1));
+            return true;
+        }
+        table = PHYS_TO_VIRT(PML4E_TO_ADDR(entry));
+    }
+    return false;
+}
+
+/**
+ * Map `len` bytes of device registers at `physaddr` uncached, in their slot in
+ * the physmap, and return the virtual address.
+ */
+void *paging_map_mmio(uint64_t physaddr, size_t len)
+{
+    paging_map_range((uint64_t)PHYS_TO_VIRT(physaddr), physaddr, len,
+                     PTE_READWRITE | PTE_CACHE_UC | PTE_NX);
+    return PHYS_TO_VIRT(physaddr);
+}
+
+/**
+ * Program this CPU's PAT: the power-on layout, except entry 4 is WC instead
+ * of WB. Nothing maps with entry 4 before this, so no existing page changes
+ * type. Every CPU has to agree on it, so APs call this before they can touch
+ * anything mapped PTE_CACHE_WC.
+ */
+void paging_pat_init()
+{
+    if (!paging_pat) {
+        return;
+    }
+    wrmsr(MSR_PAT, PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) |
+                       PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC) |
+                       PAT_ENTRY(4, PAT_WC) | PAT_ENTRY(5, PAT_WT) |
+                       PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC));
+}
+
+/**
+ * (Re)map the framebuffer at LFB_VMA with memory type `cache`, one of
+ * PTE_CACHE_*. Only this CPU's caches are written back, so do it before SMP.
+ */
+void paging_map_lfb(uint64_t cache)
+{
+    if (paging_lfb_size == 0) {
+        return;
+    }
+    paging_map_range(LFB_VMA, paging_lfb_phys, paging_lfb_size,
+                     PTE_READWRITE | PTE_NX | cache);
+    // Lines cached under the old type mustn't linger (SDM Vol. 3A 11.12.4)
+    __asm__ volatile("wbinvd" ::: "memory");
 }
 
 /**
@@ -163,68 +546,148 @@ static void paging_remap_lfb(struct mb2_info *mb2_info)
         return;
     }
 
-    // We'll map the LFB to -3G in virtual mem (1G below kernel)
-    uint64_t virtaddr = LFB_VMA;
-    for (uint64_t physaddr = tag_fb->framebuffer.addr;
-         physaddr < tag_fb->framebuffer.addr + fb_size;
-         physaddr += PAGE_SIZE, virtaddr += PAGE_SIZE) {
-        paging_map_page(virtaddr, physaddr);
-    }
+    // We'll map the LFB to -3G in virtual mem (1G below kernel). It's only
+    // ever written, and write-combining lets those go out in bursts.
+    paging_lfb_phys = tag_fb->framebuffer.addr;
+    paging_lfb_size = fb_size;
+    paging_map_lfb(PTE_CACHE_WC);
     printf("Done.\n");
 }
 
 /**
- * Remap 2G of kernel code to *4K pages* at higher-half starting at -2G.
+ * Page flags for the kernel image page at `physaddr`:
+ * text is read-only, rodata is read-only and NX, data & bss are NX.
+ */
+static uint64_t paging_kernel_image_flags(uint64_t physaddr)
+{
+    uint64_t virtaddr = physaddr + KERNEL_VMA;
+    if (virtaddr < (uint64_t)_rodata_start) {
+        return PTE_PRESENT | PTE_GLOBAL;
+    } else if (virtaddr < (uint64_t)_data_start) {
+        return PTE_PRESENT | PTE_GLOBAL | paging_nx;
+    } else {
+        return PTE_PRESENT | PTE_READWRITE | PTE_GLOBAL | paging_nx;
+    }
+}
+
+/**
+ * Remap 2G of kernel code at higher-half starting at -2G.
+ * 4K pages are only used for low memory and the kernel image (so that each
+ * section gets the right permissions); everything else is 2M or 1G pages.
  */
 static void paging_remap_kernel()
 {
     memset(kernel_pml4, 0, 8 * 512);
     memset(kernel_pdpt0, 0, 8 * 512);
     memset(kernel_pd0, 0, 8 * 512);
-    memset(kernel_pd0_pt, 0, 8 * 512 * 512);
+    memset(kernel_low_pt, 0, 8 * 512);
+    memset(kernel_image_pt, 0, 8 * 512 * KERNEL_IMAGE_PTS);
     memset(kernel_pd1, 0, 8 * 512);
-    memset(kernel_pd1_pt, 0, 8 * 512 * 512);
+
+    // Check what the CPU can do for us
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_EXT_FEATURES, &eax, &ebx, &ecx, &edx);
+    paging_gbpages = edx & CPUID_EXT_EDX_PAGE1GB;
+    if (edx & CPUID_EXT_EDX_NX) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+        paging_nx = PTE_NX;
+    }
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    paging_pat = edx & CPUID_EDX_PAT;
+    paging_pat_init();
+
+    uint64_t kernel_image_limit = TO_LOWER_HALF(_kernel_end);
+    if (kernel_image_limit > KERNEL_LMA + KERNEL_IMAGE_PTS * HUGEPAGE_SIZE) {
+        printf("Kernel image too large for KERNEL_IMAGE_PTS!\n");
+    }
 
     // Map virtual higher-half addresses starting at -2G to physical addresses [0G, 2G)
     kernel_pml4[511] =
         TO_LOWER_HALF((uint64_t)kernel_pdpt0) | PTE_PRESENT | PTE_READWRITE;
     kernel_pdpt0[510] =
         TO_LOWER_HALF((uint64_t)kernel_pd0) | PTE_PRESENT | PTE_READWRITE;
-    uint64_t physaddr = 0;
-    // [0G, 1G)
-    for (size_t i = 0; i < 512; i++) {
-        kernel_pd0[i] = TO_LOWER_HALF((uint64_t)(&(kernel_pd0_pt[i * 512]))) |
-                        PTE_PRESENT | PTE_READWRITE;
-        for (size_t j = 0; j < 512; j++, physaddr += 0x1000) {
-            kernel_pd0_pt[i * 512 + j] = physaddr | PTE_PRESENT | PTE_READWRITE;
+    // [0, 2M): low memory, 4K pages as the first one is our temp map slot
+    kernel_pd0[0] =
+        TO_LOWER_HALF((uint64_t)kernel_low_pt) | PTE_PRESENT | PTE_READWRITE;
+    for (size_t j = 1; j < 512; j++) {
+        kernel_low_pt[j] = (j * PAGE_SIZE) | PTE_PRESENT | PTE_READWRITE |
+                           PTE_GLOBAL | paging_nx;
+    }
+    // [2M, 2M + 2M * KERNEL_IMAGE_PTS): kernel image
+    uint64_t physaddr = KERNEL_LMA;
+    for (size_t i = 0; i < KERNEL_IMAGE_PTS; i++) {
+        kernel_pd0[1 + i] =
+            TO_LOWER_HALF((uint64_t)(&(kernel_image_pt[i * 512]))) |
+            PTE_PRESENT | PTE_READWRITE;
+        for (size_t j = 0; j < 512; j++, physaddr += PAGE_SIZE) {
+            kernel_image_pt[i * 512 + j] =
+                physaddr | paging_kernel_image_flags(physaddr);
         }
     }
+    // The rest of [0G, 1G)
+    for (size_t i = 1 + KERNEL_IMAGE_PTS; i < 512; i++) {
+        kernel_pd0[i] = (i * HUGEPAGE_SIZE) | PTE_PRESENT | PTE_READWRITE |
+                        PDE_HUGE | PTE_GLOBAL | paging_nx;
+    }
     // [1G, 2G)
-    for (size_t i = 0; i < 512; i++) {
-        kernel_pd1[i] = TO_LOWER_HALF((uint64_t)(&(kernel_pd1_pt[i * 512]))) |
-                        PTE_PRESENT | PTE_READWRITE;
-        for (size_t j = 0; j < 512; j++, physaddr += 0x1000) {
-            kernel_pd1_pt[i * 512 + j] = physaddr | PTE_PRESENT | PTE_READWRITE;
+    if (paging_gbpages) {
+        kernel_pdpt0[511] = GIGAPAGE_SIZE | PTE_PRESENT | PTE_READWRITE |
+                            PDE_HUGE | PTE_GLOBAL | paging_nx;
+    } else {
+        kernel_pdpt0[511] =
+            TO_LOWER_HALF((uint64_t)kernel_pd1) | PTE_PRESENT | PTE_READWRITE;
+        for (size_t i = 0; i < 512; i++) {
+            kernel_pd1[i] = (GIGAPAGE_SIZE + i * HUGEPAGE_SIZE) | PTE_PRESENT |
+                            PTE_READWRITE | PDE_HUGE | PTE_GLOBAL | paging_nx;
         }
     }
 
+    // Enforce read-only pages in ring 0 (CR0.WP)
+    uint64_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0 | (1 << 16)));
+
     // Replace the boot PML4
     uint64_t pml4 = (uint64_t)kernel_pml4 - KERNEL_VMA; // physaddr of new PML4
     __asm__ volatile("movq %0, %%cr3" ::"r"(pml4) : "memory");
 }
 
+/**
+ * Direct map all RAM at PHYSMAP_VMA. The tables for this are built through the
+ * temp map, which is retired as soon as we're done.
+ */
+static void paging_physmap_init()
+{
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        uint64_t physaddr = block->base;
+        while (physaddr < block->limit) {
+            uint64_t virtaddr = (uint64_t)PHYS_TO_VIRT(physaddr);
+            uint64_t page_size = paging_best_page_size(
+                virtaddr, physaddr, block->limit - physaddr);
+            paging_map(virtaddr, physaddr, page_size,
+                       PTE_PRESENT | PTE_READWRITE | PTE_GLOBAL | paging_nx);
+            physaddr += page_size;
+        }
+    }
+
+    paging_unmap_temp();
+    paging_physmap_ready = true;
+}
+
 /**
  * Setup paging:
- *  - Remap kernel to 4K pages
+ *  - Remap kernel to hugepages (4K only for low memory and the kernel image)
+ *  - Direct map all RAM at PHYSMAP_VMA, so page tables can be edited in place
  *  - Remap LFB to higher-half
  *  - Re-initialise terminal with new LFB
- *  - Map bottom-half linear address space to available physical space from memory map
+ * The lower half is left empty; vmem fills it in on demand.
  */
 void paging_init(struct mb2_info *mb2_info)
 {
     paging_remap_kernel();
+    paging_physmap_init();
     paging_remap_lfb(mb2_info);
-    paging_flush_tlb();
 
     // Re-initialise LFB with higher-half address
     struct mb2_tag *tag_fb = mb2_find_tag(mb2_info, MB_TAG_TYPE_FRAMEBUFFER);
@@ -233,21 +696,5 @@ void paging_init(struct mb2_info *mb2_info)
     size_t pitch = tag_fb->framebuffer.pitch;
     terminal_init(LFB_VMA, width, height, pitch, 2);
 
-    /// Map the available RAM to a linear address space
-    printf("Mapping linear address space...\n");
-    for (size_t i = 0; i < pmem_blocks_count; i++) {
-        struct pmem_block *block = pmem_block_map + i;
-        printf("Mapping block starting at 0x%x -> [0x%x, 0x%x) (%u bytes)\n",
-               linear_limit, block->base, block->limit,
-               block->limit - block->base);
-        for (uint64_t physaddr = block->base; physaddr < block->limit;
-             physaddr += PAGE_SIZE, linear_limit += PAGE_SIZE) {
-            paging_map_page(linear_limit, physaddr);
-        }
-    }
-    printf("Done.\n");
-
-    /// Reload CR3 with our new PML4 mapping
-    paging_flush_tlb();
     terminal_clear();
 }
@@ -0,0 +1,28 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel/cpu.h"
+#include "kernel/percpu.h"
+
+size_t percpu_count = 0;
+
+/**
+ * Make `cpu` the calling CPU's percpu area by pointing GS base at it.
+ */
+void percpu_load(struct percpu *cpu)
+{
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+/**
+ * Set up the BSP's percpu area. This has to come before anything that calls
+ * this_cpu_id(), i.e. before pmem.
+ */
+void percpu_init()
+{
+    struct percpu *cpu = percpu_areas + 0;
+    cpu->id = 0;
+    cpu->online = true;
+    percpu_load(cpu);
+    percpu_count = 1;
+}
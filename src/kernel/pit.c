@@ -0,0 +1,40 @@
+#include <kernel/io.h>
+#include <kernel/pit.h>
+
+/**
+ * Fire IRQ0 `hz` times a second.
+ */
+void pit_set_periodic(unsigned int hz)
+{
+    uint32_t divisor = PIT_FREQUENCY / hz;
+    if (divisor > 0xffff) {
+        divisor = 0; // 0 is 65536, the slowest it goes
+    }
+
+    // Channel 0, lobyte/hibyte, mode 2 (rate generator)
+    outb(PIT_PORT_CMD, 0x34);
+    outb(PIT_PORT_CHANNEL0, divisor & 0xff);
+    outb(PIT_PORT_CHANNEL0, (divisor >> 8) & 0xff);
+}
+
+/**
+ * Busy-wait for `us` microseconds (at most ~54ms) on channel 2, which isn't
+ * wired to an interrupt. Good for calibrating other clocks against.
+ */
+void pit_wait_us(unsigned int us)
+{
+    uint32_t count = (uint64_t)PIT_FREQUENCY * us / 1000000;
+    if (count > 0xffff) {
+        count = 0xffff;
+    }
+
+    // Gate on, speaker off
+    outb(PIT_PORT_GATE, (inb(PIT_PORT_GATE) & ~0x02) | 0x01);
+    // Channel 2, lobyte/hibyte, mode 0 (output goes high at terminal count)
+    outb(PIT_PORT_CMD, 0xb0);
+    outb(PIT_PORT_CHANNEL2, count & 0xff);
+    outb(PIT_PORT_CHANNEL2, (count >> 8) & 0xff);
+    while (!(inb(PIT_PORT_GATE) & 0x20)) {
+        __asm__ volatile("pause");
+    }
+}
@@ -4,45 +4,598 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <algo.h>
+#include "kernel/addr.h"
+#include "kernel/numa.h"
 #include "kernel/pmem.h"
 #include "kernel/paging.h"
+#include "kernel/percpu.h"
+#include "kernel/printk.h"
+#include "kernel/spinlock.h"
+
+// Physical memory below this is reachable at KERNEL_VMA + physaddr
+#define PMEM_EARLY_LIMIT (0x80000000ull) /** 2G */
+// Leave the real-mode area (IVT, BDA, EBDA, VGA, BIOS ROM) alone
+#define PMEM_LOW_LIMIT (0x100000ull) /** 1M */
+
+#define PAGES_TO_BYTES(n) ((uint64_t)(n) * PAGE_SIZE)
+
+extern uint8_t _kernel_end[];
 
 // Number of contiguous blocks of RAM
 size_t pmem_blocks_count = 0;
-// Number of free 4K pages
+// Number of usable 4K pages
 size_t usable_pages = 0;
-// Index of the free block currently giving allocations
-size_t pmem_current_block = 0;
+
+/// Buddy free lists per NUMA node. Until pmem_numa_init, it's all node 0.
+static struct pmem_node pmem_nodes[NUMA_MAX_NODES];
+static size_t pmem_nodes_count = 1;
+// Number of free 4K pages, over all nodes
+static size_t pmem_free_count = 0;
+// Node each CPU allocates from by default
+static unsigned int pmem_cpu_nodes[MAX_CPUS];
+
+// Protects the free lists of every node (but not the per-CPU caches)
+static struct spinlock pmem_lock;
+
+/// Per-CPU caches of free order-0 pages
+static struct pmem_pcp pmem_pcps[MAX_CPUS];
+
+/// Pages zeroed ahead of time by pmem_zero_pool_fill
+static uint64_t pmem_zero_pool[PMEM_ZERO_POOL_SIZE];
+static size_t pmem_zero_pool_count = 0;
+static struct spinlock pmem_zero_pool_lock;
+static uint64_t pmem_zero_pool_hits = 0;
+static uint64_t pmem_zero_pool_misses = 0;
+
+/// Ranges that must never be handed out (kernel image, boot info, ...)
+#define MAX_PMEM_RESERVED (8)
+static struct pmem_block pmem_reserved[MAX_PMEM_RESERVED];
+static size_t pmem_reserved_count = 0;
+
+/**
+ * Find the RAM block containing `physaddr` (binary search, the map is sorted).
+ */
+static struct pmem_block *pmem_find_block(uint64_t physaddr)
+{
+    size_t lo = 0;
+    size_t hi = pmem_blocks_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        struct pmem_block *block = pmem_block_map + mid;
+        if (physaddr < block->base) {
+            hi = mid;
+        } else if (physaddr >= block->limit) {
+            lo = mid + 1;
+        } else {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+static inline uint64_t pmem_page_to_phys(struct pmem_page *page)
+{
+    return (uint64_t)page->pfn * PAGE_SIZE;
+}
+
+static void pmem_list_push(struct pmem_node *node, unsigned int order,
+                           struct pmem_page *page)
+{
+    page->prev = NULL;
+    page->next = node->free_lists[order];
+    if (page->next != NULL) {
+        page->next->prev = page;
+    }
+    node->free_lists[order] = page;
+    page->order = order;
+    page->flags |= PMEM_PAGE_FREE;
+}
+
+static void pmem_list_remove(struct pmem_node *node, unsigned int order,
+                             struct pmem_page *page)
+{
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        node->free_lists[order] = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags &= ~PMEM_PAGE_FREE;
+}
+
+/**
+ * Take a block of 2^order pages off `node`'s free lists.
+ * Caller holds `pmem_lock`.
+ */
+static void *pmem_buddy_alloc(struct pmem_node *node, unsigned int order)
+{
+    if (order > PMEM_MAX_ORDER) {
+        return NULL;
+    }
+
+    // Find the smallest free block that fits
+    unsigned int k = order;
+    while (k <= PMEM_MAX_ORDER && node->free_lists[k] == NULL) {
+        k++;
+    }
+    if (k > PMEM_MAX_ORDER) {
+        return NULL;
+    }
+
+    struct pmem_page *page = node->free_lists[k];
+    pmem_list_remove(node, k, page);
+
+    // Split it down to size, handing the upper halves back to the free lists
+    while (k > order) {
+        k--;
+        pmem_list_push(node, k, page + (1ull << k));
+    }
+
+    page->order = order;
+    node->free_count -= 1ull << order;
+    pmem_free_count -= 1ull << order;
+    return (void *)pmem_page_to_phys(page);
+}
+
+/**
+ * Take a block of 2^order pages from `node`, or failing that from the nearest
+ * node that has one. Caller holds `pmem_lock`.
+ */
+static void *pmem_buddy_alloc_near(unsigned int node, unsigned int order)
+{
+    for (size_t i = 0; i < pmem_nodes_count; i++) {
+        void *page =
+            pmem_buddy_alloc(pmem_nodes + pmem_nodes[node].fallback[i], order);
+        if (page != NULL) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Give a block of 2^order pages back to the free lists, merging with free
+ * buddies as far up as possible. Caller holds `pmem_lock`.
+ */
+static void pmem_buddy_free(void *physaddr, unsigned int order)
+{
+    struct pmem_block *block = pmem_find_block((uint64_t)physaddr);
+    if (block == NULL || (uint64_t)physaddr % PAGES_TO_BYTES(1ull << order)) {
+        printf("pmem: bad free of 0x%x (order %u)\n", physaddr, order);
+        return;
+    }
+
+    uint64_t block_pfn = block->base / PAGE_SIZE;
+    uint64_t block_limit_pfn = block->limit / PAGE_SIZE;
+    uint64_t pfn = (uint64_t)physaddr / PAGE_SIZE;
+    if (pfn + (1ull << order) > block_limit_pfn) {
+        printf("pmem: bad free of 0x%x (order %u)\n", physaddr, order);
+        return;
+    }
+    struct pmem_page *page = block->pages + (pfn - block_pfn);
+    if (page->flags & PMEM_PAGE_FREE) {
+        printf("pmem: double free of 0x%x\n", physaddr);
+        return;
+    }
+    struct pmem_node *node = pmem_nodes + block->node;
+    node->free_count += 1ull << order;
+    pmem_free_count += 1ull << order;
+
+    while (order < PMEM_MAX_ORDER) {
+        uint64_t buddy_pfn = pfn ^ (1ull << order);
+        if (buddy_pfn < block_pfn ||
+            buddy_pfn + (1ull << order) > block_limit_pfn) {
+            break;
+        }
+        struct pmem_page *buddy = block->pages + (buddy_pfn - block_pfn);
+        if (!(buddy->flags & PMEM_PAGE_FREE) || buddy->order != order) {
+            break;
+        }
+
+        // Buddy is free too, coalesce into a block of the next order
+        pmem_list_remove(node, order, buddy);
+        pfn &= ~(1ull << order);
+        page = block->pages + (pfn - block_pfn);
+        order++;
+    }
+
+    pmem_list_push(node, order, page);
+}
+
+/**
+ * Allocate 2^order physically contiguous pages, aligned to their size, on
+ * `node` if possible and otherwise on the nearest node with room.
+ * NOTE: This returns a PHYSICAL address, or NULL if we're out of memory.
+ */
+void *pmem_alloc_pages_node(unsigned int node, unsigned int order)
+{
+    if (node >= pmem_nodes_count) {
+        node = 0;
+    }
+    uint64_t flags = spin_lock_irqsave(&pmem_lock);
+    void *page = pmem_buddy_alloc_near(node, order);
+    spin_unlock_irqrestore(&pmem_lock, flags);
+    return page;
+}
+
+/**
+ * Allocate 2^order physically contiguous pages, aligned to their size,
+ * preferably on this CPU's node.
+ * NOTE: This returns a PHYSICAL address, or NULL if we're out of memory.
+ */
+void *pmem_alloc_pages(unsigned int order)
+{
+    return pmem_alloc_pages_node(pmem_cpu_nodes[this_cpu_id()], order);
+}
+
+/**
+ * Refill this CPU's cache with a batch of pages from the free lists of its
+ * own node (or the nearest one with pages left).
+ */
+static void pmem_pcp_refill(struct pmem_pcp *pcp, unsigned int node)
+{
+    size_t n = 0;
+    spin_lock(&pmem_lock);
+    while (n < PMEM_PCP_BATCH) {
+        void *page = pmem_buddy_alloc_near(node, 0);
+        if (page == NULL) {
+            break;
+        }
+        pcp->pages[pcp->count++] = (uint64_t)page;
+        n++;
+    }
+    spin_unlock(&pmem_lock);
+
+    pcp->stats.refills += 1;
+    pcp->stats.refill_pages += n;
+}
+
+/**
+ * Drain a batch of pages from this CPU's cache back to the free lists.
+ */
+static void pmem_pcp_drain(struct pmem_pcp *pcp, size_t n)
+{
+    if (n > pcp->count) {
+        n = pcp->count;
+    }
+
+    spin_lock(&pmem_lock);
+    for (size_t i = 0; i < n; i++) {
+        pmem_buddy_free((void *)pcp->pages[--pcp->count], 0);
+    }
+    spin_unlock(&pmem_lock);
+
+    pcp->stats.drains += 1;
+    pcp->stats.drain_pages += n;
+}
 
 /**
  * Return an available physical page (4K).
+ * Served from this CPU's page cache, which is refilled in batches.
  * NOTE: This returns a 4K-aligned PHYSICAL address.
  */
 void *pmem_alloc_page()
 {
-    struct pmem_block *block = pmem_block_map + pmem_current_block;
+    void *page = NULL;
+    uint64_t flags = irq_save();
+    struct pmem_pcp *pcp = pmem_pcps + this_cpu_id();
+    if (pcp->count > 0) {
+        pcp->stats.alloc_hits += 1;
+    } else {
+        pcp->stats.alloc_misses += 1;
+        pmem_pcp_refill(pcp, pmem_cpu_nodes[this_cpu_id()]);
+    }
+    if (pcp->count > 0) {
+        page = (void *)pcp->pages[--pcp->count];
+    }
+    irq_restore(flags);
+
+    if (page == NULL) {
+        panic("Out of physical memory!\n");
+    }
+
+    return page;
+}
+
+/**
+ * Allocate `n_pages` physically contiguous pages.
+ * The allocation is carved from a buddy block and the unused tail is given
+ * straight back, so release it with `pmem_free_range(base, base + n * 4K)`.
+ */
+void *pmem_alloc_range(size_t n_pages)
+{
+    if (n_pages == 0) {
+        return NULL;
+    }
 
-    // First check if we have enough space to allocate from this block
-    if (block->limit - block->base < PAGE_SIZE) {
-        // Not enough space left in this block, move on to the previous
-        pmem_current_block -= 1;
-        if (pmem_current_block < 0) {
-            /// TODO: PANIC
-            printf("Out of physical memory!\n");
-            __asm__ volatile("1: jmp 1b");
+    unsigned int order = 0;
+    while ((1ull << order) < n_pages) {
+        order++;
+    }
+
+    uint64_t base = (uint64_t)pmem_alloc_pages(order);
+    if (base == 0) {
+        return (void *)base;
+    }
+
+    pmem_free_range(base + PAGES_TO_BYTES(n_pages),
+                    base + PAGES_TO_BYTES(1ull << order));
+    return (void *)base;
+}
+
+/**
+ * Free 2^order contiguous pages starting at `physaddr`.
+ */
+void pmem_free_pages(void *physaddr, unsigned int order)
+{
+    uint64_t flags = spin_lock_irqsave(&pmem_lock);
+    pmem_buddy_free(physaddr, order);
+    spin_unlock_irqrestore(&pmem_lock, flags);
+}
+
+/**
+ * Order of the block starting at `physaddr`, as handed out by pmem_alloc_pages.
+ */
+unsigned int pmem_page_order(void *physaddr)
+{
+    struct pmem_block *block = pmem_find_block((uint64_t)physaddr);
+    if (block == NULL) {
+        return 0;
+    }
+    return block->pages[((uint64_t)physaddr - block->base) / PAGE_SIZE].order;
+}
+
+static struct pmem_page *pmem_page_desc(uint64_t physaddr)
+{
+    struct pmem_block *block = pmem_find_block(physaddr);
+    if (block == NULL) {
+        panic("pmem: no descriptor for 0x%x\n", physaddr);
+    }
+    return block->pages + (physaddr - block->base) / PAGE_SIZE;
+}
+
+/**
+ * Take an extra reference to the (order-0) page at `physaddr`, e.g. to share
+ * it copy-on-write.
+ */
+void pmem_page_get(void *physaddr)
+{
+    struct pmem_page *page = pmem_page_desc((uint64_t)physaddr);
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference to the page at `physaddr`, freeing it if it was the last.
+ */
+void pmem_page_put(void *physaddr)
+{
+    struct pmem_page *page = pmem_page_desc((uint64_t)physaddr);
+    uint16_t refs = __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE);
+    do {
+        if (refs == 0) {
+            pmem_free_page(physaddr);
             return;
         }
+    } while (!__atomic_compare_exchange_n(&page->refcount, &refs, refs - 1,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Whether more than one owner holds the page at `physaddr`.
+ */
+bool pmem_page_shared(void *physaddr)
+{
+    struct pmem_page *page = pmem_page_desc((uint64_t)physaddr);
+    return __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 0;
+}
 
-        // Try again with new block index
-        return pmem_alloc_page();
+/**
+ * Free a single page (4K) into this CPU's page cache.
+ * Once the cache fills up, a batch is drained back to the free lists.
+ */
+void pmem_free_page(void *physaddr)
+{
+    // Pages from other nodes go straight home, so the cache stays local
+    if (pmem_nodes_count > 1 &&
+        pmem_page_node(physaddr) != pmem_cpu_nodes[this_cpu_id()]) {
+        pmem_free_pages(physaddr, 0);
+        return;
     }
 
-    block->limit -= PAGE_SIZE;
-    return block->limit;
+    uint64_t flags = irq_save();
+    struct pmem_pcp *pcp = pmem_pcps + this_cpu_id();
+    if (pcp->count < PMEM_PCP_SIZE) {
+        pcp->stats.free_hits += 1;
+    } else {
+        pcp->stats.free_misses += 1;
+        pmem_pcp_drain(pcp, PMEM_PCP_BATCH);
+    }
+    pcp->pages[pcp->count++] = (uint64_t)physaddr;
+    irq_restore(flags);
 }
 
-static int pmem_cmp(const struct pmem_block *a, const struct pmem_block *b)
+/**
+ * Free every page in [base, limit), which need not be a power of two.
+ * The range is split into the largest naturally-aligned buddy blocks.
+ * Caller holds `pmem_lock`.
+ */
+static void pmem_free_range_locked(uint64_t base, uint64_t limit)
 {
+    // Only whole pages can be freed
+    if (base % PAGE_SIZE != 0) {
+        base += PAGE_SIZE - (base % PAGE_SIZE);
+    }
+    limit -= (limit % PAGE_SIZE);
+
+    while (base < limit) {
+        unsigned int order = PMEM_MAX_ORDER;
+        while (order > 0 && ((base % PAGES_TO_BYTES(1ull << order)) != 0 ||
+                             base + PAGES_TO_BYTES(1ull << order) > limit)) {
+            order--;
+        }
+        pmem_buddy_free((void *)base, order);
+        base += PAGES_TO_BYTES(1ull << order);
+    }
+}
+
+/**
+ * Free every page in [base, limit), which need not be a power of two.
+ */
+void pmem_free_range(uint64_t base, uint64_t limit)
+{
+    uint64_t flags = spin_lock_irqsave(&pmem_lock);
+    pmem_free_range_locked(base, limit);
+    spin_unlock_irqrestore(&pmem_lock, flags);
+}
+
+/**
+ * Allocate a single zeroed page (4K), preferably one that was cleared in the
+ * background already. Needs the physmap.
+ */
+void *pmem_alloc_zeroed_page()
+{
+    uint64_t page = 0;
+    uint64_t flags = spin_lock_irqsave(&pmem_zero_pool_lock);
+    if (pmem_zero_pool_count > 0) {
+        page = pmem_zero_pool[--pmem_zero_pool_count];
+        pmem_zero_pool_hits += 1;
+    } else {
+        pmem_zero_pool_misses += 1;
+    }
+    spin_unlock_irqrestore(&pmem_zero_pool_lock, flags);
+
+    if (page == 0) {
+        // Pool ran dry, pay for it now
+        page = (uint64_t)pmem_alloc_page();
+        memset(PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+    }
+    return (void *)page;
+}
+
+/**
+ * Top up the zeroed page pool by at most a batch of pages. Meant to be called
+ * when there's nothing better to do; the clearing itself happens with
+ * interrupts enabled.
+ */
+void pmem_zero_pool_fill()
+{
+    for (size_t i = 0; i < PMEM_ZERO_POOL_BATCH; i++) {
+        if (__atomic_load_n(&pmem_zero_pool_count, __ATOMIC_RELAXED) >=
+            PMEM_ZERO_POOL_SIZE) {
+            return;
+        }
+
+        uint64_t page = (uint64_t)pmem_alloc_page();
+        memset(PHYS_TO_VIRT(page), 0, PAGE_SIZE);
+
+        uint64_t flags = spin_lock_irqsave(&pmem_zero_pool_lock);
+        if (pmem_zero_pool_count < PMEM_ZERO_POOL_SIZE) {
+            pmem_zero_pool[pmem_zero_pool_count++] = page;
+            page = 0;
+        }
+        spin_unlock_irqrestore(&pmem_zero_pool_lock, flags);
+
+        if (page != 0) {
+            // Someone else filled it up in the meantime
+            pmem_free_page((void *)page);
+            return;
+        }
+    }
+}
+
+/**
+ * Number of free 4K pages left in the buddy allocator.
+ */
+size_t pmem_free_pages_count()
+{
+    return pmem_free_count;
+}
+
+/**
+ * Number of free 4K pages left on `node`.
+ */
+size_t pmem_node_free_pages_count(unsigned int node)
+{
+    if (node >= pmem_nodes_count) {
+        return 0;
+    }
+    return pmem_nodes[node].free_count;
+}
+
+/**
+ * NUMA node the page at `physaddr` lives on.
+ */
+unsigned int pmem_page_node(void *physaddr)
+{
+    struct pmem_block *block = pmem_find_block((uint64_t)physaddr);
+    return block != NULL ? block->node : 0;
+}
+
+void pmem_set_cpu_node(size_t cpu, unsigned int node)
+{
+    pmem_cpu_nodes[cpu] = node < pmem_nodes_count ? node : 0;
+}
+
+unsigned int pmem_cpu_node(size_t cpu)
+{
+    return pmem_cpu_nodes[cpu];
+}
+
+/**
+ * Sum the page cache counters over all CPUs.
+ */
+void pmem_pcp_get_stats(struct pmem_pcp_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        struct pmem_pcp_stats *s = &pmem_pcps[i].stats;
+        stats->alloc_hits += s->alloc_hits;
+        stats->alloc_misses += s->alloc_misses;
+        stats->free_hits += s->free_hits;
+        stats->free_misses += s->free_misses;
+        stats->refills += s->refills;
+        stats->refill_pages += s->refill_pages;
+        stats->drains += s->drains;
+        stats->drain_pages += s->drain_pages;
+    }
+}
+
+void pmem_print_stats()
+{
+    struct pmem_pcp_stats stats;
+    pmem_pcp_get_stats(&stats);
+
+    uint64_t allocs = stats.alloc_hits + stats.alloc_misses;
+    uint64_t frees = stats.free_hits + stats.free_misses;
+    printf("pmem: %u pages free\n", pmem_free_count);
+    if (pmem_nodes_count > 1) {
+        for (size_t i = 0; i < pmem_nodes_count; i++) {
+            printf("pmem: node %u: %u pages free\n", i,
+                   pmem_nodes[i].free_count);
+        }
+    }
+    printf("pmem: page cache alloc hits %u/%u (%u%%), free hits %u/%u (%u%%)\n",
+           stats.alloc_hits, allocs,
+           allocs ? stats.alloc_hits * 100 / allocs : 0, stats.free_hits,
+           frees, frees ? stats.free_hits * 100 / frees : 0);
+    printf("pmem: %u refills (avg %u pages), %u drains (avg %u pages)\n",
+           stats.refills, stats.refills ? stats.refill_pages / stats.refills : 0,
+           stats.drains, stats.drains ? stats.drain_pages / stats.drains : 0);
+    printf("pmem: zeroed pool %u/%u pages, hits %u, misses %u\n",
+           pmem_zero_pool_count, PMEM_ZERO_POOL_SIZE, pmem_zero_pool_hits,
+           pmem_zero_pool_misses);
+}
+
+static int pmem_cmp(const void *pa, const void *pb)
+{
+    const struct pmem_block *a = pa;
+    const struct pmem_block *b = pb;
     // We're dealing with potentially huge numbers
     if (a->base > b->base) {
         return 1;
@@ -53,6 +606,108 @@ static int pmem_cmp(const struct pmem_block *a, const struct pmem_block *b)
     }
 }
 
+static void pmem_reserve(uint64_t base, uint64_t limit)
+{
+    if (pmem_reserved_count >= MAX_PMEM_RESERVED) {
+        // TODO: Panic
+        printf("Too many reserved physical memory ranges!\n");
+        return;
+    }
+
+    // Widen to whole pages
+    base -= (base % PAGE_SIZE);
+    if (limit % PAGE_SIZE != 0) {
+        limit += PAGE_SIZE - (limit % PAGE_SIZE);
+    }
+
+    struct pmem_block *r = pmem_reserved + pmem_reserved_count;
+    pmem_reserved_count += 1;
+    r->base = base;
+    r->limit = limit;
+    qsort(pmem_reserved, pmem_reserved_count, sizeof(*pmem_reserved),
+          pmem_cmp);
+}
+
+/**
+ * Find `size` bytes of usable RAM below PMEM_EARLY_LIMIT that doesn't collide
+ * with anything reserved, and reserve it. Only for use before the buddy
+ * allocator has been seeded. Returns the physical address, or 0.
+ */
+static uint64_t pmem_early_alloc(uint64_t size)
+{
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        uint64_t base = block->base;
+        uint64_t limit =
+            block->limit < PMEM_EARLY_LIMIT ? block->limit : PMEM_EARLY_LIMIT;
+
+        // Bump the candidate past every reserved range it collides with
+        // (reserved ranges are sorted, so a single pass will do)
+        for (size_t j = 0; j < pmem_reserved_count; j++) {
+            struct pmem_block *r = pmem_reserved + j;
+            if (base < r->limit && base + size > r->base) {
+                base = r->limit;
+            }
+        }
+
+        if (base + size <= limit) {
+            pmem_reserve(base, base + size);
+            return base;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Setup page descriptors for all usable RAM and hand every unreserved page to
+ * the buddy allocator.
+ */
+static void pmem_buddy_init()
+{
+    // Allocate descriptors for every page in one chunk
+    usable_pages = 0;
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        usable_pages += (block->limit - block->base) / PAGE_SIZE;
+    }
+    uint64_t pages_size = usable_pages * sizeof(struct pmem_page);
+    uint64_t pages_phys = pmem_early_alloc(pages_size);
+    if (pages_phys == 0) {
+        panic("No room for %u page descriptors!\n", usable_pages);
+    }
+
+    struct pmem_page *pages = (struct pmem_page *)(pages_phys + KERNEL_VMA);
+    memset(pages, 0, pages_size);
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        block->pages = pages;
+        for (uint64_t physaddr = block->base; physaddr < block->limit;
+             physaddr += PAGE_SIZE, pages++) {
+            pages->pfn = physaddr / PAGE_SIZE;
+        }
+    }
+
+    // Free everything that isn't reserved
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        uint64_t base = block->base;
+        for (size_t j = 0; j < pmem_reserved_count; j++) {
+            struct pmem_block *r = pmem_reserved + j;
+            if (r->limit <= base || r->base >= block->limit) {
+                continue;
+            }
+            if (r->base > base) {
+                pmem_free_range(base, r->base);
+            }
+            base = r->limit;
+        }
+        if (base < block->limit) {
+            pmem_free_range(base, block->limit);
+        }
+    }
+}
+
 /**
  * Determine what physical memory is available given the memory map from the bootloader,
  * then setup our physical memory manager so we can start allocating.
@@ -148,7 +803,7 @@ void pmem_init(struct mb2_info *mb2_info)
     break_overlap_loop:;
     } while (overlap);
 
-    // Summary & mark free pages
+    // Summary
     size_t total_block_size = 0;
     for (size_t i = 0; i < pmem_blocks_count; i++) {
         struct pmem_block *block = pmem_block_map + i;
@@ -156,9 +811,153 @@ void pmem_init(struct mb2_info *mb2_info)
         total_block_size += block_size;
         printf("Available RAM %x .. %x (%u MiB)\n", block->base, block->limit,
                block_size / (1 << 20));
-        // We will allocate physical pages backwards starting from the last block
-        pmem_current_block = i;
     }
-    printf("Total physical memory entries mapped: %u (%u GiB)\n\n",
+    printf("Total physical memory entries mapped: %u (%u GiB)\n",
            pmem_blocks_count, total_block_size / (1 << 30));
+
+    // Keep our hands off low memory, the kernel image and the MB2 boot info
+    uint64_t mb2_info_phys = (uint64_t)mb2_info - KERNEL_VMA;
+    pmem_reserve(0, PMEM_LOW_LIMIT);
+    pmem_reserve(KERNEL_LMA, (uint64_t)_kernel_end - KERNEL_VMA);
+    pmem_reserve(mb2_info_phys, mb2_info_phys + mb2_info->total_size);
+
+    // Mark free pages
+    pmem_buddy_init();
+    printf("Physical page allocator: %u of %u pages free\n\n", pmem_free_count,
+           usable_pages);
+}
+
+/// Scratch space for splitting the block map along node boundaries
+static struct pmem_block pmem_numa_blocks[MAX_PMEM_ENTRIES];
+
+/**
+ * Split the block map so that no block straddles two nodes, tagging each
+ * block with its node. Caller holds `pmem_lock`.
+ */
+static void pmem_numa_split_blocks()
+{
+    size_t count = 0;
+    bool truncated = false;
+    for (size_t i = 0; i < pmem_blocks_count && !truncated; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        uint64_t base = block->base;
+        while (base < block->limit) {
+            if (count >= MAX_PMEM_ENTRIES) {
+                truncated = true;
+                break;
+            }
+
+            // Ranges are sorted, so the first one that ends past `base`
+            // either contains it or is the next one up
+            uint64_t limit = block->limit;
+            uint32_t node = 0;
+            for (size_t j = 0; j < numa_mem_ranges_count; j++) {
+                struct numa_mem_range *range = numa_mem_ranges + j;
+                if (range->limit <= base) {
+                    continue;
+                }
+                if (range->base <= base) {
+                    node = range->node;
+                    limit = range->limit < limit ? range->limit : limit;
+                } else if (range->base < limit) {
+                    limit = range->base;
+                }
+                break;
+            }
+
+            struct pmem_block *split = pmem_numa_blocks + count;
+            count += 1;
+            split->base = base;
+            split->limit = limit;
+            split->pages = block->pages + (base - block->base) / PAGE_SIZE;
+            split->node = node;
+            base = limit;
+        }
+    }
+
+    if (truncated) {
+        panic("pmem: too many blocks after splitting by node!\n");
+    }
+    for (size_t i = 0; i < count; i++) {
+        pmem_block_map[i] = pmem_numa_blocks[i];
+    }
+    pmem_blocks_count = count;
+}
+
+/**
+ * Move every free page onto the free lists of the node it belongs to, now that
+ * we know the topology, and work out each node's fallback order.
+ * Pages sitting in per-CPU caches stay there until they're drained.
+ */
+void pmem_numa_init()
+{
+    uint64_t flags = spin_lock_irqsave(&pmem_lock);
+
+    // Mark every free page (not just the heads) as moving, and empty the lists
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        size_t n = (block->limit - block->base) / PAGE_SIZE;
+        for (size_t j = 0; j < n;) {
+            struct pmem_page *page = block->pages + j;
+            if (!(page->flags & PMEM_PAGE_FREE)) {
+                j++;
+                continue;
+            }
+            size_t chunk = 1ull << page->order;
+            for (size_t k = 0; k < chunk; k++) {
+                page[k].flags = (page[k].flags & ~PMEM_PAGE_FREE) |
+                                PMEM_PAGE_MOVING;
+                page[k].next = NULL;
+                page[k].prev = NULL;
+            }
+            j += chunk;
+        }
+    }
+    for (size_t i = 0; i < NUMA_MAX_NODES; i++) {
+        struct pmem_node *node = pmem_nodes + i;
+        for (size_t order = 0; order <= PMEM_MAX_ORDER; order++) {
+            node->free_lists[order] = NULL;
+        }
+        node->free_count = 0;
+    }
+    pmem_free_count = 0;
+
+    pmem_numa_split_blocks();
+    pmem_nodes_count = numa_nodes_count;
+
+    // Free the moving pages again, run by run, onto their new nodes
+    for (size_t i = 0; i < pmem_blocks_count; i++) {
+        struct pmem_block *block = pmem_block_map + i;
+        size_t n = (block->limit - block->base) / PAGE_SIZE;
+        for (size_t j = 0; j < n;) {
+            if (!(block->pages[j].flags & PMEM_PAGE_MOVING)) {
+                j++;
+                continue;
+            }
+            size_t run = j;
+            while (run < n && (block->pages[run].flags & PMEM_PAGE_MOVING)) {
+                block->pages[run].flags &= ~PMEM_PAGE_MOVING;
+                run++;
+            }
+            pmem_free_range_locked(block->base + PAGES_TO_BYTES(j),
+                                   block->base + PAGES_TO_BYTES(run));
+            j = run;
+        }
+    }
+
+    // Fallback order for each node: itself, then by distance
+    for (size_t i = 0; i < pmem_nodes_count; i++) {
+        unsigned int *fallback = pmem_nodes[i].fallback;
+        for (size_t j = 0; j < pmem_nodes_count; j++) {
+            size_t k = j;
+            while (k > 0 &&
+                   numa_distance(i, fallback[k - 1]) > numa_distance(i, j)) {
+                fallback[k] = fallback[k - 1];
+                k--;
+            }
+            fallback[k] = j;
+        }
+    }
+
+    spin_unlock_irqrestore(&pmem_lock, flags);
 }
@@ -0,0 +1,341 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <ringbuf.h>
+#include "kernel/colours.h"
+#include "kernel/cpu.h"
+#include "kernel/percpu.h"
+#include "kernel/printk.h"
+#include "kernel/serial.h"
+#include "kernel/spinlock.h"
+#include "kernel/terminal.h"
+#include "kernel/timer.h"
+#include "kernel/workqueue.h"
+
+/**
+ * One CPU's log. Anything on the CPU pushes (including interrupt handlers),
+ * only the holder of printk_drain_lock pops and touches the rest.
+ */
+struct printk_log {
+    struct mpsc_ring ring;
+    size_t overflows; /** ring.overflows already reported */
+    struct printk_record staged; /** Popped, waiting its turn in the merge */
+    bool has_staged;
+    struct work work; /** Drains on this CPU's kworker */
+};
+
+static struct printk_log printk_logs[MAX_CPUS];
+static uint8_t printk_storage[MAX_CPUS][MPSC_RING_STORAGE_SIZE(
+    PRINTK_RING_RECORDS, sizeof(struct printk_record))]
+    __attribute__((aligned(8)));
+static bool printk_ready = false;
+static bool printk_async = false;
+static bool printk_panicking = false;
+static struct spinlock printk_drain_lock;
+static bool printk_serial_bol = true; /** Serial is at the start of a line */
+
+static const char *printk_tags[] = {
+    [PRINTK_EMERG] = "EMERG: ",
+    [PRINTK_ERR] = "ERR: ",
+    [PRINTK_WARN] = "WARN: ",
+    [PRINTK_INFO] = "",
+    [PRINTK_DEBUG] = "DEBUG: ",
+};
+
+/**
+ * The first printk comes from the BSP before any other CPU is up, so it can
+ * set up every ring.
+ */
+static void printk_init()
+{
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        mpsc_ring_init(&printk_logs[cpu].ring, printk_storage[cpu],
+                       sizeof(struct printk_record), PRINTK_RING_RECORDS);
+    }
+    __atomic_store_n(&printk_ready, true, __ATOMIC_RELEASE);
+}
+
+static size_t printk_ring_count(struct printk_log *log)
+{
+    return __atomic_load_n(&log->ring.head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&log->ring.tail, __ATOMIC_ACQUIRE);
+}
+
+static bool printk_pending()
+{
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct printk_log *log = printk_logs + cpu;
+        if (printk_ring_count(log) > 0 ||
+            __atomic_load_n(&log->ring.overflows, __ATOMIC_RELAXED) !=
+                log->overflows) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Serial sink. Every line gets the time since boot and, unless it's plain
+ * INFO, its level.
+ */
+static void printk_emit_serial(struct printk_record *rec, const char *text)
+{
+    bool out = serial_present && !serial_claimed();
+    char segment[PRINTK_RECORD_TEXT + 1];
+    while (*text != '\0') {
+        if (printk_serial_bol && out) {
+            uint64_t us = tsc_to_ns(rec->tsc) / NSEC_PER_USEC;
+            serial_write("[");
+            serial_write_dec(us / 1000000, 1);
+            serial_write(".");
+            serial_write_dec(us % 1000000, 6);
+            serial_write("] ");
+            serial_write(printk_tags[rec->level]);
+        }
+        size_t n = 0;
+        while (text[n] != '\0' && text[n] != '\n') {
+            n += 1;
+        }
+        if (text[n] == '\n') {
+            n += 1;
+        }
+        memcpy(segment, text, n);
+        segment[n] = '\0';
+        if (out) {
+            serial_write(segment);
+        }
+        printk_serial_bol = segment[n - 1] == '\n';
+        text += n;
+    }
+}
+
+static void printk_emit(struct printk_record *rec)
+{
+    char text[PRINTK_RECORD_TEXT + 1];
+    memcpy(text, rec->text, rec->len);
+    text[rec->len] = '\0';
+    if (rec->level <= PRINTK_FB_LEVEL) {
+        terminal_write(text);
+    }
+    printk_emit_serial(rec, text);
+}
+
+/**
+ * Say how many records fell off full rings since last time.
+ */
+static void printk_report_drops()
+{
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct printk_log *log = printk_logs + cpu;
+        size_t overflows =
+            __atomic_load_n(&log->ring.overflows, __ATOMIC_RELAXED);
+        if (overflows == log->overflows) {
+            continue;
+        }
+        struct printk_record rec = {
+            .tsc = rdtsc(),
+            .level = PRINTK_WARN,
+            .cpu = cpu,
+        };
+        rec.len = snprintf(rec.text, sizeof(rec.text),
+                           "printk: %u records dropped on CPU %u\n",
+                           overflows - log->overflows, (uint64_t)cpu);
+        log->overflows = overflows;
+        printk_emit(&rec);
+    }
+}
+
+/**
+ * Emit the oldest record across all CPUs. Each CPU's ring is already in
+ * order, so it's a merge on the record at the front of each. Returns false
+ * once they're all empty.
+ */
+static bool printk_emit_next()
+{
+    struct printk_log *oldest = NULL;
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct printk_log *log = printk_logs + cpu;
+        if (!log->has_staged) {
+            log->has_staged = mpsc_ring_pop(&log->ring, &log->staged);
+        }
+        if (log->has_staged &&
+            (oldest == NULL || log->staged.tsc < oldest->staged.tsc)) {
+            oldest = log;
+        }
+    }
+    if (oldest == NULL) {
+        return false;
+    }
+    printk_emit(&oldest->staged);
+    oldest->has_staged = false;
+    return true;
+}
+
+/**
+ * Push everything out to the sinks, unless someone else is already at it, in
+ * which case they'll see what we added before they let go. `sync` also gets
+ * it onto the screen before returning.
+ */
+static void printk_drain(bool sync)
+{
+    do {
+        if (!spin_trylock(&printk_drain_lock)) {
+            return;
+        }
+        printk_report_drops();
+        while (printk_emit_next()) {
+        }
+        spin_unlock(&printk_drain_lock);
+    } while (printk_pending());
+
+    if (sync) {
+        terminal_sync();
+    }
+}
+
+static void printk_work(void *arg)
+{
+    (void)arg;
+    printk_drain(false);
+}
+
+/**
+ * How much of `text` fits in a record, without splitting an escape sequence
+ * (the terminal wants them whole).
+ */
+static size_t printk_chunk(const char *text, size_t len)
+{
+    if (len <= PRINTK_RECORD_TEXT) {
+        return len;
+    }
+    for (size_t i = PRINTK_RECORD_TEXT; i > 0; i--) {
+        char c = text[i - 1];
+        if (c == '\x1b') {
+            return i > 1 ? i - 1 : PRINTK_RECORD_TEXT;
+        }
+        if (!(c == '[' || c == ';' || (c >= '0' && c <= '9'))) {
+            break;
+        }
+    }
+    return PRINTK_RECORD_TEXT;
+}
+
+/**
+ * Log a message at `level`. Costs a format and a copy into this CPU's ring,
+ * the sinks run later on the kworker, except for PRINTK_SYNC_LEVEL and worse,
+ * before printk_async_init, or when the ring is getting full.
+ */
+int vprintk(int level, const char *fmt, va_list ap)
+{
+    char line[PRINTK_LINE_MAX];
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    size_t left = len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1;
+
+    if (!__atomic_load_n(&printk_ready, __ATOMIC_ACQUIRE)) {
+        printk_init();
+    }
+    if (level < PRINTK_EMERG) {
+        level = PRINTK_EMERG;
+    } else if (level > PRINTK_DEBUG) {
+        level = PRINTK_DEBUG;
+    }
+
+    bool sync = level <= PRINTK_SYNC_LEVEL ||
+                !__atomic_load_n(&printk_async, __ATOMIC_ACQUIRE);
+    // Interrupts off, so the records of a message stay together and an
+    // interrupt handler can't catch our CPU number going stale
+    uint64_t flags = irq_save();
+    size_t cpu = this_cpu_id();
+    struct printk_log *log = printk_logs + cpu;
+    struct printk_record rec = {
+        .tsc = rdtsc(),
+        .level = level,
+        .cpu = cpu,
+    };
+    for (const char *text = line; left > 0;) {
+        rec.len = printk_chunk(text, left);
+        memcpy(rec.text, text, rec.len);
+        mpsc_ring_push(&log->ring, &rec);
+        text += rec.len;
+        left -= rec.len;
+    }
+    if (printk_ring_count(log) > PRINTK_RING_RECORDS / 2) {
+        // The kworker isn't keeping up, better slow than lossy
+        sync = true;
+    }
+    irq_restore(flags);
+
+    if (sync) {
+        printk_drain(true);
+    } else {
+        work_queue(&log->work);
+    }
+    return len;
+}
+
+int printk(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vprintk(level, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/**
+ * Get everything logged so far out before returning, e.g. before taking the
+ * serial port for a dump.
+ */
+void printk_flush()
+{
+    printk_drain(true);
+}
+
+/**
+ * Hand draining over to the kworkers. Needs workqueue_init.
+ */
+void printk_async_init()
+{
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        work_init(&printk_logs[cpu].work, printk_work, NULL);
+    }
+    __atomic_store_n(&printk_async, true, __ATOMIC_RELEASE);
+    printk_drain(false);
+}
+
+/**
+ * Something's gone unrecoverably wrong: get the log and the message out
+ * synchronously, whatever locks are held (whoever has them isn't coming back,
+ * or it's us), then stop this CPU for good.
+ */
+void panic(const char *fmt, ...)
+{
+    irq_save();
+    if (__atomic_exchange_n(&printk_panicking, true, __ATOMIC_ACQ_REL)) {
+        // A panic while panicking, or on another CPU. The first one talks.
+        for (;;) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+
+    terminal_panic();
+    serial_panic();
+    __atomic_store_n(&printk_async, false, __ATOMIC_RELEASE);
+    spin_unlock(&printk_drain_lock);
+    // Make room, and keep what led up to this above it
+    printk_drain(true);
+
+    va_list ap;
+    va_start(ap, fmt);
+    printk(PRINTK_EMERG, BG_BIANCO(FG_ROSSO(" PANIC ")) " on CPU %u: ",
+           (uint64_t)this_cpu_id());
+    vprintk(PRINTK_EMERG, fmt, ap);
+    va_end(ap);
+
+    for (;;) {
+        __asm__ volatile("cli; hlt");
+    }
+}
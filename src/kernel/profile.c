@@ -0,0 +1,343 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/paging.h"
+#include "kernel/percpu.h"
+#include "kernel/printk.h"
+#include "kernel/profile.h"
+#include "kernel/serial.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+#include "kernel/vmem.h"
+
+/**
+ * One CPU's samples. Only that CPU writes it (from NMI or timer context), and
+ * `count` is published after each sample, so readers need no lock.
+ */
+struct profile_buffer {
+    struct profile_sample *samples;
+    size_t count;
+    size_t dropped;
+    struct timer timer; /** PROFILE_TIMER only */
+};
+
+static struct profile_buffer profile_buffers[MAX_CPUS];
+static size_t profile_buffers_count = 0;
+static enum profile_mode profile_mode = PROFILE_OFF;
+static bool profile_active = false;
+static uint64_t profile_period = 0; /** Cycles, or ns for PROFILE_TIMER */
+
+static uint32_t pmu_version = 0;
+static uint32_t pmu_width = 0;
+
+/**
+ * Is `fp` a frame we can read without faulting? Frames only go up the stack,
+ * and never further than PROFILE_STACK_SPAN from where we were.
+ */
+static bool profile_frame_ok(uint64_t fp, uint64_t lowest, uint64_t rsp)
+{
+    uint64_t phys;
+    return fp >= lowest && fp - rsp < PROFILE_STACK_SPAN && (fp & 0x7) == 0 &&
+           paging_translate(fp, &phys) && paging_translate(fp + 8, &phys);
+}
+
+/**
+ * Record a sample for this CPU: `rip`, then return addresses from the frame
+ * chain starting at `rbp`, which ends at a 0 rbp (see thread_create). Runs in
+ * NMI context, so no locks and nothing that can fault.
+ */
+static void profile_record(uint64_t rip, uint64_t rbp, uint64_t rsp)
+{
+    size_t cpu = this_cpu_id();
+    if (cpu >= profile_buffers_count) {
+        return;
+    }
+    struct profile_buffer *buf = profile_buffers + cpu;
+    size_t n = buf->count;
+    if (n >= PROFILE_SAMPLES) {
+        buf->dropped += 1;
+        return;
+    }
+
+    struct profile_sample *sample = buf->samples + n;
+    sample->pcs[0] = rip;
+    size_t depth = 1;
+    uint64_t fp = rbp;
+    uint64_t lowest = rsp;
+    while (depth < PROFILE_MAX_DEPTH && profile_frame_ok(fp, lowest, rsp)) {
+        uint64_t *frame = (uint64_t *)fp;
+        sample->pcs[depth++] = frame[1];
+        lowest = fp + 16;
+        fp = frame[0];
+    }
+    sample->depth = depth;
+    __atomic_store_n(&buf->count, n + 1, __ATOMIC_RELEASE);
+}
+
+static void profile_pmu_arm()
+{
+    uint64_t mask = (pmu_width < 64 ? (1ull << pmu_width) : 0) - 1;
+    wrmsr(MSR_PMC0, -profile_period & mask);
+}
+
+static void profile_pmu_stop()
+{
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    if (pmu_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+    }
+    lapic_write(LAPIC_LVT_PERFMON, LAPIC_LVT_NMI | LAPIC_LVT_MASKED);
+}
+
+/**
+ * Did PMC0 overflow? Without the global status MSR, a counter that's wrapped
+ * past zero has lost its top bit.
+ */
+static bool profile_pmu_overflowed()
+{
+    if (pmu_version >= 2) {
+        return rdmsr(MSR_PERF_GLOBAL_STATUS) & 1;
+    }
+    return !(rdmsr(MSR_PMC0) & (1ull << (pmu_width - 1)));
+}
+
+/**
+ * NMI handler. Returns false if the NMI wasn't ours.
+ */
+bool profile_nmi(struct interrupt_frame *frame)
+{
+    if (profile_mode != PROFILE_PMU || !profile_pmu_overflowed()) {
+        return false;
+    }
+
+    if (__atomic_load_n(&profile_active, __ATOMIC_RELAXED)) {
+        profile_record(frame->rip, frame->rbp, frame->rsp);
+        profile_pmu_arm();
+        if (pmu_version >= 2) {
+            wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+        }
+        // The LVT entry masks itself when the PMI is delivered
+        lapic_write(LAPIC_LVT_PERFMON, LAPIC_LVT_NMI);
+    } else {
+        profile_pmu_stop();
+        if (pmu_version >= 2) {
+            wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+        }
+    }
+    return true;
+}
+
+/**
+ * Fallback sampler, on the timer interrupt. Whatever that interrupted is the
+ * sample.
+ */
+static void profile_timer_fire(void *arg)
+{
+    struct profile_buffer *buf = arg;
+    if (!__atomic_load_n(&profile_active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    struct irq_frame *frame = irq_current_frame();
+    if (frame != NULL) {
+        profile_record(frame->rip, frame->rbp, frame->rsp);
+    }
+    timer_arm(&buf->timer, ktime_get_ns() + profile_period);
+}
+
+/**
+ * Start sampling on this CPU. Interrupts are off.
+ */
+static void profile_start_cpu()
+{
+    size_t cpu = this_cpu_id();
+    if (cpu >= profile_buffers_count) {
+        return;
+    }
+
+    switch (profile_mode) {
+    case PROFILE_PMU:
+        wrmsr(MSR_PERFEVTSEL0, 0);
+        profile_pmu_arm();
+        lapic_write(LAPIC_LVT_PERFMON, LAPIC_LVT_NMI);
+        wrmsr(MSR_PERFEVTSEL0, PERFEVTSEL_CYCLES | PERFEVTSEL_OS |
+                                   PERFEVTSEL_INT | PERFEVTSEL_EN);
+        if (pmu_version >= 2) {
+            wrmsr(MSR_PERF_GLOBAL_CTRL, 1);
+        }
+        break;
+    case PROFILE_TIMER: {
+        struct profile_buffer *buf = profile_buffers + cpu;
+        timer_setup(&buf->timer, profile_timer_fire, buf);
+        timer_arm(&buf->timer, ktime_get_ns() + profile_period);
+        break;
+    }
+    case PROFILE_OFF:
+        break;
+    }
+}
+
+static void profile_start_irq(unsigned int vector, void *ctx)
+{
+    (void)vector;
+    (void)ctx;
+    if (__atomic_load_n(&profile_active, __ATOMIC_ACQUIRE)) {
+        profile_start_cpu();
+    }
+}
+
+/**
+ * Join in on a profile that's already running. Called by each AP once its
+ * LAPIC and timer are up.
+ */
+void profile_cpu_online()
+{
+    if (__atomic_load_n(&profile_active, __ATOMIC_ACQUIRE)) {
+        uint64_t flags = irq_save();
+        profile_start_cpu();
+        irq_restore(flags);
+    }
+}
+
+/**
+ * Throw away the last profile and sample every CPU once per `period_cycles`
+ * (TSC cycles in timer mode). Returns false if there's nothing to sample with.
+ */
+bool profile_start(uint64_t period_cycles)
+{
+    if (profile_mode == PROFILE_OFF || profile_active) {
+        return false;
+    }
+    if (period_cycles < PROFILE_MIN_PERIOD_CYCLES) {
+        period_cycles = PROFILE_MIN_PERIOD_CYCLES;
+    }
+    profile_period = profile_mode == PROFILE_PMU ? period_cycles :
+                                                   tsc_to_ns(period_cycles);
+
+    // Every CPU in the MADT, including the ones that aren't up yet. NMIs
+    // can't take page faults, so the buffers are populated now.
+    size_t cpus = apic_cpus_count > 0 ? apic_cpus_count : 1;
+    for (size_t cpu = 0; cpu < cpus; cpu++) {
+        struct profile_buffer *buf = profile_buffers + cpu;
+        if (buf->samples == NULL) {
+            size_t size = PROFILE_SAMPLES * sizeof(struct profile_sample);
+            size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            buf->samples = vmem_alloc(size);
+            vmem_populate((uint8_t *)buf->samples + size, size);
+        }
+        buf->count = 0;
+        buf->dropped = 0;
+    }
+    profile_buffers_count = cpus;
+
+    __atomic_store_n(&profile_active, true, __ATOMIC_RELEASE);
+    uint64_t flags = irq_save();
+    profile_start_cpu();
+    irq_restore(flags);
+    for (size_t cpu = 0; cpu < percpu_count; cpu++) {
+        if (cpu != this_cpu_id()) {
+            lapic_send_ipi(percpu_areas[cpu].apic_id, PROFILE_VECTOR);
+        }
+    }
+    return true;
+}
+
+/**
+ * Stop sampling. Other CPUs notice on their next sample and don't re-arm, and
+ * nothing past the counts read by profile_dump is looked at, so there's no
+ * need to wait for them.
+ */
+void profile_stop()
+{
+    __atomic_store_n(&profile_active, false, __ATOMIC_RELEASE);
+    uint64_t flags = irq_save();
+    if (profile_mode == PROFILE_PMU) {
+        profile_pmu_stop();
+    } else if (profile_mode == PROFILE_TIMER) {
+        for (size_t cpu = 0; cpu < profile_buffers_count; cpu++) {
+            timer_cancel(&profile_buffers[cpu].timer);
+        }
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Send every sample over serial, one line each, leaf first:
+ *   PROFILE BEGIN <mode> <period>
+ *   CPU <id> <samples> <dropped>
+ *   S <pc> <pc> ...
+ *   PROFILE END
+ * All numbers are hex. tools/profile.py symbolizes and folds them.
+ */
+void profile_dump()
+{
+    if (!serial_present) {
+        printf("Profile: no serial port to dump to\n");
+        return;
+    }
+
+    size_t total = 0;
+    printk_flush();
+    serial_claim();
+    serial_write("PROFILE BEGIN ");
+    serial_write(profile_mode == PROFILE_PMU ? "pmu " : "timer ");
+    serial_write_hex(profile_period);
+    serial_write("\n");
+    for (size_t cpu = 0; cpu < profile_buffers_count; cpu++) {
+        struct profile_buffer *buf = profile_buffers + cpu;
+        size_t count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+        serial_write("CPU ");
+        serial_write_hex(cpu);
+        serial_write(" ");
+        serial_write_hex(count);
+        serial_write(" ");
+        serial_write_hex(buf->dropped);
+        serial_write("\n");
+        for (size_t i = 0; i < count; i++) {
+            struct profile_sample *sample = buf->samples + i;
+            serial_write("S");
+            for (size_t d = 0; d < sample->depth; d++) {
+                serial_write(" ");
+                serial_write_hex(sample->pcs[d]);
+            }
+            serial_write("\n");
+        }
+        total += count;
+    }
+    serial_write("PROFILE END\n");
+    serial_release();
+    printf("Profile: %u samples written to serial\n", total);
+}
+
+/**
+ * Pick a sample source: PMC0 counting unhalted cycles if there's an
+ * architectural PMU, a kernel timer otherwise. Needs the APIC and timer_init.
+ */
+void profile_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= CPUID_PERFMON && apic_enabled) {
+        cpuid(CPUID_PERFMON, &eax, &ebx, &ecx, &edx);
+        pmu_version = eax & 0xff;
+        uint32_t counters = (eax >> 8) & 0xff;
+        pmu_width = (eax >> 16) & 0xff;
+        uint32_t events = (eax >> 24) & 0xff;
+        // EBX bit 0 set means unhalted core cycles isn't available
+        if (pmu_version > 0 && counters > 0 && pmu_width > 32 &&
+            events > 0 && !(ebx & 1)) {
+            profile_mode = PROFILE_PMU;
+        }
+    }
+    if (profile_mode == PROFILE_OFF) {
+        profile_mode = PROFILE_TIMER;
+    }
+
+    irq_register(PROFILE_VECTOR, profile_start_irq, NULL);
+    printf("Profile: sampling with %s\n",
+           profile_mode == PROFILE_PMU ? "PMU overflow NMIs" :
+                                         "the timer interrupt");
+}
@@ -0,0 +1,465 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/apic.h"
+#include "kernel/interrupts.h"
+#include "kernel/percpu.h"
+#include "kernel/pmem.h"
+#include "kernel/sched.h"
+#include "kernel/slab.h"
+#include "kernel/softirq.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+#include "kernel/vmem.h"
+
+/**
+ * Per-CPU run queue. A CPU holds its own `lock` from picking the next thread
+ * until it's running on the next thread's stack, so nothing on this queue
+ * can be stolen while we're still on its stack.
+ */
+struct sched_rq {
+    struct spinlock lock;
+    struct thread *head[SCHED_PRIORITIES];
+    struct thread *tail[SCHED_PRIORITIES];
+    size_t ready; /** Threads in head/tail */
+    struct thread *current;
+    struct thread *idle; /** NULL until sched_start on this CPU */
+    struct thread *dead; /** Switched away from for the last time */
+    struct timer slice; /** Preempts `current`, only armed while busy */
+    bool need_resched; /** Checked on the way out of interrupts */
+};
+
+static struct sched_rq sched_rqs[MAX_CPUS];
+static size_t sched_next_id = 0;
+/// CPUs running their idle thread, which need a kick to notice new work
+static uint32_t sched_idle_cpus = 0;
+
+extern void sched_switch(uint64_t *prev_rsp, uint64_t next_rsp);
+extern void sched_thread_start(void);
+
+/**
+ * Append `thread` to `rq` behind everything else of the same priority.
+ * Caller holds `rq->lock`.
+ */
+static void sched_enqueue_locked(struct sched_rq *rq, struct thread *thread)
+{
+    unsigned int prio = thread->priority;
+    thread->state = THREAD_READY;
+    thread->cpu = rq - sched_rqs;
+    thread->next = NULL;
+    if (rq->tail[prio] != NULL) {
+        rq->tail[prio]->next = thread;
+    } else {
+        rq->head[prio] = thread;
+    }
+    rq->tail[prio] = thread;
+    rq->ready += 1;
+}
+
+/**
+ * Send CPU `cpu` a reschedule IPI.
+ */
+static void sched_kick(size_t cpu)
+{
+    lapic_send_ipi(percpu_areas[cpu].apic_id, SCHED_RESCHED_VECTOR);
+}
+
+/**
+ * Make `thread` runnable on `rq`, and make sure someone gets to it: preempt
+ * `rq`'s CPU if it's idle or running something less important, otherwise
+ * kick an idle CPU that's allowed to steal it. Caller holds `rq->lock`, with
+ * interrupts off.
+ */
+static void sched_wake_locked(struct sched_rq *rq, struct thread *thread)
+{
+    size_t cpu = rq - sched_rqs;
+    sched_enqueue_locked(rq, thread);
+
+    if (rq->current == NULL) {
+        return; // CPU isn't scheduling yet, it'll find it in sched_start
+    }
+    if (rq->current == rq->idle ||
+        thread->priority < rq->current->priority) {
+        if (cpu == this_cpu_id()) {
+            rq->need_resched = true;
+        } else {
+            sched_kick(cpu);
+        }
+        return;
+    }
+
+    uint32_t idle = __atomic_load_n(&sched_idle_cpus, __ATOMIC_RELAXED) &
+                    thread->affinity & ~SCHED_CPU(this_cpu_id());
+    if (idle != 0) {
+        sched_kick(__builtin_ctz(idle));
+    }
+}
+
+/**
+ * Take the first thread from `rq` that may run on `cpu`, highest priority
+ * first. Caller holds `rq->lock`.
+ */
+static struct thread *sched_dequeue_locked(struct sched_rq *rq, size_t cpu)
+{
+    for (unsigned int prio = 0; prio < SCHED_PRIORITIES; prio++) {
+        struct thread *prev = NULL;
+        for (struct thread *t = rq->head[prio]; t != NULL;
+             prev = t, t = t->next) {
+            if (!(t->affinity & SCHED_CPU(cpu))) {
+                continue;
+            }
+            if (prev != NULL) {
+                prev->next = t->next;
+            } else {
+                rq->head[prio] = t->next;
+            }
+            if (rq->tail[prio] == t) {
+                rq->tail[prio] = prev;
+            }
+            t->next = NULL;
+            rq->ready -= 1;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Look for work on other CPUs' queues. Caller holds `rq->lock`, so victims
+ * are only trylocked: two CPUs stealing from each other must not deadlock.
+ */
+static struct thread *sched_steal(struct sched_rq *rq)
+{
+    size_t self = rq - sched_rqs;
+    for (size_t i = 1; i < percpu_count; i++) {
+        struct sched_rq *victim = sched_rqs + (self + i) % percpu_count;
+        if (__atomic_load_n(&victim->ready, __ATOMIC_RELAXED) == 0 ||
+            !spin_trylock(&victim->lock)) {
+            continue;
+        }
+        struct thread *thread = sched_dequeue_locked(victim, self);
+        spin_unlock(&victim->lock);
+        if (thread != NULL) {
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Second half of a switch, on the next thread's stack: let go of this CPU's
+ * run queue and free whatever thread exited on the way here.
+ */
+static void sched_finish_switch()
+{
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    struct thread *dead = rq->dead;
+    rq->dead = NULL;
+    spin_unlock(&rq->lock);
+
+    if (dead != NULL) {
+        vmem_free(dead->stack_top);
+        kfree(dead);
+    }
+}
+
+/**
+ * Called by sched_thread_start before a new thread's entry point.
+ */
+void sched_thread_begin()
+{
+    sched_finish_switch();
+    interrupts_enable();
+}
+
+/**
+ * Switch to the best thread that can run here: local first, then stolen, then
+ * idle. The current thread goes back on the queue if it's still runnable.
+ * Caller has interrupts off and holds `rq->lock`, which is dropped.
+ */
+static void sched_reschedule_locked(struct sched_rq *rq)
+{
+    size_t cpu = rq - sched_rqs;
+    struct thread *prev = rq->current;
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        sched_enqueue_locked(rq, prev);
+    }
+
+    struct thread *next = sched_dequeue_locked(rq, cpu);
+    if (next == NULL) {
+        next = sched_steal(rq);
+    }
+    if (next == NULL) {
+        next = rq->idle;
+    }
+    next->state = THREAD_RUNNING;
+    next->cpu = cpu;
+    rq->need_resched = false;
+    // Tickless while idle: nothing to preempt
+    if (next != rq->idle) {
+        timer_arm(&rq->slice, ktime_get_ns() + SCHED_TIMESLICE_NS);
+        __atomic_and_fetch(&sched_idle_cpus, ~SCHED_CPU(cpu), __ATOMIC_RELAXED);
+    } else {
+        timer_cancel(&rq->slice);
+        __atomic_or_fetch(&sched_idle_cpus, SCHED_CPU(cpu), __ATOMIC_RELAXED);
+    }
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    if (prev->state == THREAD_DEAD) {
+        rq->dead = prev;
+    }
+    rq->current = next;
+    sched_switch(&prev->rsp, next->rsp);
+    // Back on prev's stack, possibly on another CPU
+    sched_finish_switch();
+}
+
+/**
+ * Give up the CPU to whatever should run next, which may be the caller again.
+ */
+void schedule()
+{
+    uint64_t flags = irq_save();
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    spin_lock(&rq->lock);
+    sched_reschedule_locked(rq);
+    irq_restore(flags);
+}
+
+void sched_yield()
+{
+    schedule();
+}
+
+/**
+ * End of `thread`'s sleep. Runs from the timer interrupt on the CPU it went to
+ * sleep on.
+ */
+static void sched_wakeup(void *arg)
+{
+    struct thread *thread = arg;
+    struct sched_rq *rq = sched_rqs + thread->cpu;
+    spin_lock(&rq->lock);
+    if (thread->state == THREAD_SLEEPING) {
+        sched_wake_locked(rq, thread);
+    }
+    spin_unlock(&rq->lock);
+}
+
+/**
+ * Put the current thread to sleep for at least `ns` nanoseconds.
+ */
+void sched_sleep_ns(uint64_t ns)
+{
+    uint64_t flags = irq_save();
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    spin_lock(&rq->lock);
+    struct thread *self = rq->current;
+    self->state = THREAD_SLEEPING;
+    timer_arm(&self->wakeup, ktime_get_ns() + ns);
+    sched_reschedule_locked(rq);
+    irq_restore(flags);
+}
+
+/**
+ * Block the current thread until someone calls sched_wake on it. Returns
+ * straight away if that already happened since the last sched_block, so
+ * check-then-block loops don't lose wakeups.
+ */
+void sched_block()
+{
+    uint64_t flags = irq_save();
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    spin_lock(&rq->lock);
+    struct thread *self = rq->current;
+    if (self->wake_pending) {
+        self->wake_pending = false;
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    self->state = THREAD_BLOCKED;
+    sched_reschedule_locked(rq);
+    irq_restore(flags);
+}
+
+/**
+ * Make a blocked `thread` runnable again, or have its next sched_block return
+ * straight away. Safe from interrupt context; any preemption it causes
+ * happens on the next interrupt exit or schedule().
+ */
+void sched_wake(struct thread *thread)
+{
+    uint64_t flags = irq_save();
+    // The thread may be stolen by another CPU while we wait for the lock
+    struct sched_rq *rq;
+    for (;;) {
+        rq = sched_rqs + __atomic_load_n(&thread->cpu, __ATOMIC_RELAXED);
+        spin_lock(&rq->lock);
+        if (rq == sched_rqs + thread->cpu) {
+            break;
+        }
+        spin_unlock(&rq->lock);
+    }
+    if (thread->state == THREAD_BLOCKED) {
+        sched_wake_locked(rq, thread);
+    } else {
+        thread->wake_pending = true;
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+struct thread *thread_current()
+{
+    uint64_t flags = irq_save();
+    struct thread *self = sched_rqs[this_cpu_id()].current;
+    irq_restore(flags);
+    return self;
+}
+
+/**
+ * End the current thread. Its stack is freed by whoever runs next.
+ */
+void thread_exit()
+{
+    irq_save();
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    spin_lock(&rq->lock);
+    rq->current->state = THREAD_DEAD;
+    sched_reschedule_locked(rq);
+    __builtin_unreachable();
+}
+
+/**
+ * Start a thread running `entry(arg)` on one of the CPUs in `affinity`. It
+ * goes to whichever of those has the shortest run queue; from there it may
+ * only be stolen by CPUs in `affinity`.
+ */
+struct thread *thread_create(const char *name, void (*entry)(void *),
+                             void *arg, unsigned int priority,
+                             uint32_t affinity)
+{
+    // Pick the least busy CPU we're allowed on
+    struct sched_rq *rq = NULL;
+    for (size_t cpu = 0; cpu < percpu_count; cpu++) {
+        if ((affinity & SCHED_CPU(cpu)) &&
+            (rq == NULL || sched_rqs[cpu].ready < rq->ready)) {
+            rq = sched_rqs + cpu;
+        }
+    }
+    if (rq == NULL) {
+        printf("sched: no online CPU for %s in affinity 0x%x\n", name,
+               (uint64_t)affinity);
+        return NULL;
+    }
+    if (priority >= SCHED_PRIORITIES) {
+        priority = SCHED_PRIORITIES - 1;
+    }
+
+    struct thread *thread = kzalloc(sizeof(*thread));
+    thread->id = __atomic_fetch_add(&sched_next_id, 1, __ATOMIC_RELAXED);
+    thread->name = name;
+    thread->priority = priority;
+    thread->affinity = affinity;
+    timer_setup(&thread->wakeup, sched_wakeup, thread);
+    thread->stack_top = vmem_alloc_stack(SCHED_STACK_SIZE);
+    // Interrupts are taken on this stack, so it can't fault
+    vmem_populate(thread->stack_top, SCHED_STACK_SIZE);
+
+    // What sched_switch expects to pop, returning into sched_thread_start
+    uint64_t *sp = thread->stack_top;
+    *--sp = (uint64_t)sched_thread_start;
+    *--sp = 0; // rbp, ends backtraces
+    *--sp = 0; // rbx
+    *--sp = (uint64_t)entry; // r12
+    *--sp = (uint64_t)arg; // r13
+    *--sp = 0; // r14
+    *--sp = 0; // r15
+    thread->rsp = (uint64_t)sp;
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    sched_wake_locked(rq, thread);
+    spin_unlock(&rq->lock);
+    // It may have to preempt us
+    sched_irq_exit();
+    irq_restore(flags);
+    return thread;
+}
+
+static void sched_slice_expired(void *arg)
+{
+    struct sched_rq *rq = arg;
+    rq->need_resched = true;
+}
+
+/**
+ * Last thing on the way out of an interrupt (or a wakeup from thread
+ * context): switch threads if something asked for it. Interrupts are off.
+ */
+void sched_irq_exit()
+{
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    // A softirq interrupted by this interrupt finishes first, its own
+    // interrupt exit picks up the reschedule after
+    if (rq->idle == NULL || !rq->need_resched || softirq_active()) {
+        return;
+    }
+    spin_lock(&rq->lock);
+    sched_reschedule_locked(rq);
+}
+
+/**
+ * Reschedule IPI, see sched_kick. The switch happens in sched_irq_exit.
+ */
+static void sched_resched_irq(unsigned int vector, void *ctx)
+{
+    (void)vector;
+    (void)ctx;
+    sched_rqs[this_cpu_id()].need_resched = true;
+}
+
+/**
+ * Turn the caller into this CPU's idle thread and start scheduling. The idle
+ * thread runs whenever there's nothing else, local or stealable.
+ */
+void sched_start()
+{
+    struct sched_rq *rq = sched_rqs + this_cpu_id();
+    struct thread *idle = kzalloc(sizeof(*idle));
+    idle->id = __atomic_fetch_add(&sched_next_id, 1, __ATOMIC_RELAXED);
+    idle->name = "idle";
+    idle->state = THREAD_RUNNING;
+    idle->priority = SCHED_PRIORITIES;
+    idle->cpu = this_cpu_id();
+    idle->affinity = SCHED_CPU(idle->cpu);
+
+    timer_setup(&rq->slice, sched_slice_expired, rq);
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    rq->current = idle;
+    rq->idle = idle;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    interrupts_enable();
+    for (;;) {
+        schedule();
+        // Nothing to do, so get ahead on zeroing pages
+        pmem_zero_pool_fill();
+
+        // Sleep until a real timer deadline or a kick. Either one reschedules
+        // on its way out of the interrupt, so nothing is missed by sleeping.
+        __asm__ volatile("hlt");
+    }
+}
+
+void sched_init()
+{
+    irq_register(SCHED_RESCHED_VECTOR, sched_resched_irq, NULL);
+    printf("Scheduler: tickless, %u ms timeslice\n",
+           (uint64_t)(SCHED_TIMESLICE_NS / NSEC_PER_MSEC));
+}
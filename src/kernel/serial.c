@@ -0,0 +1,134 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/io.h"
+#include "kernel/serial.h"
+#include "kernel/spinlock.h"
+
+static struct spinlock serial_lock;
+static size_t serial_claims = 0;
+
+static void serial_putc_locked(char c)
+{
+    while (!(inb(SERIAL_COM1 + SERIAL_LSR) & SERIAL_LSR_THRE)) {
+        __asm__ volatile("pause");
+    }
+    outb(SERIAL_COM1 + SERIAL_DATA, c);
+}
+
+void serial_putc(char c)
+{
+    if (!serial_present) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+    serial_putc_locked(c);
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+/**
+ * Write a NUL-terminated string, LF becoming CRLF. Lines from different CPUs
+ * don't interleave as long as each goes out in one call.
+ */
+void serial_write(const char *str)
+{
+    if (!serial_present) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+    for (; *str != '\0'; str++) {
+        if (*str == '\n') {
+            serial_putc_locked('\r');
+        }
+        serial_putc_locked(*str);
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+/**
+ * Keep the console (see printk) off the port while something is writing
+ * output that has to come out in one piece, like a profile dump.
+ */
+void serial_claim()
+{
+    __atomic_fetch_add(&serial_claims, 1, __ATOMIC_ACQ_REL);
+}
+
+void serial_release()
+{
+    __atomic_fetch_sub(&serial_claims, 1, __ATOMIC_ACQ_REL);
+}
+
+bool serial_claimed()
+{
+    return __atomic_load_n(&serial_claims, __ATOMIC_ACQUIRE) > 0;
+}
+
+/**
+ * Take the port over for a panic, whoever holds the lock isn't coming back.
+ */
+void serial_panic()
+{
+    __atomic_store_n(&serial_claims, 0, __ATOMIC_RELEASE);
+    spin_unlock(&serial_lock);
+}
+
+/**
+ * Write `value` as lowercase hex, no prefix or padding.
+ */
+void serial_write_hex(uint64_t value)
+{
+    char buf[17];
+    size_t i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    serial_write(buf + i);
+}
+
+/**
+ * Write `value` in decimal, zero-padded to at least `min_digits`.
+ */
+void serial_write_dec(uint64_t value, unsigned int min_digits)
+{
+    char buf[21];
+    size_t i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0 || sizeof(buf) - 1 - i < min_digits);
+    serial_write(buf + i);
+}
+
+/**
+ * Set up COM1 for 115200 8N1, FIFOs on, no interrupts. Returns false if
+ * there's no UART there (the loopback check fails).
+ */
+bool serial_init()
+{
+    uint16_t divisor = SERIAL_CLOCK / SERIAL_BAUD;
+    outb(SERIAL_COM1 + SERIAL_IER, 0x00);
+    outb(SERIAL_COM1 + SERIAL_LCR, SERIAL_LCR_DLAB);
+    outb(SERIAL_COM1 + SERIAL_DATA, divisor & 0xff);
+    outb(SERIAL_COM1 + SERIAL_IER, (divisor >> 8) & 0xff);
+    outb(SERIAL_COM1 + SERIAL_LCR, SERIAL_LCR_8N1);
+    outb(SERIAL_COM1 + SERIAL_FCR, 0xc7); // Enable and clear FIFOs, 14 bytes
+
+    // Loopback test
+    outb(SERIAL_COM1 + SERIAL_MCR, 0x1e);
+    outb(SERIAL_COM1 + SERIAL_DATA, 0xae);
+    if (inb(SERIAL_COM1 + SERIAL_DATA) != 0xae) {
+        printf("Serial: no UART on COM1\n");
+        return false;
+    }
+    // Normal operation: DTR, RTS, OUT2
+    outb(SERIAL_COM1 + SERIAL_MCR, 0x0b);
+
+    serial_present = true;
+    printf("Serial: COM1 at %u baud\n", (uint64_t)SERIAL_BAUD);
+    return true;
+}
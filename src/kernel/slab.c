@@ -0,0 +1,308 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <memory.h>
+#include "kernel/addr.h"
+#include "kernel/paging.h"
+#include "kernel/pmem.h"
+#include "kernel/slab.h"
+
+#define SLAB_SIZE (PAGE_SIZE)
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((uint64_t)(a)-1))
+// Free objects are chained through a pointer stored inside the object
+#define FREE_PTR(cache, obj) (*(void **)((uint8_t *)(obj) + (cache)->free_offset))
+
+/// Power-of-two size classes for kmalloc: 8, 16, ..., KMALLOC_MAX_CLASS
+#define KMALLOC_MIN_SHIFT (3)
+#define KMALLOC_CLASSES (8)
+static struct kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-8",   "kmalloc-16",  "kmalloc-32",  "kmalloc-64",
+    "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+/// Every cache we know about
+static struct kmem_cache *kmem_caches = NULL;
+static struct spinlock kmem_caches_lock;
+
+static void kmem_list_add(struct slab **head, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    *head = slab;
+}
+
+static void kmem_list_del(struct slab **head, struct slab *slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * Grab a fresh page for `cache`, carve it into constructed objects and put it
+ * on the partial list. Caller holds the cache lock.
+ */
+static struct slab *kmem_slab_new(struct kmem_cache *cache)
+{
+    struct slab *slab = PHYS_TO_VIRT(pmem_alloc_page());
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->freelist = NULL;
+
+    // Chain backwards so objects are handed out in address order
+    uint8_t *objs = (uint8_t *)slab + cache->objs_offset;
+    for (size_t i = cache->objs_per_slab; i > 0; i--) {
+        void *obj = objs + (i - 1) * cache->size;
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        FREE_PTR(cache, obj) = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    kmem_list_add(&cache->partial, slab);
+    cache->slabs_count += 1;
+    return slab;
+}
+
+/**
+ * Return `obj` to its slab. Caller holds the cache lock.
+ */
+static void kmem_slab_put(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab = (struct slab *)((uint64_t)obj & ~(SLAB_SIZE - 1));
+    bool was_full = slab->freelist == NULL;
+    FREE_PTR(cache, obj) = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse -= 1;
+
+    if (was_full) {
+        kmem_list_del(&cache->full, slab);
+        kmem_list_add(&cache->partial, slab);
+    }
+
+    // Hand empty slabs back to pmem, but keep one around to avoid thrashing
+    if (slab->inuse == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        kmem_list_del(&cache->partial, slab);
+        cache->slabs_count -= 1;
+        pmem_free_page((void *)VIRT_TO_PHYS(slab));
+    }
+}
+
+/**
+ * Refill this CPU's object cache with a batch from the slabs.
+ */
+static void kmem_cache_refill(struct kmem_cache *cache,
+                              struct kmem_cache_cpu *cpu)
+{
+    spin_lock(&cache->lock);
+    while (cpu->count < KMEM_CPU_CACHE_BATCH) {
+        struct slab *slab = cache->partial;
+        if (slab == NULL) {
+            slab = kmem_slab_new(cache);
+        }
+
+        void *obj = slab->freelist;
+        slab->freelist = FREE_PTR(cache, obj);
+        slab->inuse += 1;
+        cpu->objs[cpu->count++] = obj;
+
+        if (slab->freelist == NULL) {
+            kmem_list_del(&cache->partial, slab);
+            kmem_list_add(&cache->full, slab);
+        }
+    }
+    spin_unlock(&cache->lock);
+}
+
+/**
+ * Drain a batch of objects from this CPU's object cache back to the slabs.
+ */
+static void kmem_cache_drain(struct kmem_cache *cache,
+                             struct kmem_cache_cpu *cpu, size_t n)
+{
+    spin_lock(&cache->lock);
+    for (size_t i = 0; i < n && cpu->count > 0; i++) {
+        kmem_slab_put(cache, cpu->objs[--cpu->count]);
+    }
+    spin_unlock(&cache->lock);
+}
+
+/**
+ * Allocate an object from `cache`. If the cache has a constructor, the object
+ * is handed out in its constructed state.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    uint64_t flags = irq_save();
+    struct kmem_cache_cpu *cpu = cache->cpu + this_cpu_id();
+    if (cpu->count == 0) {
+        kmem_cache_refill(cache, cpu);
+    }
+    void *obj = cpu->objs[--cpu->count];
+    irq_restore(flags);
+
+    return obj;
+}
+
+/**
+ * Free an object back to `cache`. Objects from caches with a constructor must
+ * be returned in their constructed state.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    uint64_t flags = irq_save();
+    struct kmem_cache_cpu *cpu = cache->cpu + this_cpu_id();
+    if (cpu->count >= KMEM_CPU_CACHE_SIZE) {
+        kmem_cache_drain(cache, cpu, KMEM_CPU_CACHE_BATCH);
+    }
+    cpu->objs[cpu->count++] = obj;
+    irq_restore(flags);
+}
+
+static bool kmem_cache_setup(struct kmem_cache *cache, const char *name,
+                             size_t size, size_t align, void (*ctor)(void *))
+{
+    memset(cache, 0, sizeof(*cache));
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    size = ALIGN_UP(size > 0 ? size : 1, align);
+
+    // Constructed objects must stay intact while free, so keep the free
+    // pointer out of the way at the end
+    cache->free_offset = 0;
+    if (ctor != NULL) {
+        cache->free_offset = size;
+        size = ALIGN_UP(size + sizeof(void *), align);
+    }
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->objs_offset = ALIGN_UP(sizeof(struct slab), align);
+    if (cache->objs_offset >= SLAB_SIZE) {
+        return false;
+    }
+    cache->objs_per_slab = (SLAB_SIZE - cache->objs_offset) / size;
+    if (cache->objs_per_slab == 0) {
+        return false;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    spin_unlock_irqrestore(&kmem_caches_lock, flags);
+    return true;
+}
+
+/**
+ * Create a named cache of `size`-byte objects aligned to `align`.
+ * `ctor` (optional) is run once on each object when its slab is created.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *obj))
+{
+    struct kmem_cache *cache = kmalloc(sizeof(*cache));
+    if (!kmem_cache_setup(cache, name, size, align, ctor)) {
+        printf("kmem: can't create cache %s (size %u, align %u)\n", name, size,
+               align);
+        kfree(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * Allocate `size` bytes from the kernel heap.
+ * Small sizes come from the power-of-two slab caches (naturally aligned),
+ * bigger ones are whole pages straight from pmem.
+ */
+void *kmalloc(size_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size <= KMALLOC_MAX_CLASS) {
+        size_t i = 0;
+        while (((size_t)1 << (i + KMALLOC_MIN_SHIFT)) < size) {
+            i++;
+        }
+        return kmem_cache_alloc(kmalloc_caches + i);
+    }
+
+    unsigned int order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    void *page = pmem_alloc_pages(order);
+    if (page == NULL) {
+        return NULL;
+    }
+    return PHYS_TO_VIRT(page);
+}
+
+/**
+ * kmalloc, but zeroed.
+ */
+void *kzalloc(size_t size)
+{
+    void *ptr = kmalloc(size);
+    if (ptr != NULL) {
+        // memset works in 8-byte words, and every allocation is a multiple
+        memset(ptr, 0, ALIGN_UP(size, sizeof(uint64_t)));
+    }
+    return ptr;
+}
+
+void kfree(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    // Slab objects never sit at the start of a page (the slab header does)
+    if ((uint64_t)ptr % PAGE_SIZE == 0) {
+        void *page = (void *)VIRT_TO_PHYS(ptr);
+        pmem_free_pages(page, pmem_page_order(page));
+        return;
+    }
+
+    struct slab *slab = (struct slab *)((uint64_t)ptr & ~(SLAB_SIZE - 1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+void kmem_print_stats()
+{
+    for (struct kmem_cache *cache = kmem_caches; cache != NULL;
+         cache = cache->next) {
+        printf("kmem: %s: %u B objects, %u per slab, %u slabs\n", cache->name,
+               cache->size, cache->objs_per_slab, cache->slabs_count);
+    }
+}
+
+void kmem_init()
+{
+    for (size_t i = 0; i < KMALLOC_CLASSES; i++) {
+        size_t size = (size_t)1 << (i + KMALLOC_MIN_SHIFT);
+        kmem_cache_setup(kmalloc_caches + i, kmalloc_names[i], size, size,
+                         NULL);
+    }
+
+    printf("Initialised kernel heap.\n");
+}
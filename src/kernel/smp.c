@@ -0,0 +1,141 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "kernel/addr.h"
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/numa.h"
+#include "kernel/paging.h"
+#include "kernel/percpu.h"
+#include "kernel/pmem.h"
+#include "kernel/sched.h"
+#include "kernel/profile.h"
+#include "kernel/smp.h"
+#include "kernel/timer.h"
+#include "kernel/vmem.h"
+
+/// Low memory isn't in the physmap, but it is mapped with the kernel image
+#define SMP_TRAMPOLINE_VMA (KERNEL_VMA + SMP_TRAMPOLINE_ADDR)
+#define SMP_SIPI_VECTOR (SMP_TRAMPOLINE_ADDR >> 12)
+#define SMP_AP_TIMEOUT_US (100000) /** 100ms */
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint8_t smp_trampoline_data[];
+
+/**
+ * Where APs land in long mode, on their own stack, with `cpu` set up by the
+ * BSP. Never returns.
+ */
+static void smp_ap_entry(struct percpu *cpu)
+{
+    percpu_load(cpu);
+    paging_pat_init();
+    gdt_load(cpu->gdt, &cpu->tss);
+    idt_load();
+    lapic_init();
+    timer_init_cpu();
+    profile_cpu_online();
+    pmem_set_cpu_node(cpu->id, numa_apic_node(cpu->apic_id));
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    sched_start();
+}
+
+/**
+ * Kick the AP described by `cpu` through the trampoline, and wait for it to
+ * check in. Returns false if it never shows up.
+ */
+static bool smp_boot_ap(struct percpu *cpu)
+{
+    cpu->self = cpu;
+    cpu->stack_top = vmem_alloc_stack(SMP_AP_STACK_SIZE);
+    // The AP has no IDT until it's in smp_ap_entry, so it can't take the page
+    // fault that would normally back its stack
+    vmem_populate(cpu->stack_top, SMP_AP_STACK_SIZE);
+    tss_init(&cpu->tss);
+
+    struct smp_trampoline_data *data =
+        (struct smp_trampoline_data *)(SMP_TRAMPOLINE_VMA +
+                                       (smp_trampoline_data -
+                                        smp_trampoline_start));
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+    data->cr3 = cr3;
+    data->efer = rdmsr(MSR_EFER) & (EFER_LME | EFER_NXE);
+    data->stack = (uint64_t)cpu->stack_top;
+    data->entry = (uint64_t)smp_ap_entry;
+    data->arg = (uint64_t)cpu;
+
+    // INIT, then two SIPIs (Intel SDM Vol. 3A Section 8.4.4.1)
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT |
+                                     LAPIC_ICR_LEVEL);
+    udelay(10000);
+    for (size_t i = 0; i < 2; i++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | SMP_SIPI_VECTOR);
+        udelay(200);
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    for (size_t us = 0; us < SMP_AP_TIMEOUT_US; us += 100) {
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        udelay(100);
+    }
+    return false;
+}
+
+/**
+ * Bring up every other CPU in the MADT, one at a time since they share the
+ * trampoline. Needs the APIC, vmem and timer_init.
+ */
+void smp_init()
+{
+    struct percpu *bsp = this_cpu();
+    if (!apic_enabled) {
+        return;
+    }
+    bsp->apic_id = lapic_id();
+    if (apic_cpus_count < 2) {
+        return;
+    }
+
+    // Low memory isn't handed out by pmem, so the trampoline page is ours. It
+    // has to be identity mapped (and executable) for the switch to long mode.
+    memcpy((void *)SMP_TRAMPOLINE_VMA, smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+    paging_map_range(SMP_TRAMPOLINE_ADDR, SMP_TRAMPOLINE_ADDR, PAGE_SIZE,
+                     PTE_READWRITE);
+
+    for (size_t i = 0; i < apic_cpus_count; i++) {
+        uint32_t apic_id = apic_cpu_ids[i];
+        if (apic_id == bsp->apic_id) {
+            continue;
+        }
+
+        struct percpu *cpu = percpu_areas + percpu_count;
+        cpu->id = percpu_count;
+        cpu->apic_id = apic_id;
+        if (smp_boot_ap(cpu)) {
+            percpu_count += 1;
+        } else {
+            printf("SMP: CPU with APIC ID %u didn't come up\n", apic_id);
+            // It might only be slow. Hold it in wait-for-SIPI before its stack,
+            // TSS and percpu slot go to the next one.
+            lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT |
+                                        LAPIC_ICR_LEVEL);
+            udelay(10000);
+            __atomic_store_n(&cpu->online, false, __ATOMIC_RELEASE);
+            vmem_free(cpu->stack_top);
+            tss_free(&cpu->tss);
+        }
+    }
+
+    paging_unmap_range(SMP_TRAMPOLINE_ADDR, PAGE_SIZE);
+    printf("SMP: %u CPU(s) online\n", percpu_count);
+}
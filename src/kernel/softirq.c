@@ -0,0 +1,75 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "kernel/interrupts.h"
+#include "kernel/percpu.h"
+#include "kernel/softirq.h"
+#include "kernel/spinlock.h"
+
+struct softirq_cpu {
+    uint32_t pending; /** Bit n means handler n has to run */
+    bool active; /** Running handlers, don't recurse from nested interrupts */
+};
+
+static void (*softirq_handlers[SOFTIRQ_COUNT])(void);
+static struct softirq_cpu softirq_cpus[MAX_CPUS];
+
+void softirq_register(unsigned int nr, void (*handler)(void))
+{
+    if (nr < SOFTIRQ_COUNT) {
+        softirq_handlers[nr] = handler;
+    }
+}
+
+/**
+ * Mark softirq `nr` pending on this CPU. It runs on the way out of the
+ * current (or next) interrupt.
+ */
+void softirq_raise(unsigned int nr)
+{
+    uint64_t flags = irq_save();
+    softirq_cpus[this_cpu_id()].pending |= 1u << nr;
+    irq_restore(flags);
+}
+
+/**
+ * True while this CPU is running softirq handlers.
+ */
+bool softirq_active()
+{
+    uint64_t flags = irq_save();
+    bool active = softirq_cpus[this_cpu_id()].active;
+    irq_restore(flags);
+    return active;
+}
+
+/**
+ * Run this CPU's pending softirqs, with interrupts on so hard IRQs aren't
+ * held up behind them. Called at interrupt exit, with interrupts off (and
+ * they're off again on return). Interrupts nesting in here don't recurse and
+ * don't switch threads, so we stay on this CPU throughout.
+ */
+void softirq_run()
+{
+    struct softirq_cpu *cpu = softirq_cpus + this_cpu_id();
+    if (cpu->active || cpu->pending == 0) {
+        return;
+    }
+
+    cpu->active = true;
+    for (size_t round = 0; round < SOFTIRQ_MAX_ROUNDS && cpu->pending != 0;
+         round++) {
+        uint32_t pending = cpu->pending;
+        cpu->pending = 0;
+        interrupts_enable();
+        while (pending != 0) {
+            unsigned int nr = __builtin_ctz(pending);
+            pending &= ~(1u << nr);
+            if (softirq_handlers[nr] != NULL) {
+                softirq_handlers[nr]();
+            }
+        }
+        interrupts_disable();
+    }
+    cpu->active = false;
+}
@@ -0,0 +1,153 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/percpu.h"
+#include "kernel/spinlock.h"
+#include "kernel/static_key.h"
+
+#define STATIC_KEY_INSN_SIZE (5)
+#define STATIC_KEY_INT3 (0xcc)
+#define STATIC_KEY_JMP (0xe9) /** jmp rel32 */
+
+extern struct static_key_entry _static_keys_start[];
+extern struct static_key_entry _static_keys_end[];
+
+static const uint8_t static_key_nop[STATIC_KEY_INSN_SIZE] = {
+    0x0f, 0x1f, 0x44, 0x00, 0x00
+};
+
+static struct spinlock static_key_lock;
+/// Site being patched, where static_key_int3 expects to catch CPUs
+static uint64_t static_key_poke_addr = 0;
+static uint32_t static_key_sync_acks = 0;
+
+/**
+ * Write to kernel text, which is mapped read-only.
+ */
+static void static_key_write_text(uint64_t addr, const uint8_t *bytes,
+                                  size_t n)
+{
+    uint64_t flags = irq_save();
+    uint64_t cr0 = read_cr0();
+    write_cr0(cr0 & ~CR0_WP);
+    for (size_t i = 0; i < n; i++) {
+        ((volatile uint8_t *)addr)[i] = bytes[i];
+    }
+    write_cr0(cr0);
+    irq_restore(flags);
+}
+
+static void static_key_sync_irq(unsigned int vector, void *ctx)
+{
+    (void)vector;
+    (void)ctx;
+    // The iret on the way out is what we're after, it's serializing
+    __atomic_fetch_add(&static_key_sync_acks, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Make every other CPU execute a serializing instruction, so none of them
+ * runs stale copies of the bytes we just wrote.
+ */
+static void static_key_sync_cores()
+{
+    size_t others = percpu_count - 1;
+    __atomic_store_n(&static_key_sync_acks, 0, __ATOMIC_RELAXED);
+    __asm__ volatile("mfence" ::: "memory");
+    for (size_t cpu = 0; cpu < percpu_count; cpu++) {
+        if (cpu != this_cpu_id()) {
+            lapic_send_ipi(percpu_areas[cpu].apic_id, STATIC_KEY_SYNC_VECTOR);
+        }
+    }
+    while (__atomic_load_n(&static_key_sync_acks, __ATOMIC_ACQUIRE) < others) {
+        __asm__ volatile("pause");
+    }
+}
+
+/**
+ * Turn one site into a jmp or back into a nop. With other CPUs running, go
+ * through an int3 so nobody ever executes a half-written instruction (Intel
+ * SDM Vol. 3A Section 8.1.3): int3 first, then the tail, then the new first
+ * byte, syncing every CPU in between.
+ */
+static void static_key_patch(struct static_key_entry *entry, bool enable)
+{
+    uint8_t insn[STATIC_KEY_INSN_SIZE];
+    if (enable) {
+        int32_t rel = entry->target - (entry->code + STATIC_KEY_INSN_SIZE);
+        insn[0] = STATIC_KEY_JMP;
+        for (size_t i = 0; i < 4; i++) {
+            insn[1 + i] = (rel >> (8 * i)) & 0xff;
+        }
+    } else {
+        for (size_t i = 0; i < STATIC_KEY_INSN_SIZE; i++) {
+            insn[i] = static_key_nop[i];
+        }
+    }
+
+    if (percpu_count < 2) {
+        static_key_write_text(entry->code, insn, STATIC_KEY_INSN_SIZE);
+        return;
+    }
+
+    uint8_t int3 = STATIC_KEY_INT3;
+    __atomic_store_n(&static_key_poke_addr, entry->code, __ATOMIC_RELEASE);
+    static_key_write_text(entry->code, &int3, 1);
+    static_key_sync_cores();
+    static_key_write_text(entry->code + 1, insn + 1, STATIC_KEY_INSN_SIZE - 1);
+    static_key_sync_cores();
+    static_key_write_text(entry->code, insn, 1);
+    static_key_sync_cores();
+    __atomic_store_n(&static_key_poke_addr, 0, __ATOMIC_RELEASE);
+}
+
+static void static_key_set(struct static_key *key, bool enable)
+{
+    spin_lock(&static_key_lock);
+    if (key->enabled != enable) {
+        key->enabled = enable;
+        for (struct static_key_entry *entry = _static_keys_start;
+             entry < _static_keys_end; entry++) {
+            if (entry->key == key) {
+                static_key_patch(entry, enable);
+            }
+        }
+    }
+    spin_unlock(&static_key_lock);
+}
+
+/**
+ * Patch every static_branch on `key` to be taken. Needs percpu_init, and with
+ * APs up, interrupts enabled on them (it waits for each to serialize).
+ */
+void static_key_enable(struct static_key *key)
+{
+    static_key_set(key, true);
+}
+
+void static_key_disable(struct static_key *key)
+{
+    static_key_set(key, false);
+}
+
+/**
+ * Breakpoint handler: a CPU that ran into a site mid-patch carries on as if
+ * it were still a nop. Returns false for any other int3.
+ */
+bool static_key_int3(struct interrupt_frame *frame)
+{
+    uint64_t addr = __atomic_load_n(&static_key_poke_addr, __ATOMIC_ACQUIRE);
+    if (addr == 0 || frame->rip - 1 != addr) {
+        return false;
+    }
+    frame->rip = addr + STATIC_KEY_INSN_SIZE;
+    return true;
+}
+
+void static_key_init()
+{
+    irq_register(STATIC_KEY_SYNC_VECTOR, static_key_sync_irq, NULL);
+}
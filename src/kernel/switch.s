@@ -0,0 +1,35 @@
+.code64
+.section .text
+
+# void sched_switch(uint64_t *prev_rsp, uint64_t next_rsp)
+# Save the callee-saved registers on the current stack, park it in
+# *prev_rsp, and pick up where the thread owning next_rsp left off. The
+# caller-saved registers are already on the stack (or dead) as far as the
+# SysV ABI is concerned.
+.global sched_switch
+sched_switch:
+    push %rbp
+    push %rbx
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, (%rdi)
+
+    mov %rsi, %rsp
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbx
+    pop %rbp
+    ret
+
+# First thing a new thread runs, "returning" from sched_switch. thread_create
+# leaves the entry point in %r12 and its argument in %r13.
+.global sched_thread_start
+sched_thread_start:
+    call sched_thread_begin
+    mov %r13, %rdi
+    call *%r12
+    call thread_exit
@@ -1,5 +1,13 @@
+#include <stdio.h>
 #include <string.h>
+#include "kernel/addr.h"
+#include "kernel/cpu.h"
+#include "kernel/paging.h"
+#include "kernel/pmem.h"
+#include "kernel/spinlock.h"
 #include "kernel/terminal.h"
+#include "kernel/timer.h"
+#include "kernel/workqueue.h"
 
 extern uint64_t KFONT_VGA_LEN;
 extern uint64_t KFONT_VGA_WIDTH;
@@ -14,36 +22,158 @@ struct colour {
     uint8_t a;
 };
 
+/**
+ * Glyph cache: each set holds the printable glyphs pre-rendered to ARGB rows
+ * for one (fg, bg, scale), so drawing a character is a memcpy per scanline.
+ * Rows are only scaled horizontally, vertical scaling just repeats them.
+ * Glyphs are rendered the first time they're drawn. printf switches colours
+ * a lot (escapes), so there are a few sets, the least recently used goes.
+ */
+#define GLYPH_FIRST (0x20)
+#define GLYPH_COUNT (96) /** 0x20 - 0x7f, what's in the font */
+#define GLYPH_ROWS (8)
+#define GLYPH_MAX_SCALE (2) /** term->scale mustn't go past this */
+#define GLYPH_ROW_PIXELS (8 * GLYPH_MAX_SCALE)
+#define GLYPH_CACHE_SETS (4)
+
+struct glyph_set {
+    struct colour fg_colour;
+    struct colour bg_colour;
+    size_t scale;
+    uint64_t last_used;
+    bool valid;
+    bool rendered[GLYPH_COUNT];
+    uint32_t rows[GLYPH_COUNT][GLYPH_ROWS][GLYPH_ROW_PIXELS];
+};
+
+static struct glyph_set glyph_cache[GLYPH_CACHE_SETS];
+static uint64_t glyph_cache_clock = 0;
+
+/**
+ * Text model: a grid of cells (character + attribute), which is the screen
+ * plus the scrollback above it, kept as a ring of lines. Writing only
+ * touches the grid and notes which cells changed. The changed cells are
+ * rendered at the next flush, which once terminal_async_init has run is a
+ * tick about a frame later, so a burst of output is drawn once.
+ *
+ * Cells are rendered into a shadow copy of the screen in RAM, one buffer per
+ * text row, and the dirty pixels copied to the framebuffer from there.
+ * Framebuffer reads are painfully slow (UC/WC), so nothing ever reads it,
+ * and scrolling just rotates the rows. If the rows can't be allocated, cells
+ * are rendered straight to the framebuffer.
+ */
+#define TERM_MAX_ROWS (256)
+#define TERM_MAX_COLS (256)
+#define TERM_SCROLLBACK_LINES (1024) /** Including the screen, power of 2 */
+#define TERM_ATTRS (256)
+#define TERM_FLUSH_NS (16 * NSEC_PER_MSEC) /** ~60 Hz */
+#define TERM_BENCH_ROUNDS (8)
+
+struct cell {
+    uint8_t c;
+    uint8_t attr; /** Index into term_attrs */
+};
+
+/// Colour pairs used so far, cells refer to them by index
+struct term_attr {
+    struct colour fg_colour;
+    struct colour bg_colour;
+};
+
 struct terminal {
-    size_t row;
+    size_t row; // cursor, on the live screen
     size_t col;
     size_t width;
     size_t height;
     struct colour fg_colour;
     struct colour bg_colour;
+    uint8_t attr; // fg/bg as a term_attrs index
     size_t scale;
+    /** Grid line of the top of the live screen, only ever goes up */
+    size_t screen_top;
+    size_t history; // lines of scrollback above the live screen
+    size_t view; // lines the view is scrolled back from the live screen
+    /** Cells of each visible row that changed, [lo, hi), clean if lo == hi */
+    size_t dirty_lo[TERM_MAX_ROWS];
+    size_t dirty_hi[TERM_MAX_ROWS];
     /** Framebuffer */
     volatile uint8_t *fb;
     size_t screen_width; // pixels
     size_t screen_height; // pixels
     size_t fb_pitch; // bytes
+    /** Shadow rows, visible row r is rows[(top + r) % height] */
+    bool shadowed;
+    uint8_t *rows[TERM_MAX_ROWS];
+    size_t rows_pages; // each
+    size_t row_pitch; // bytes per scanline of a shadow row
+    size_t top;
+    /** Pixels not flushed yet, [x0, x1) x [y0, y1), empty if y0 == y1 */
+    size_t dirty_x0;
+    size_t dirty_y0;
+    size_t dirty_x1;
+    size_t dirty_y1;
 };
 
 static struct terminal term0;
 static struct terminal *term = &term0;
+static struct spinlock term_lock;
+
+static struct cell term_grid[TERM_SCROLLBACK_LINES * TERM_MAX_COLS];
+static struct term_attr term_attrs[TERM_ATTRS];
+static size_t term_attrs_count = 0;
 
-static inline void vga_text_set(size_t x, size_t y, unsigned char c)
+/// Deferred flushes, see terminal_flush
+static bool term_async = false;
+static bool term_tick_pending = false;
+static struct timer term_tick;
+static struct work term_work;
+
+static inline bool colour_eq(struct colour a, struct colour b)
 {
-    if (term->fb == NULL)
-        return;
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+/**
+ * The glyph set for `attr` at the current scale, taking over the least
+ * recently used one if there isn't one yet.
+ */
+static struct glyph_set *glyph_cache_get(const struct term_attr *attr)
+{
+    struct glyph_set *victim = &glyph_cache[0];
+    for (size_t i = 0; i < GLYPH_CACHE_SETS; i++) {
+        struct glyph_set *set = &glyph_cache[i];
+        if (set->valid && set->scale == term->scale &&
+            colour_eq(set->fg_colour, attr->fg_colour) &&
+            colour_eq(set->bg_colour, attr->bg_colour)) {
+            set->last_used = ++glyph_cache_clock;
+            return set;
+        }
+        if (!set->valid ||
+            (victim->valid && set->last_used < victim->last_used)) {
+            victim = set;
+        }
+    }
+
+    victim->fg_colour = attr->fg_colour;
+    victim->bg_colour = attr->bg_colour;
+    victim->scale = term->scale;
+    victim->last_used = ++glyph_cache_clock;
+    memset(victim->rendered, 0, sizeof(victim->rendered));
+    victim->valid = true;
+    return victim;
+}
 
+/**
+ * Render glyph `g` of `set` from the font bitmap.
+ */
+static void glyph_render(struct glyph_set *set, size_t g)
+{
     // Find the glyph offset in the font bitmap
-    size_t glyph_x_off = (c - 0x20) * GLYPH_WIDTH;
-    // Copy pixels from glyph to framebuffer
-    for (size_t j = 0; j < KFONT_VGA_HEIGHT * term->scale; j++) {
-        for (size_t i = 0; i < GLYPH_WIDTH * term->scale; i++) {
-            size_t index = (KFONT_VGA_WIDTH * (j / term->scale) + glyph_x_off +
-                            (i / term->scale));
+    size_t glyph_x_off = g * GLYPH_WIDTH;
+    for (size_t j = 0; j < KFONT_VGA_HEIGHT; j++) {
+        uint32_t *row = set->rows[g][j];
+        for (size_t i = 0; i < GLYPH_WIDTH; i++) {
+            size_t index = KFONT_VGA_WIDTH * j + glyph_x_off + i;
             index -= 1; // idk, font file issue?
 
             uint8_t red, green, blue, alpha;
@@ -51,64 +181,347 @@ static inline void vga_text_set(size_t x, size_t y, unsigned char c)
                 KFONT_VGA[index] + KFONT_VGA[index + 1] + KFONT_VGA[index + 2] >
                 0;
             if (is_fg) {
-                red = KFONT_VGA[index] * term->fg_colour.r / 0xff;
-                green = KFONT_VGA[index + 1] * term->fg_colour.g / 0xff;
-                blue = KFONT_VGA[index + 2] * term->fg_colour.b / 0xff;
-                alpha = term->fg_colour.a;
+                red = KFONT_VGA[index] * set->fg_colour.r / 0xff;
+                green = KFONT_VGA[index + 1] * set->fg_colour.g / 0xff;
+                blue = KFONT_VGA[index + 2] * set->fg_colour.b / 0xff;
+                alpha = set->fg_colour.a;
             } else {
-                red = term->bg_colour.r;
-                green = term->bg_colour.g;
-                blue = term->bg_colour.b;
-                alpha = term->bg_colour.a;
+                red = set->bg_colour.r;
+                green = set->bg_colour.g;
+                blue = set->bg_colour.b;
+                alpha = set->bg_colour.a;
             }
             uint32_t argb = ((alpha << 24) | 0xff000000) |
                             ((red << 16) & 0xff0000) | ((green << 8) & 0xff00) |
                             blue;
+            for (size_t s = 0; s < set->scale; s++) {
+                row[i * set->scale + s] = argb;
+            }
+        }
+    }
+    set->rendered[g] = true;
+}
 
-            // Calculate framebuffer offset, i.e. where to copy pixels to
-            size_t fb_off =
-                term->fb_pitch * (KFONT_VGA_HEIGHT * term->scale * y + j) +
-                (GLYPH_WIDTH * term->scale * x + i) * 4;
-            *((uint32_t *)((uint8_t *)term->fb + fb_off)) = argb;
+/**
+ * Attribute index for the current colours, adding them if they're new. Once
+ * the table is full, new pairs fall back to the first.
+ */
+static void term_attr_select()
+{
+    for (size_t i = 0; i < term_attrs_count; i++) {
+        if (colour_eq(term_attrs[i].fg_colour, term->fg_colour) &&
+            colour_eq(term_attrs[i].bg_colour, term->bg_colour)) {
+            term->attr = i;
+            return;
         }
     }
+    if (term_attrs_count == TERM_ATTRS) {
+        term->attr = 0;
+        return;
+    }
+    term_attrs[term_attrs_count].fg_colour = term->fg_colour;
+    term_attrs[term_attrs_count].bg_colour = term->bg_colour;
+    term->attr = term_attrs_count++;
 }
 
-void terminal_scroll_up(size_t n)
+/**
+ * Grid line `n`, counting from the first line ever written.
+ */
+static inline struct cell *term_line(size_t n)
+{
+    return term_grid + (n % TERM_SCROLLBACK_LINES) * term->width;
+}
+
+static inline uint8_t *term_row(size_t r)
+{
+    size_t i = term->top + r;
+    return term->rows[i < term->height ? i : i - term->height];
+}
+
+static inline void term_dirty_cells(size_t r, size_t lo, size_t hi)
+{
+    if (term->dirty_lo[r] == term->dirty_hi[r]) {
+        term->dirty_lo[r] = lo;
+        term->dirty_hi[r] = hi;
+        return;
+    }
+    if (lo < term->dirty_lo[r])
+        term->dirty_lo[r] = lo;
+    if (hi > term->dirty_hi[r])
+        term->dirty_hi[r] = hi;
+}
+
+static void term_dirty_all()
+{
+    for (size_t r = 0; r < term->height; r++) {
+        term->dirty_lo[r] = 0;
+        term->dirty_hi[r] = term->width;
+    }
+}
+
+static inline void term_mark_dirty(size_t x0, size_t y0, size_t x1, size_t y1)
+{
+    if (term->dirty_y0 == term->dirty_y1) {
+        term->dirty_x0 = x0;
+        term->dirty_y0 = y0;
+        term->dirty_x1 = x1;
+        term->dirty_y1 = y1;
+        return;
+    }
+    if (x0 < term->dirty_x0)
+        term->dirty_x0 = x0;
+    if (y0 < term->dirty_y0)
+        term->dirty_y0 = y0;
+    if (x1 > term->dirty_x1)
+        term->dirty_x1 = x1;
+    if (y1 > term->dirty_y1)
+        term->dirty_y1 = y1;
+}
+
+/**
+ * Put `c` at (x, y) on the live screen.
+ */
+static inline void term_put(size_t x, size_t y, unsigned char c)
+{
+    struct cell *cell = term_line(term->screen_top + y) + x;
+    cell->c = c;
+    cell->attr = term->attr;
+    if (y + term->view < term->height) {
+        term_dirty_cells(y + term->view, x, x + 1);
+    }
+}
+
+/**
+ * Draw `c` with glyphs from `set` at (x, y) on the screen.
+ */
+static inline void vga_text_set(struct glyph_set *set, size_t x, size_t y,
+                                unsigned char c)
+{
+    // Anything the font doesn't have is drawn as a blank
+    size_t g = (size_t)c - GLYPH_FIRST;
+    if (g >= GLYPH_COUNT) {
+        g = 0;
+    }
+    if (!set->rendered[g]) {
+        glyph_render(set, g);
+    }
+
+    // Copy rows from the glyph to the shadow row (or framebuffer)
+    size_t scale = term->scale;
+    size_t row_bytes = GLYPH_WIDTH * scale * 4;
+    size_t cell_h = KFONT_VGA_HEIGHT * scale;
+    uint8_t *dst;
+    size_t pitch;
+    if (term->shadowed) {
+        dst = term_row(y) + row_bytes * x;
+        pitch = term->row_pitch;
+        term_mark_dirty(GLYPH_WIDTH * scale * x, cell_h * y,
+                        GLYPH_WIDTH * scale * (x + 1), cell_h * (y + 1));
+    } else {
+        dst = (uint8_t *)term->fb + term->fb_pitch * cell_h * y + row_bytes * x;
+        pitch = term->fb_pitch;
+    }
+    for (size_t j = 0; j < KFONT_VGA_HEIGHT; j++) {
+        for (size_t s = 0; s < scale; s++) {
+            memcpy(dst, set->rows[g][j], row_bytes);
+            dst += pitch;
+        }
+    }
+}
+
+/**
+ * Copy the dirty part of the shadow rows to the framebuffer, a scanline at a
+ * time. Only ever writes to the framebuffer.
+ */
+static void term_flush_pixels()
+{
+    if (!term->shadowed || term->dirty_y0 == term->dirty_y1)
+        return;
+
+    size_t cell_h = KFONT_VGA_HEIGHT * term->scale;
+    size_t x_off = term->dirty_x0 * 4;
+    size_t len = (term->dirty_x1 - term->dirty_x0) * 4;
+    size_t y = term->dirty_y0;
+    while (y < term->dirty_y1) {
+        size_t r = y / cell_h;
+        uint8_t *src = term_row(r) + term->row_pitch * (y - r * cell_h);
+        for (; y < term->dirty_y1 && y < (r + 1) * cell_h; y++) {
+            memcpy((uint8_t *)term->fb + term->fb_pitch * y + x_off,
+                   src + x_off, len);
+            src += term->row_pitch;
+        }
+    }
+    term->dirty_y0 = term->dirty_y1 = 0;
+}
+
+/**
+ * Render the cells that changed and get them onto the framebuffer.
+ */
+static void term_render()
 {
     if (term->fb == NULL)
         return;
 
-    size_t height_px = term->screen_height;
-    size_t pitch = term->fb_pitch;
-    size_t cut = KFONT_VGA_HEIGHT * term->scale * n;
-    for (size_t j = 0; j < height_px - cut; j++) {
-        size_t j_2 = j + cut;
-        memcpy(term->fb + (j * pitch), term->fb + (j_2 * pitch), pitch);
+    size_t first = term->screen_top - term->view;
+    struct glyph_set *set = NULL;
+    size_t set_attr = TERM_ATTRS;
+    for (size_t r = 0; r < term->height; r++) {
+        if (term->dirty_lo[r] == term->dirty_hi[r])
+            continue;
+        struct cell *line = term_line(first + r);
+        for (size_t x = term->dirty_lo[r]; x < term->dirty_hi[r]; x++) {
+            if (line[x].attr != set_attr) {
+                set_attr = line[x].attr;
+                set = glyph_cache_get(&term_attrs[set_attr]);
+            }
+            vga_text_set(set, x, r, line[x].c);
+        }
+        term->dirty_lo[r] = term->dirty_hi[r] = 0;
+    }
+    term_flush_pixels();
+}
+
+/**
+ * Scroll the live screen up `n` lines, into the scrollback.
+ */
+static void term_scroll(size_t n)
+{
+    if (n > term->height)
+        n = term->height;
+
+    // Lines coming in at the bottom are blank
+    for (size_t i = 0; i < n; i++) {
+        struct cell *line = term_line(term->screen_top + term->height + i);
+        for (size_t x = 0; x < term->width; x++) {
+            line[x].c = ' ';
+            line[x].attr = term->attr;
+        }
+    }
+    term->screen_top += n;
+    term->history += n;
+    if (term->history > TERM_SCROLLBACK_LINES - term->height)
+        term->history = TERM_SCROLLBACK_LINES - term->height;
+
+    if (term->view > 0) {
+        // Someone's reading the scrollback, keep it still for them, unless
+        // what they're reading just fell off the end
+        term->view += n;
+        if (term->view > term->history) {
+            term->view = term->history;
+            term_dirty_all();
+        }
+        return;
+    }
+
+    if (!term->shadowed) {
+        term_dirty_all();
+        return;
+    }
+    // Rotate the shadow rows, and what was still to be drawn on them
+    size_t keep = term->height - n;
+    for (size_t r = 0; r < keep; r++) {
+        term->dirty_lo[r] = term->dirty_lo[r + n];
+        term->dirty_hi[r] = term->dirty_hi[r + n];
+    }
+    for (size_t r = keep; r < term->height; r++) {
+        term->dirty_lo[r] = 0;
+        term->dirty_hi[r] = term->width;
+    }
+    term->top = (term->top + n) % term->height;
+    term_mark_dirty(0, 0, term->width * GLYPH_WIDTH * term->scale,
+                    term->height * KFONT_VGA_HEIGHT * term->scale);
+}
+
+void terminal_scroll_up(size_t n)
+{
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    term_scroll(n);
+    spin_unlock_irqrestore(&term_lock, flags);
+}
+
+/**
+ * Move the view `lines` further back into the scrollback (negative goes
+ * towards the live screen).
+ */
+void terminal_view_scroll(long lines)
+{
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    size_t view = term->view;
+    if (lines < 0) {
+        view = (size_t)-lines > view ? 0 : view + lines;
+    } else {
+        view += lines;
+        if (view > term->history)
+            view = term->history;
     }
-    for (size_t j = height_px - cut; j < height_px; j++) {
-        size_t j_2 = j + cut;
-        memset(term->fb + (j * pitch), 0, pitch);
+    if (view != term->view) {
+        term->view = view;
+        term_dirty_all();
     }
+    spin_unlock_irqrestore(&term_lock, flags);
+    terminal_flush();
 }
 
 void terminal_set_fg_colour(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 {
+    uint64_t flags = spin_lock_irqsave(&term_lock);
     term->fg_colour.r = r;
     term->fg_colour.g = g;
     term->fg_colour.b = b;
     term->fg_colour.a = a;
+    term_attr_select();
+    spin_unlock_irqrestore(&term_lock, flags);
 }
 
 void terminal_set_bg_colour(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 {
+    uint64_t flags = spin_lock_irqsave(&term_lock);
     term->bg_colour.r = r;
     term->bg_colour.g = g;
     term->bg_colour.b = b;
     term->bg_colour.a = a;
+    term_attr_select();
+    spin_unlock_irqrestore(&term_lock, flags);
 }
 
-void terminal_write_char(const char c)
+/// ANSI basic colours, for SGR 30-37 and 40-47
+static const struct colour term_palette[8] = {
+    { 0, 0, 0, 0xff }, // Black
+    { 0xff, 0, 0, 0xff }, // Red
+    { 0, 0xff, 0, 0xff }, // Green
+    { 0xff, 0xff, 0, 0xff }, // Yellow
+    { 0, 0, 0xff, 0xff }, // Blue
+    { 0xff, 0, 0xff, 0xff }, // Magenta
+    { 0, 0xff, 0xff, 0xff }, // Cyan
+    { 0xff, 0xff, 0xff, 0xff }, // White
+};
+
+/**
+ * Apply the SGR escape at `s` (just past the ESC [), returning where the text
+ * carries on. Only reset and the basic fg/bg colours are understood.
+ */
+static const char *term_escape(const char *s)
+{
+    if (s[0] == '0' && s[1] == 'm') {
+        term->bg_colour = term_palette[0];
+        term->fg_colour = term_palette[7];
+        term_attr_select();
+        return s + 2;
+    }
+    if ((s[0] == '3' || s[0] == '4') && s[1] >= '0' && s[1] <= '7' &&
+        s[2] == 'm') {
+        if (s[0] == '3') {
+            term->fg_colour = term_palette[s[1] - '0'];
+        } else {
+            term->bg_colour = term_palette[s[1] - '0'];
+        }
+        term_attr_select();
+        return s + 3;
+    }
+    return s;
+}
+
+static void term_write_char(const char c)
 {
     switch (c) {
     case '\r':
@@ -122,12 +535,13 @@ void terminal_write_char(const char c)
         term->col += 4;
         break;
     case 0x8: /* backspace */
-        vga_text_set(term->col - 1, term->row, ' ');
-        if (term->col)
+        if (term->col) {
             term->col -= 1;
+            term_put(term->col, term->row, ' ');
+        }
         break;
     default:
-        vga_text_set(term->col, term->row, c);
+        term_put(term->col, term->row, c);
         term->col += 1;
     }
 
@@ -136,28 +550,182 @@ void terminal_write_char(const char c)
         term->row += 1;
     }
     if (term->row >= term->height) {
-        terminal_scroll_up(1);
+        term_scroll(1);
         term->row -= 1;
     }
 }
 
+void terminal_write_char(const char c)
+{
+    if (term->fb == NULL)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    term_write_char(c);
+    spin_unlock_irqrestore(&term_lock, flags);
+}
+
+/**
+ * Render and flush everything that's changed, right now.
+ */
+void terminal_sync()
+{
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    term_render();
+    spin_unlock_irqrestore(&term_lock, flags);
+}
+
+static void terminal_tick(void *arg)
+{
+    (void)arg;
+    work_queue(&term_work);
+}
+
+static void terminal_flush_work(void *arg)
+{
+    (void)arg;
+    __atomic_store_n(&term_tick_pending, false, __ATOMIC_RELEASE);
+    terminal_sync();
+}
+
+/**
+ * Get what's been written onto the screen. Before terminal_async_init, or
+ * with interrupts off (the tick might never come, e.g. on the way to a
+ * hang), that's done now. Otherwise it's left for the next tick.
+ */
+void terminal_flush()
+{
+    uint64_t flags = irq_save();
+    irq_restore(flags);
+    if (!term_async || !(flags & (1 << 9))) {
+        terminal_sync();
+        return;
+    }
+    if (!__atomic_exchange_n(&term_tick_pending, true, __ATOMIC_ACQ_REL)) {
+        timer_arm(&term_tick, ktime_get_ns() + TERM_FLUSH_NS);
+    }
+}
+
 void terminal_clear()
 {
+    uint64_t flags = spin_lock_irqsave(&term_lock);
     for (size_t y = 0; y < term->height; y++) {
+        struct cell *line = term_line(term->screen_top + y);
         for (size_t x = 0; x < term->width; x++) {
-            vga_text_set(x, y, ' ');
+            line[x].c = ' ';
+            line[x].attr = term->attr;
         }
     }
     term->row = 0;
     term->col = 0;
+    term->view = 0;
+    term_dirty_all();
+    spin_unlock_irqrestore(&term_lock, flags);
+    terminal_flush();
 }
 
+/**
+ * Write `str`, following any ANSI colour escapes in it.
+ */
 void terminal_write(const char *str)
 {
-    size_t len = strlen(str);
-    for (size_t i = 0; i < len; i++) {
-        terminal_write_char(str[i]);
+    if (term->fb == NULL)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    while (*str != '\0') {
+        if (str[0] == '\x1b' && str[1] == '[') {
+            str = term_escape(str + 2);
+            continue;
+        }
+        term_write_char(*str);
+        str += 1;
+    }
+    spin_unlock_irqrestore(&term_lock, flags);
+    terminal_flush();
+}
+
+/**
+ * Allocate a shadow buffer for each text row. Needs pmem and the physmap.
+ */
+static bool terminal_shadow_init()
+{
+    for (size_t r = 0; r < TERM_MAX_ROWS; r++) {
+        if (term->rows[r] != NULL) {
+            uint64_t base = VIRT_TO_PHYS(term->rows[r]);
+            pmem_free_range(base, base + PAGE_SIZE * term->rows_pages);
+            term->rows[r] = NULL;
+        }
+    }
+
+    term->row_pitch = term->width * GLYPH_WIDTH * term->scale * 4;
+    size_t bytes = term->row_pitch * KFONT_VGA_HEIGHT * term->scale;
+    term->rows_pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    term->top = 0;
+    term->dirty_y0 = term->dirty_y1 = 0;
+    for (size_t r = 0; r < term->height; r++) {
+        void *page = pmem_alloc_range(term->rows_pages);
+        if (page == NULL) {
+            return false;
+        }
+        term->rows[r] = PHYS_TO_VIRT(page);
+    }
+    return true;
+}
+
+/**
+ * Average ns to redraw the whole screen with the framebuffer mapped `cache`.
+ */
+static uint64_t terminal_bench_redraw(uint64_t cache)
+{
+    paging_map_lfb(cache);
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < TERM_BENCH_ROUNDS; i++) {
+        term_mark_dirty(0, 0, term->width * GLYPH_WIDTH * term->scale,
+                        term->height * KFONT_VGA_HEIGHT * term->scale);
+        term_flush_pixels();
     }
+    return tsc_to_ns((rdtsc() - start) / TERM_BENCH_ROUNDS);
+}
+
+/**
+ * Compare full-screen redraws with the framebuffer uncached and
+ * write-combining, which is how it's left. Needs timer_init, and has to run
+ * before SMP since paging_map_lfb only writes back this CPU's caches.
+ */
+void terminal_benchmark()
+{
+    if (!term->shadowed)
+        return;
+
+    terminal_sync();
+    uint64_t flags = spin_lock_irqsave(&term_lock);
+    uint64_t uc_ns = terminal_bench_redraw(PTE_CACHE_UC);
+    uint64_t wc_ns = terminal_bench_redraw(PTE_CACHE_WC);
+    spin_unlock_irqrestore(&term_lock, flags);
+    printf("Terminal redraw: %u us uncached, %u us write-combining\n",
+           uc_ns / 1000, wc_ns / 1000);
+}
+
+/**
+ * Take the terminal over for a panic: whoever holds the lock isn't coming
+ * back (or it's us, halfway through a render), and nothing will run the
+ * tick, so render synchronously from here on.
+ */
+void terminal_panic()
+{
+    __atomic_store_n(&term_async, false, __ATOMIC_RELEASE);
+    spin_unlock(&term_lock);
+}
+
+/**
+ * Defer flushes to a tick about a frame later. Needs timers and workqueues.
+ */
+void terminal_async_init()
+{
+    timer_setup(&term_tick, terminal_tick, NULL);
+    work_init(&term_work, terminal_flush_work, NULL);
+    __atomic_store_n(&term_async, true, __ATOMIC_RELEASE);
 }
 
 void terminal_init(uint64_t *framebuffer, size_t screen_width,
@@ -176,9 +744,19 @@ void terminal_init(uint64_t *framebuffer, size_t screen_width,
     term->bg_colour.a = 0;
     term->width = screen_width / (GLYPH_WIDTH * term->scale);
     term->height = screen_height / (KFONT_VGA_HEIGHT * term->scale);
+    if (term->width > TERM_MAX_COLS)
+        term->width = TERM_MAX_COLS;
+    if (term->height > TERM_MAX_ROWS)
+        term->height = TERM_MAX_ROWS;
+    term->screen_top = 0;
+    term->history = 0;
+    term->view = 0;
+    term_attrs_count = 0;
+    term_attr_select();
     term->fb = framebuffer;
     term->screen_width = screen_width;
     term->screen_height = screen_height;
     term->fb_pitch = fb_scanline;
+    term->shadowed = framebuffer != NULL && terminal_shadow_init();
     terminal_clear();
 }
@@ -0,0 +1,270 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/apic.h"
+#include "kernel/cpu.h"
+#include "kernel/interrupts.h"
+#include "kernel/percpu.h"
+#include "kernel/pic.h"
+#include "kernel/pit.h"
+#include "kernel/spinlock.h"
+#include "kernel/timer.h"
+
+/// Armed timers on one CPU, soonest first
+struct timer_queue {
+    struct spinlock lock;
+    struct timer *head;
+};
+
+static struct timer_queue timer_queues[MAX_CPUS];
+static enum timer_mode timer_mode = TIMER_PIT_PERIODIC;
+
+/// TSC at boot, i.e. ktime 0
+static uint64_t timer_tsc_base = 0;
+static uint64_t timer_tsc_hz = 0;
+/// ns = tsc * timer_ns_mult >> 32, tsc = ns * timer_tsc_mult >> 24
+static uint64_t timer_ns_mult = 0;
+static uint64_t timer_tsc_mult = 0;
+/// LAPIC timer ticks (after the divider) = ns * timer_lapic_mult >> 32
+static uint64_t timer_lapic_mult = 0;
+
+/**
+ * Nanoseconds since the TSC was calibrated. Assumes the TSCs on every CPU are
+ * in sync, which holds on anything with an invariant TSC (and in QEMU).
+ */
+uint64_t ktime_get_ns()
+{
+    return tsc_to_ns(rdtsc() - timer_tsc_base);
+}
+
+/**
+ * Convert a TSC interval to nanoseconds.
+ */
+uint64_t tsc_to_ns(uint64_t cycles)
+{
+    return ((unsigned __int128)cycles * timer_ns_mult) >> 32;
+}
+
+static uint64_t timer_ns_to_tsc(uint64_t ns)
+{
+    return timer_tsc_base + (((unsigned __int128)ns * timer_tsc_mult) >> 24);
+}
+
+/**
+ * Busy-wait for `us` microseconds.
+ */
+void udelay(uint64_t us)
+{
+    uint64_t deadline = ktime_get_ns() + us * NSEC_PER_USEC;
+    while (ktime_get_ns() < deadline) {
+        __asm__ volatile("pause");
+    }
+}
+
+/**
+ * Point this CPU's timer hardware at `deadline`, or stop it for 0.
+ */
+static void timer_program(uint64_t deadline)
+{
+    switch (timer_mode) {
+    case TIMER_TSC_DEADLINE:
+        wrmsr(MSR_TSC_DEADLINE, deadline ? timer_ns_to_tsc(deadline) : 0);
+        break;
+    case TIMER_LAPIC_ONESHOT: {
+        if (deadline == 0) {
+            lapic_write(LAPIC_TIMER_INIT, 0);
+            break;
+        }
+        uint64_t now = ktime_get_ns();
+        uint64_t delta = deadline > now ? deadline - now : 0;
+        uint64_t count = ((unsigned __int128)delta * timer_lapic_mult) >> 32;
+        // Too far out just fires early, and timer_irq programs the rest
+        if (count > 0xffffffff) {
+            count = 0xffffffff;
+        }
+        lapic_write(LAPIC_TIMER_INIT, count > 0 ? count : 1);
+        break;
+    }
+    case TIMER_PIT_PERIODIC:
+        // Checked on every tick anyway
+        break;
+    }
+}
+
+void timer_setup(struct timer *timer, void (*fn)(void *), void *arg)
+{
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->armed = false;
+    timer->next = NULL;
+}
+
+/**
+ * Remove `timer` from `queue`, if it's on it. Caller holds `queue->lock`.
+ */
+static void timer_unlink_locked(struct timer_queue *queue, struct timer *timer)
+{
+    if (!timer->armed) {
+        return;
+    }
+    for (struct timer **link = &queue->head; *link != NULL;
+         link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+    timer->armed = false;
+}
+
+/**
+ * Fire `timer` at `deadline` (ktime_get_ns) on this CPU, replacing whatever it
+ * was armed for before.
+ */
+void timer_arm(struct timer *timer, uint64_t deadline)
+{
+    timer_cancel(timer);
+
+    uint64_t flags = irq_save();
+    struct timer_queue *queue = timer_queues + this_cpu_id();
+    spin_lock(&queue->lock);
+    timer->deadline = deadline;
+    timer->cpu = this_cpu_id();
+    timer->armed = true;
+    struct timer **link = &queue->head;
+    while (*link != NULL && (*link)->deadline <= deadline) {
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    *link = timer;
+    if (queue->head == timer) {
+        timer_program(deadline);
+    }
+    spin_unlock(&queue->lock);
+    irq_restore(flags);
+}
+
+/**
+ * Disarm `timer`. It may already be running on its CPU.
+ */
+void timer_cancel(struct timer *timer)
+{
+    if (!__atomic_load_n(&timer->armed, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    struct timer_queue *queue = timer_queues + timer->cpu;
+    spin_lock(&queue->lock);
+    bool was_head = queue->head == timer;
+    timer_unlink_locked(queue, timer);
+    // Don't wake up for nothing. Other CPUs just take a spurious interrupt.
+    if (was_head && queue == timer_queues + this_cpu_id()) {
+        timer_program(queue->head != NULL ? queue->head->deadline : 0);
+    }
+    spin_unlock(&queue->lock);
+    irq_restore(flags);
+}
+
+/**
+ * Timer interrupt: run whatever has expired on this CPU and sleep until the
+ * next deadline. Callbacks run with interrupts off but the queue unlocked,
+ * so they may re-arm.
+ */
+static void timer_irq(unsigned int vector, void *ctx)
+{
+    (void)vector;
+    (void)ctx;
+
+    struct timer_queue *queue = timer_queues + this_cpu_id();
+    spin_lock(&queue->lock);
+    uint64_t now = ktime_get_ns();
+    while (queue->head != NULL && queue->head->deadline <= now) {
+        struct timer *timer = queue->head;
+        queue->head = timer->next;
+        timer->armed = false;
+        spin_unlock(&queue->lock);
+        timer->fn(timer->arg);
+        spin_lock(&queue->lock);
+        now = ktime_get_ns();
+    }
+    timer_program(queue->head != NULL ? queue->head->deadline : 0);
+    spin_unlock(&queue->lock);
+}
+
+/**
+ * Set up this CPU's local APIC timer. Needs timer_init on the BSP first.
+ */
+void timer_init_cpu()
+{
+    switch (timer_mode) {
+    case TIMER_TSC_DEADLINE:
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | TIMER_VECTOR);
+        // The SDM wants this fenced before the first deadline write
+        __asm__ volatile("mfence" ::: "memory");
+        break;
+    case TIMER_LAPIC_ONESHOT:
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | TIMER_VECTOR);
+        break;
+    case TIMER_PIT_PERIODIC:
+        break;
+    }
+}
+
+/**
+ * Calibrate the TSC (and the LAPIC timer if we need it) against the PIT, then
+ * pick the best interrupt source. Needs the APIC up (or not) already, and
+ * interrupts off.
+ */
+void timer_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_EXT_POWER, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EXT_EDX_INVARIANT_TSC)) {
+        printf("Timer: TSC isn't invariant, ktime may drift\n");
+    }
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    bool tsc_deadline = ecx & CPUID_ECX_TSC_DEADLINE;
+
+    // Time both the TSC and the LAPIC timer over the same PIT interval
+    if (apic_enabled && !tsc_deadline) {
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+    }
+    uint64_t tsc_start = rdtsc();
+    pit_wait_us(TIMER_CALIBRATE_US);
+    uint64_t tsc_end = rdtsc();
+    uint64_t lapic_ticks = 0;
+    if (apic_enabled && !tsc_deadline) {
+        lapic_ticks = 0xffffffff - lapic_read(LAPIC_TIMER_CURRENT);
+    }
+
+    timer_tsc_hz = (tsc_end - tsc_start) * (1000000 / TIMER_CALIBRATE_US);
+    timer_ns_mult = (NSEC_PER_SEC << 32) / timer_tsc_hz;
+    timer_tsc_mult = (timer_tsc_hz << 24) / NSEC_PER_SEC;
+    timer_tsc_base = tsc_start;
+
+    irq_register(TIMER_VECTOR, timer_irq, NULL);
+
+    if (apic_enabled && tsc_deadline) {
+        timer_mode = TIMER_TSC_DEADLINE;
+    } else if (apic_enabled) {
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        uint64_t lapic_hz = lapic_ticks * (1000000 / TIMER_CALIBRATE_US);
+        timer_lapic_mult = (lapic_hz << 32) / NSEC_PER_SEC;
+        timer_mode = TIMER_LAPIC_ONESHOT;
+    } else {
+        pit_set_periodic(TIMER_FALLBACK_HZ);
+        pic_irq_on(0);
+        timer_mode = TIMER_PIT_PERIODIC;
+    }
+    timer_init_cpu();
+
+    printf("Timer: TSC %u MHz, %s\n", timer_tsc_hz / 1000000,
+           timer_mode == TIMER_TSC_DEADLINE  ? "TSC-deadline" :
+           timer_mode == TIMER_LAPIC_ONESHOT ? "LAPIC one-shot" :
+                                               "PIT periodic");
+}
@@ -0,0 +1,123 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/cpu.h"
+#include "kernel/percpu.h"
+#include "kernel/printk.h"
+#include "kernel/serial.h"
+#include "kernel/spinlock.h"
+#include "kernel/static_key.h"
+#include "kernel/timer.h"
+#include "kernel/trace.h"
+
+struct trace_buffer {
+    struct trace_event events[TRACE_EVENTS];
+    size_t head; /** Events ever recorded, the next goes in head % TRACE_EVENTS */
+};
+
+static struct trace_buffer trace_buffers[MAX_CPUS];
+/// TSC at trace_start, timestamp 0
+static uint64_t trace_tsc_base = 0;
+
+/**
+ * Slow path of the trace_* macros. Safe anywhere but NMI context.
+ */
+void trace_record(const char *name, char phase, uint64_t arg)
+{
+    uint64_t flags = irq_save();
+    struct trace_buffer *buf = trace_buffers + this_cpu_id();
+    struct trace_event *event = buf->events + buf->head % TRACE_EVENTS;
+    event->tsc = rdtsc();
+    event->name = name;
+    event->arg = arg;
+    event->phase = phase;
+    buf->head += 1;
+    irq_restore(flags);
+}
+
+/**
+ * Clear the buffers and turn every tracepoint on. Fine as early as right
+ * after percpu_init; timestamps are only converted to ns when dumped.
+ */
+void trace_start()
+{
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        trace_buffers[cpu].head = 0;
+    }
+    trace_tsc_base = rdtsc();
+    static_key_enable(&trace_key);
+}
+
+void trace_stop()
+{
+    static_key_disable(&trace_key);
+}
+
+/**
+ * Write `str` as the contents of a JSON string.
+ */
+static void trace_write_json_string(const char *str)
+{
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            serial_putc('\\');
+        }
+        serial_putc(*str >= 0x20 ? *str : '?');
+    }
+}
+
+/**
+ * Send everything recorded over serial as a Chrome trace, between
+ * "TRACE BEGIN" and "TRACE END" lines (tools/trace.py cuts it out). Each CPU
+ * is a thread of process 0. Call after trace_stop, and after timer_init.
+ */
+void trace_dump()
+{
+    if (!serial_present) {
+        printf("Trace: no serial port to dump to\n");
+        return;
+    }
+
+    size_t total = 0, lost = 0;
+    bool first = true;
+    printk_flush();
+    serial_claim();
+    serial_write("TRACE BEGIN\n{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t cpu = 0; cpu < percpu_count; cpu++) {
+        struct trace_buffer *buf = trace_buffers + cpu;
+        size_t start = buf->head > TRACE_EVENTS ? buf->head - TRACE_EVENTS : 0;
+        for (size_t i = start; i < buf->head; i++) {
+            struct trace_event *event = buf->events + i % TRACE_EVENTS;
+            uint64_t ns = event->tsc > trace_tsc_base ?
+                              tsc_to_ns(event->tsc - trace_tsc_base) :
+                              0;
+            char phase[2] = { event->phase, '\0' };
+
+            serial_write(first ? "{\"name\":\"" : ",\n{\"name\":\"");
+            trace_write_json_string(event->name);
+            serial_write("\",\"ph\":\"");
+            serial_write(phase);
+            // Microseconds, with the ns as a fraction
+            serial_write("\",\"ts\":");
+            serial_write_dec(ns / NSEC_PER_USEC, 1);
+            serial_write(".");
+            serial_write_dec(ns % NSEC_PER_USEC, 3);
+            serial_write(",\"pid\":0,\"tid\":");
+            serial_write_dec(cpu, 1);
+            if (event->phase == TRACE_INSTANT) {
+                serial_write(",\"s\":\"t\",\"args\":{\"arg\":");
+                serial_write_dec(event->arg, 1);
+                serial_write("}");
+            }
+            serial_write("}");
+            first = false;
+        }
+        total += buf->head - start;
+        lost += start;
+    }
+    serial_write("\n]}\nTRACE END\n");
+    serial_release();
+    printf("Trace: %u events written to serial (%u overwritten)\n", total,
+           lost);
+}
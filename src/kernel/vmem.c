@@ -1,31 +1,317 @@
 #include <stddef.h>
+#include <stdio.h>
+#include <memory.h>
+#include <string.h>
+#include "kernel/addr.h"
+#include "kernel/cpu.h"
 #include "kernel/vmem.h"
 #include "kernel/paging.h"
+#include "kernel/pmem.h"
+#include "kernel/slab.h"
+#include "kernel/spinlock.h"
 #include "kernel/colours.h"
 
-// Base address of available space
-uint64_t linear_base = 0;
+// Next free address in [VMEM_BASE, VMEM_LIMIT). Address space is never
+// reused, there's plenty of it.
+static uint64_t vmem_next = VMEM_BASE + PAGE_SIZE;
+static struct vmem_region *vmem_regions = NULL;
+static struct spinlock vmem_lock;
+// Shared by every untouched page that has only been read so far
+static uint64_t vmem_zero_page = 0;
 
 /**
- * Allocate `n` bytes of virtual memory.
- * Physical memory and paging must be initialised already!
+ * Find the region containing `virtaddr`. Caller holds `vmem_lock`.
  */
-void *vmem_alloc(size_t n)
+static struct vmem_region *vmem_find_region(uint64_t virtaddr)
+{
+    for (struct vmem_region *r = vmem_regions; r != NULL; r = r->next) {
+        if (virtaddr >= r->base && virtaddr < r->limit) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the region starting at `ptr`, as returned by vmem_alloc(_stack).
+ * Caller holds `vmem_lock`.
+ */
+static struct vmem_region **vmem_find_start(void *ptr)
+{
+    struct vmem_region **link = &vmem_regions;
+    for (; *link != NULL; link = &(*link)->next) {
+        uint64_t start = ((*link)->flags & VMEM_STACK) ? (*link)->limit :
+                                                          (*link)->base;
+        if (start == (uint64_t)ptr) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reserve `n` bytes (rounded up to pages) of virtual memory for `region`,
+ * followed by a guard page. Nothing is mapped until it's touched.
+ * Caller holds `vmem_lock`.
+ */
+static void vmem_reserve_locked(struct vmem_region *region, size_t n,
+                                uint32_t flags)
 {
-    uint64_t base = linear_base;
-    uint64_t limit = linear_base + n;
-    if (limit >= linear_limit) {
+    n = (n + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t base = vmem_next;
+    uint64_t limit = base + n;
+    if (n == 0 || limit + PAGE_SIZE > VMEM_LIMIT) {
         // OOM
         printf(BG_ROSSO("OOM") "\n");
         __asm__ volatile("mov $0xdeadbeef, %rax\n\t"
                          "1: jmp 1b");
     }
+    vmem_next = limit + PAGE_SIZE;
+
+    region->base = base;
+    region->limit = limit;
+    region->flags = flags;
+    region->resident = 0;
+    region->next = vmem_regions;
+    vmem_regions = region;
+}
+
+static struct vmem_region *vmem_reserve(size_t n, uint32_t flags)
+{
+    struct vmem_region *region = kmalloc(sizeof(*region));
+    uint64_t irqflags = spin_lock_irqsave(&vmem_lock);
+    vmem_reserve_locked(region, n, flags);
+    spin_unlock_irqrestore(&vmem_lock, irqflags);
+    return region;
+}
+
+/**
+ * Allocate `n` bytes of zeroed virtual memory. This only reserves address
+ * space: reads are served from the shared zero page, and physical pages are
+ * only allocated on the first write.
+ */
+void *vmem_alloc(size_t n)
+{
+    return (void *)vmem_reserve(n, 0)->base;
+}
+
+/**
+ * Allocate an `n` byte stack and return its top. Running off the bottom hits
+ * the guard page and is reported as a stack overflow.
+ */
+void *vmem_alloc_stack(size_t n)
+{
+    return (void *)vmem_reserve(n, VMEM_STACK)->limit;
+}
+
+/**
+ * Back the `n` bytes below `top` with private pages right away, for memory
+ * that can't take a page fault. Stacks we take interrupts on are the usual
+ * case: the CPU can't push an exception frame onto a page that isn't there.
+ */
+void vmem_populate(void *top, size_t n)
+{
+    for (size_t offset = PAGE_SIZE; offset <= n; offset += PAGE_SIZE) {
+        *(volatile uint8_t *)((uint64_t)top - offset) = 0;
+    }
+}
+
+/**
+ * Free a region returned by vmem_alloc, vmem_alloc_stack or vmem_clone,
+ * dropping its references to whatever physical pages ended up backing it.
+ */
+void vmem_free(void *ptr)
+{
+    uint64_t irqflags = spin_lock_irqsave(&vmem_lock);
+    struct vmem_region **link = vmem_find_start(ptr);
+    if (link == NULL) {
+        spin_unlock_irqrestore(&vmem_lock, irqflags);
+        printf("vmem: bad free of 0x%x\n", ptr);
+        return;
+    }
+    struct vmem_region *region = *link;
+    *link = region->next;
+
+    // Pages may be shared, so note them down and only drop our references
+    // once the whole range is unmapped (and flushed in one go)
+    size_t count = 0;
+    uint64_t *pages = NULL;
+    if (region->resident > 0) {
+        pages = kmalloc(region->resident * sizeof(uint64_t));
+    }
+    for (uint64_t virtaddr = region->base;
+         virtaddr < region->limit && count < region->resident;
+         virtaddr += PAGE_SIZE) {
+        uint64_t physaddr;
+        if (paging_translate(virtaddr, &physaddr) &&
+            physaddr != vmem_zero_page) {
+            pages[count++] = physaddr;
+        }
+    }
+    paging_unmap_range(region->base, region->limit - region->base);
+    spin_unlock_irqrestore(&vmem_lock, irqflags);
 
-    linear_base = limit;
-    return base;
+    for (size_t i = 0; i < count; i++) {
+        pmem_page_put((void *)pages[i]);
+    }
+    kfree(pages);
+    kfree(region);
+}
+
+/**
+ * Duplicate the region starting at `ptr`. No memory is copied: both regions
+ * share the same pages read-only, and whichever writes first gets its own
+ * copy. Returns the start of the new region (the top for stacks).
+ */
+void *vmem_clone(void *ptr)
+{
+    struct vmem_region *copy = kmalloc(sizeof(*copy));
+    uint64_t irqflags = spin_lock_irqsave(&vmem_lock);
+    struct vmem_region **link = vmem_find_start(ptr);
+    if (link == NULL) {
+        spin_unlock_irqrestore(&vmem_lock, irqflags);
+        printf("vmem: bad clone of 0x%x\n", ptr);
+        kfree(copy);
+        return NULL;
+    }
+    struct vmem_region *region = *link;
+    vmem_reserve_locked(copy, region->limit - region->base, region->flags);
+
+    for (uint64_t offset = 0; offset < region->limit - region->base;
+         offset += PAGE_SIZE) {
+        uint64_t physaddr;
+        if (!paging_translate(region->base + offset, &physaddr)) {
+            continue;
+        }
+        if (physaddr != vmem_zero_page) {
+            pmem_page_get((void *)physaddr);
+            copy->resident += 1;
+            // Write-protect the original too
+            paging_map_range(region->base + offset, physaddr, PAGE_SIZE,
+                             PTE_NX);
+        }
+        paging_map_range(copy->base + offset, physaddr, PAGE_SIZE, PTE_NX);
+    }
+    spin_unlock_irqrestore(&vmem_lock, irqflags);
+
+    return (void *)((copy->flags & VMEM_STACK) ? copy->limit : copy->base);
+}
+
+/**
+ * Give `region` a private, writable copy of the read-only page at `virtaddr`.
+ * Caller holds `vmem_lock`.
+ */
+static void vmem_cow(struct vmem_region *region, uint64_t virtaddr,
+                     uint64_t physaddr)
+{
+    uint64_t page = physaddr;
+    if (physaddr == vmem_zero_page) {
+        page = (uint64_t)pmem_alloc_zeroed_page();
+        region->resident += 1;
+    } else if (pmem_page_shared((void *)physaddr)) {
+        page = (uint64_t)pmem_alloc_page();
+        memcpy(PHYS_TO_VIRT(page), PHYS_TO_VIRT(physaddr), PAGE_SIZE);
+        pmem_page_put((void *)physaddr);
+    }
+    // else: everyone else has let go already, so just take it back
+
+    paging_map_range(virtaddr, page, PAGE_SIZE, PTE_READWRITE | PTE_NX);
+}
+
+/**
+ * Try to resolve a page fault at `faultaddr`:
+ *  - Reads of untouched pages map the shared zero page
+ *  - Writes to untouched or copy-on-write pages get a private page
+ * Returns false if the fault isn't ours to fix.
+ */
+bool vmem_handle_fault(uint64_t faultaddr, uint64_t err_code)
+{
+    if (err_code & PF_IFETCH) {
+        // Nothing in vmem is executable
+        return false;
+    }
+
+    uint64_t irqflags = spin_lock_irqsave(&vmem_lock);
+    struct vmem_region *region = vmem_find_region(faultaddr);
+    if (region == NULL) {
+        spin_unlock_irqrestore(&vmem_lock, irqflags);
+        return false;
+    }
+
+    // Another CPU may have faulted the same page in already, so go by what's
+    // mapped now rather than by the error code alone
+    uint64_t virtaddr = faultaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t physaddr;
+    bool present = paging_translate(virtaddr, &physaddr);
+    if (!present && !(err_code & PF_WRITE)) {
+        paging_map_range(virtaddr, vmem_zero_page, PAGE_SIZE, PTE_NX);
+    } else if (!present) {
+        physaddr = (uint64_t)pmem_alloc_zeroed_page();
+        paging_map_range(virtaddr, physaddr, PAGE_SIZE,
+                         PTE_READWRITE | PTE_NX);
+        region->resident += 1;
+    } else if (err_code & PF_WRITE) {
+        vmem_cow(region, virtaddr, physaddr);
+    }
+    spin_unlock_irqrestore(&vmem_lock, irqflags);
+
+    return true;
+}
+
+/**
+ * Explain an unresolved page fault at `faultaddr` in terms of vmem regions.
+ * Doesn't take `vmem_lock`, we're on the way down anyway.
+ */
+void vmem_report_fault(uint64_t faultaddr)
+{
+    // Guard pages are shared by neighbouring regions. A stack running off its
+    // bottom is the likeliest culprit, then an overrun of the region below.
+    struct vmem_region *inside = NULL, *below = NULL, *above = NULL;
+    for (struct vmem_region *r = vmem_regions; r != NULL; r = r->next) {
+        if (faultaddr >= r->base && faultaddr < r->limit) {
+            inside = r;
+        } else if (faultaddr >= r->base - PAGE_SIZE && faultaddr < r->base &&
+                   (below == NULL || (r->flags & VMEM_STACK))) {
+            below = r;
+        } else if (faultaddr >= r->limit && faultaddr < r->limit + PAGE_SIZE) {
+            above = r;
+        }
+    }
+
+    if (inside != NULL) {
+        printf("  0x%x is in region [0x%x, 0x%x), offset 0x%x\n", faultaddr,
+               inside->base, inside->limit, faultaddr - inside->base);
+    } else if (below != NULL && (below->flags & VMEM_STACK)) {
+        printf("  Stack overflow: 0x%x is in the guard page below [0x%x, 0x%x)\n",
+               faultaddr, below->base, below->limit);
+    } else if (above != NULL) {
+        printf("  Overrun: 0x%x is in the guard page above [0x%x, 0x%x)\n",
+               faultaddr, above->base, above->limit);
+    } else if (below != NULL) {
+        printf("  Underrun: 0x%x is in the guard page below [0x%x, 0x%x)\n",
+               faultaddr, below->base, below->limit);
+    } else {
+        printf("  0x%x is not in any vmem region\n", faultaddr);
+    }
+}
+
+/**
+ * Number of pages currently backing vmem regions.
+ */
+size_t vmem_resident_pages()
+{
+    size_t pages = 0;
+    uint64_t irqflags = spin_lock_irqsave(&vmem_lock);
+    for (struct vmem_region *r = vmem_regions; r != NULL; r = r->next) {
+        pages += r->resident;
+    }
+    spin_unlock_irqrestore(&vmem_lock, irqflags);
+    return pages;
 }
 
 void vmem_init()
 {
-    // TODO
+    kmem_init();
+
+    vmem_zero_page = (uint64_t)pmem_alloc_zeroed_page();
 }
@@ -0,0 +1,109 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "kernel/percpu.h"
+#include "kernel/sched.h"
+#include "kernel/spinlock.h"
+#include "kernel/workqueue.h"
+
+struct workqueue {
+    struct spinlock lock;
+    struct work *head;
+    struct work *tail;
+    struct thread *worker;
+};
+
+static struct workqueue workqueues[MAX_CPUS];
+
+void work_init(struct work *work, void (*fn)(void *), void *arg)
+{
+    work->fn = fn;
+    work->arg = arg;
+    work->pending = false;
+    work->next = NULL;
+}
+
+/**
+ * Queue `work` on this CPU's worker. Safe from interrupt and softirq context.
+ * Returns false if it was still pending from an earlier call, in which case
+ * that run will pick up whatever this one was for.
+ */
+bool work_queue(struct work *work)
+{
+    // The same item can be queued from several CPUs, each with its own
+    // queue lock, so whoever flips `pending` owns the one list it goes on
+    if (__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+
+    struct workqueue *wq = workqueues + this_cpu_id();
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    work->next = NULL;
+    if (wq->tail != NULL) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+    struct thread *worker = wq->worker;
+    spin_unlock_irqrestore(&wq->lock, flags);
+
+    // Before workqueue_init it just waits for the worker to show up
+    if (worker != NULL) {
+        sched_wake(worker);
+    }
+    return true;
+}
+
+static void workqueue_worker(void *arg)
+{
+    struct workqueue *wq = arg;
+    for (;;) {
+        // One at a time: an item is only off the list once it's about to
+        // run, so nothing still waiting can be requeued out from under us
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        struct work *work = wq->head;
+        if (work != NULL) {
+            wq->head = work->next;
+            if (wq->head == NULL) {
+                wq->tail = NULL;
+            }
+            work->next = NULL;
+            // Unlinked, so it can go on any list again, even while it runs
+            __atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+        }
+        spin_unlock_irqrestore(&wq->lock, flags);
+
+        if (work == NULL) {
+            sched_block();
+            continue;
+        }
+        work->fn(work->arg);
+    }
+}
+
+/**
+ * Start a kworker thread pinned to each online CPU. Needs the scheduler and
+ * the APs up.
+ */
+void workqueue_init()
+{
+    for (size_t cpu = 0; cpu < percpu_count; cpu++) {
+        struct workqueue *wq = workqueues + cpu;
+        struct thread *worker =
+            thread_create("kworker", workqueue_worker, wq, SCHED_PRIO_HIGH,
+                          SCHED_CPU(cpu));
+        if (worker == NULL) {
+            printf("Workqueue: couldn't start a worker for CPU %u\n", cpu);
+            continue;
+        }
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        wq->worker = worker;
+        bool queued = wq->head != NULL;
+        spin_unlock_irqrestore(&wq->lock, flags);
+        if (queued) {
+            sched_wake(worker);
+        }
+    }
+}
@@ -5,18 +5,63 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define RINGBUF_SIZE (512)
+/**
+ *  Lock-free ring buffers of fixed-size elements. Capacity must be a power
+ *  of two, and storage is the caller's. Pushing to a full ring fails (and
+ *  counts an overflow) rather than overwriting anything.
+ *
+ *  spsc_ring: one producer, one consumer, e.g. an IRQ handler and a thread.
+ *  mpsc_ring: any number of producers (other CPUs, nested IRQs), one
+ *             consumer. A producer interrupted halfway through a push only
+ *             holds up the consumer, never other producers.
+ */
+#define RING_CACHELINE (64)
 
-struct u8_ringbuf {
-    uint8_t buffer[RINGBUF_SIZE];
-    uint8_t *p_write;
-    uint8_t *p_read;
-    uint8_t *p_end;
+/// Bytes of storage an mpsc_ring needs: each slot carries a sequence number
+#define MPSC_RING_SLOT_SIZE(elem_size)                                         \
+    (sizeof(size_t) + (((elem_size) + 7) & ~(size_t)7))
+#define MPSC_RING_STORAGE_SIZE(capacity, elem_size)                            \
+    ((capacity) * MPSC_RING_SLOT_SIZE(elem_size))
+#define SPSC_RING_STORAGE_SIZE(capacity, elem_size) ((capacity) * (elem_size))
+
+struct spsc_ring {
+    uint8_t *slots;
+    size_t elem_size;
+    size_t mask; /** Capacity - 1 */
+    size_t overflows; /** Elements dropped because the ring was full */
+    /// Next slot to write, only the producer writes it
+    size_t head __attribute__((aligned(RING_CACHELINE)));
+    /// Next slot to read, only the consumer writes it
+    size_t tail __attribute__((aligned(RING_CACHELINE)));
+};
+
+struct mpsc_ring {
+    uint8_t *slots;
+    size_t elem_size;
+    size_t slot_size;
+    size_t mask;
+    size_t overflows;
+    /// Next slot to claim, producers race for it
+    size_t head __attribute__((aligned(RING_CACHELINE)));
+    /// Next slot to read, only the consumer writes it
+    size_t tail __attribute__((aligned(RING_CACHELINE)));
 };
 
-bool u8_rb_fifo_has_data(struct u8_ringbuf *rb);
-void u8_rb_fifo_init(struct u8_ringbuf *rb);
-void u8_rb_fifo_push(struct u8_ringbuf *rb, uint8_t data);
-uint8_t u8_rb_fifo_pop(struct u8_ringbuf *rb);
+void spsc_ring_init(struct spsc_ring *ring, void *storage, size_t elem_size,
+                    size_t capacity);
+size_t spsc_ring_count(struct spsc_ring *ring);
+bool spsc_ring_push(struct spsc_ring *ring, const void *elem);
+size_t spsc_ring_push_bulk(struct spsc_ring *ring, const void *elems,
+                           size_t n);
+bool spsc_ring_pop(struct spsc_ring *ring, void *elem);
+size_t spsc_ring_pop_bulk(struct spsc_ring *ring, void *elems, size_t n);
+
+void mpsc_ring_init(struct mpsc_ring *ring, void *storage, size_t elem_size,
+                    size_t capacity);
+bool mpsc_ring_push(struct mpsc_ring *ring, const void *elem);
+size_t mpsc_ring_push_bulk(struct mpsc_ring *ring, const void *elems,
+                           size_t n);
+bool mpsc_ring_pop(struct mpsc_ring *ring, void *elem);
+size_t mpsc_ring_pop_bulk(struct mpsc_ring *ring, void *elems, size_t n);
 
 #endif /* _RINGBUF_H */
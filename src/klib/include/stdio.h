@@ -6,10 +6,15 @@
  *  http://pubs.opengroup.org/onlinepubs/9699919799/basedefs/stdio.h.html
  */
 
+#include <stdarg.h>
+#include <stddef.h>
+
 #define EOF (-1)
 #define BUFSIZ (512)
 
 int printf(const char *restrict, ...);
+int snprintf(char *restrict, size_t, const char *restrict, ...);
+int vsnprintf(char *restrict, size_t, const char *restrict, va_list);
 int putchar(int);
 int puts(const char *);
 
@@ -1,35 +1,204 @@
 #include <ringbuf.h>
-#include <memory.h>
+#include <string.h>
 
-bool u8_rb_fifo_has_data(struct u8_ringbuf *rb)
+/**
+ * Copy `n` elements between `elems` and the ring's slots starting at index
+ * `pos`, in at most two pieces since the slots wrap.
+ */
+static void spsc_ring_copy(struct spsc_ring *ring, size_t pos, void *elems,
+                           size_t n, bool to_ring)
 {
-    return rb->p_write != rb->p_read;
+    size_t first = ring->mask + 1 - (pos & ring->mask);
+    if (first > n) {
+        first = n;
+    }
+    uint8_t *slot = ring->slots + (pos & ring->mask) * ring->elem_size;
+    uint8_t *elem = elems;
+    size_t first_bytes = first * ring->elem_size;
+    size_t rest_bytes = (n - first) * ring->elem_size;
+    if (to_ring) {
+        memcpy(slot, elem, first_bytes);
+        memcpy(ring->slots, elem + first_bytes, rest_bytes);
+    } else {
+        memcpy(elem, slot, first_bytes);
+        memcpy(elem + first_bytes, ring->slots, rest_bytes);
+    }
+}
+
+void spsc_ring_init(struct spsc_ring *ring, void *storage, size_t elem_size,
+                    size_t capacity)
+{
+    ring->slots = storage;
+    ring->elem_size = elem_size;
+    ring->mask = capacity - 1;
+    ring->overflows = 0;
+    ring->head = 0;
+    ring->tail = 0;
 }
 
-void u8_rb_fifo_push(struct u8_ringbuf *rb, uint8_t data)
+/**
+ * Elements waiting. Exact for the consumer, a lower bound for the producer.
+ */
+size_t spsc_ring_count(struct spsc_ring *ring)
 {
-    *(rb->p_write++) = data;
-    if (rb->p_write >= rb->p_end) {
-        rb->p_write = rb->buffer;
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Push up to `n` elements, returning how many fit. The rest are counted as
+ * overflows. Producer only.
+ */
+size_t spsc_ring_push_bulk(struct spsc_ring *ring, const void *elems, size_t n)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t space = ring->mask + 1 - (head - tail);
+    if (n > space) {
+        __atomic_fetch_add(&ring->overflows, n - space, __ATOMIC_RELAXED);
+        n = space;
     }
-    if (rb->p_read == rb->p_write) {
-        rb->p_read++; // bye bye data
+    spsc_ring_copy(ring, head, (void *)elems, n, true);
+    // Publish the elements before the new head
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool spsc_ring_push(struct spsc_ring *ring, const void *elem)
+{
+    return spsc_ring_push_bulk(ring, elem, 1) == 1;
+}
+
+/**
+ * Pop up to `n` elements into `elems`, returning how many there were.
+ * Consumer only.
+ */
+size_t spsc_ring_pop_bulk(struct spsc_ring *ring, void *elems, size_t n)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (n > head - tail) {
+        n = head - tail;
     }
+    spsc_ring_copy(ring, tail, elems, n, false);
+    // Done reading the slots before handing them back
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool spsc_ring_pop(struct spsc_ring *ring, void *elem)
+{
+    return spsc_ring_pop_bulk(ring, elem, 1) == 1;
+}
+
+/**
+ * MPSC slots are a sequence number followed by the element (D. Vyukov's
+ * bounded queue). Slot i is free for the push at position p when its
+ * sequence is p, and holds that push's element once it's p + 1.
+ */
+static inline size_t *mpsc_ring_seq(struct mpsc_ring *ring, size_t pos)
+{
+    return (size_t *)(ring->slots + (pos & ring->mask) * ring->slot_size);
+}
+
+static inline void *mpsc_ring_elem(struct mpsc_ring *ring, size_t pos)
+{
+    return (uint8_t *)mpsc_ring_seq(ring, pos) + sizeof(size_t);
+}
+
+void mpsc_ring_init(struct mpsc_ring *ring, void *storage, size_t elem_size,
+                    size_t capacity)
+{
+    ring->slots = storage;
+    ring->elem_size = elem_size;
+    ring->slot_size = MPSC_RING_SLOT_SIZE(elem_size);
+    ring->mask = capacity - 1;
+    ring->overflows = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        *mpsc_ring_seq(ring, i) = i;
+    }
+}
+
+/**
+ * Push up to `n` elements as one contiguous run, returning how many fit. The
+ * rest are counted as overflows. Safe from any number of producers, including
+ * interrupt handlers that preempt one.
+ */
+size_t mpsc_ring_push_bulk(struct mpsc_ring *ring, const void *elems, size_t n)
+{
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t want = n;
+    for (;;) {
+        // The consumer frees slots in order, so if the last slot of the run
+        // is free, so is the rest. Shrink the run until it fits.
+        while (n > 0 &&
+               __atomic_load_n(mpsc_ring_seq(ring, head + n - 1),
+                               __ATOMIC_ACQUIRE) != head + n - 1) {
+            n -= 1;
+        }
+        if (n == 0) {
+            // Really full, or just a stale head?
+            size_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            if (now == head) {
+                break;
+            }
+            head = now;
+            n = want;
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&ring->head, &head, head + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+        n = want; // Someone else got in first, `head` is fresh
+    }
+    if (want > n) {
+        __atomic_fetch_add(&ring->overflows, want - n, __ATOMIC_RELAXED);
+    }
+
+    const uint8_t *elem = elems;
+    for (size_t i = 0; i < n; i++, elem += ring->elem_size) {
+        memcpy(mpsc_ring_elem(ring, head + i), elem, ring->elem_size);
+        __atomic_store_n(mpsc_ring_seq(ring, head + i), head + i + 1,
+                         __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+bool mpsc_ring_push(struct mpsc_ring *ring, const void *elem)
+{
+    return mpsc_ring_push_bulk(ring, elem, 1) == 1;
 }
 
-uint8_t u8_rb_fifo_pop(struct u8_ringbuf *rb)
+/**
+ * Pop up to `n` elements into `elems`, stopping early at a slot whose
+ * producer hasn't finished. Consumer only.
+ */
+size_t mpsc_ring_pop_bulk(struct mpsc_ring *ring, void *elems, size_t n)
 {
-    uint8_t ret = *(rb->p_read++);
-    if (rb->p_read >= rb->p_end) {
-        rb->p_read = rb->buffer;
+    size_t tail = ring->tail;
+    uint8_t *elem = elems;
+    size_t i;
+    for (i = 0; i < n; i++, elem += ring->elem_size) {
+        size_t *seq = mpsc_ring_seq(ring, tail + i);
+        if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != tail + i + 1) {
+            break;
+        }
+        memcpy(elem, mpsc_ring_elem(ring, tail + i), ring->elem_size);
+        // Free for the push one lap later
+        __atomic_store_n(seq, tail + i + ring->mask + 1, __ATOMIC_RELEASE);
     }
-    return ret;
+    __atomic_store_n(&ring->tail, tail + i, __ATOMIC_RELAXED);
+    return i;
 }
 
-void u8_rb_fifo_init(struct u8_ringbuf *rb)
+bool mpsc_ring_pop(struct mpsc_ring *ring, void *elem)
 {
-    memset(rb->buffer, 0, RINGBUF_SIZE);
-    rb->p_end = rb->buffer + RINGBUF_SIZE;
-    rb->p_write = rb->buffer;
-    rb->p_read = rb->buffer;
+    return mpsc_ring_pop_bulk(ring, elem, 1) == 1;
 }
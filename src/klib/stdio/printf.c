@@ -3,8 +3,8 @@
 #include <string.h>
 #include <stdint.h>
 
-void terminal_set_bg_colour(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
-void terminal_set_fg_colour(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+int vprintk(int level, const char *fmt, va_list ap);
+#define PRINTF_LEVEL (3) /** PRINTK_INFO */
 
 /**
  * Convert a number to a regular ol' ASCII string.
@@ -48,99 +48,36 @@ char *ulltoa(unsigned long long num, char *str, int base)
     return str;
 }
 
-int printf(const char *restrict fmt, ...)
+/**
+ * Append `c` to `buf` if there's room, leaving space for the NUL.
+ */
+static inline void vsnprintf_put(char *buf, size_t size, size_t *len, char c)
 {
-    va_list ap;
-    va_start(ap, fmt);
+    if (*len + 1 < size) {
+        buf[*len] = c;
+    }
+    *len += 1;
+}
 
-    int len = 0;
+/**
+ * Format into `buf`, truncating to `size` bytes including the NUL. Returns
+ * the length the whole thing would have had. Supports %%, %c, %s, %u and %x
+ * (64-bit), anything else (ANSI escapes too) is copied as is.
+ */
+int vsnprintf(char *restrict buf, size_t size, const char *restrict fmt,
+              va_list ap)
+{
+    size_t len = 0;
     while (*fmt != '\0') {
-        if (*fmt == '\x1b' && *(fmt + 1) == '[') {
-            // ANSI escape
-            fmt += 2;
-            // SGR functions
-            if (*fmt == '0' && *(fmt + 1) == 'm') {
-                // Reset
-                terminal_set_bg_colour(0, 0, 0, 0xff);
-                terminal_set_fg_colour(0xff, 0xff, 0xff, 0xff);
-                fmt += 2;
-                continue;
-            } else if (*fmt == '3' && *(fmt + 2) == 'm') {
-                // Set text to basic colour palette
-                uint8_t colour = *(fmt + 1) - '0';
-                switch (colour) {
-                case 0: // Black
-                    terminal_set_fg_colour(0, 0, 0, 0xff);
-                    break;
-                case 1: // Red
-                    terminal_set_fg_colour(0xff, 0, 0, 0xff);
-                    break;
-                case 2: // Green
-                    terminal_set_fg_colour(0, 0xff, 0, 0xff);
-                    break;
-                case 3: // Yellow
-                    terminal_set_fg_colour(0xff, 0xff, 0, 0xff);
-                    break;
-                case 4: // Blue
-                    terminal_set_fg_colour(0, 0, 0xff, 0xff);
-                    break;
-                case 5: // Magenta
-                    terminal_set_fg_colour(0xff, 0, 0xff, 0xff);
-                    break;
-                case 6: // Cyan
-                    terminal_set_fg_colour(0, 0xff, 0xff, 0xff);
-                    break;
-                case 7: // White
-                    terminal_set_fg_colour(0xff, 0xff, 0xff, 0xff);
-                    break;
-                }
-                fmt += 3;
-                continue;
-            } else if (*fmt == '4' && *(fmt + 2) == 'm') {
-                // Set background to basic colour palette
-                uint8_t colour = *(fmt + 1) - '0';
-                switch (colour) {
-                case 0: // Black
-                    terminal_set_bg_colour(0, 0, 0, 0xff);
-                    break;
-                case 1: // Red
-                    terminal_set_bg_colour(0xff, 0, 0, 0xff);
-                    break;
-                case 2: // Green
-                    terminal_set_bg_colour(0, 0xff, 0, 0xff);
-                    break;
-                case 3: // Yellow
-                    terminal_set_bg_colour(0xff, 0xff, 0, 0xff);
-                    break;
-                case 4: // Blue
-                    terminal_set_bg_colour(0, 0, 0xff, 0xff);
-                    break;
-                case 5: // Magenta
-                    terminal_set_bg_colour(0xff, 0, 0xff, 0xff);
-                    break;
-                case 6: // Cyan
-                    terminal_set_bg_colour(0, 0xff, 0xff, 0xff);
-                    break;
-                case 7: // White
-                    terminal_set_bg_colour(0xff, 0xff, 0xff, 0xff);
-                    break;
-                }
-                fmt += 3;
-                continue;
-            }
-        }
-
         if (*fmt == '%' && *(fmt + 1) == '%') {
-            putchar(*((const unsigned char *)fmt));
+            vsnprintf_put(buf, size, &len, '%');
             fmt += 2;
-            len += 1;
             continue;
         }
 
         if (*fmt != '%') {
-            putchar(*((const unsigned char *)fmt));
+            vsnprintf_put(buf, size, &len, *fmt);
             fmt += 1;
-            len += 1;
             continue;
         }
 
@@ -149,17 +86,15 @@ int printf(const char *restrict fmt, ...)
 
         if (*fmt == 'c') {
             int c = va_arg(ap, int);
-            putchar(*((const unsigned char *)c));
+            vsnprintf_put(buf, size, &len, (char)c);
             fmt += 1;
-            len += 1;
             continue;
         }
 
         if (*fmt == 's') {
             const char *str = va_arg(ap, const char *);
-            for (size_t i = 0; i < strlen(str); i++) {
-                putchar(*((const unsigned char *)(str + i)));
-                len += 1;
+            for (; *str; str += 1) {
+                vsnprintf_put(buf, size, &len, *str);
             }
             fmt += 1;
             continue;
@@ -170,8 +105,8 @@ int printf(const char *restrict fmt, ...)
             unsigned long long u = va_arg(ap, unsigned long long);
             char ubuf[21];
             char *ubuf_out = ulltoa(u, ubuf, 10);
-            for (; *ubuf_out; ubuf_out += 1, len += 1) {
-                putchar(*ubuf_out);
+            for (; *ubuf_out; ubuf_out += 1) {
+                vsnprintf_put(buf, size, &len, *ubuf_out);
             }
             fmt += 1;
             continue;
@@ -182,14 +117,37 @@ int printf(const char *restrict fmt, ...)
             unsigned long long x = va_arg(ap, unsigned long long);
             char xbuf[17];
             char *xbuf_out = ulltoa(x, xbuf, 16);
-            for (; *xbuf_out; xbuf_out += 1, len += 1) {
-                putchar(*xbuf_out);
+            for (; *xbuf_out; xbuf_out += 1) {
+                vsnprintf_put(buf, size, &len, *xbuf_out);
             }
             fmt += 1;
             continue;
         }
     }
 
+    if (size > 0) {
+        buf[len < size ? len : size - 1] = '\0';
+    }
+    return len;
+}
+
+int snprintf(char *restrict buf, size_t size, const char *restrict fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/**
+ * Goes to the kernel log, see printk.
+ */
+int printf(const char *restrict fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vprintk(PRINTF_LEVEL, fmt, ap);
     va_end(ap);
     return len;
 }
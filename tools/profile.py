@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""
+Symbolize a profile dumped over serial by profile_dump (build with
+PROFILE_BOOT=1, the dump lands in tmp/serial.log).
+
+    tools/profile.py tmp/serial.log argir.bin            # flat profile
+    tools/profile.py tmp/serial.log argir.bin --folded   # for flamegraph.pl
+"""
+import argparse
+import bisect
+import collections
+import subprocess
+import sys
+
+
+def load_symbols(binary, nm):
+    """Sorted (address, name) of every function in `binary`."""
+    out = subprocess.run([nm, "-n", "--defined-only", binary],
+                         capture_output=True, text=True, check=True).stdout
+    symbols = []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "tTwW":
+            symbols.append((int(parts[0], 16), parts[2]))
+    return symbols
+
+
+def symbolize(symbols, addrs, pc):
+    i = bisect.bisect_right(addrs, pc) - 1
+    if i < 0:
+        return f"0x{pc:x}"
+    return symbols[i][1]
+
+
+def parse_dump(path):
+    """Samples (leaf first) from the last complete dump in the log."""
+    samples, current = None, None
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("PROFILE BEGIN"):
+                current = []
+                _, _, mode, period = line.split()
+                print(f"# {mode} sampling, period 0x{period}", file=sys.stderr)
+            elif line.startswith("PROFILE END") and current is not None:
+                samples, current = current, None
+            elif line.startswith("CPU ") and current is not None:
+                _, cpu, count, dropped = line.split()
+                print(f"# CPU {int(cpu, 16)}: {int(count, 16)} samples, "
+                      f"{int(dropped, 16)} dropped", file=sys.stderr)
+            elif line.startswith("S ") and current is not None:
+                current.append([int(pc, 16) for pc in line.split()[1:]])
+    if samples is None:
+        sys.exit(f"{path}: no complete profile found")
+    return samples
+
+
+def stack_names(symbols, addrs, sample):
+    # Callers are return addresses, back up into the call instruction
+    names = [symbolize(symbols, addrs, sample[0])]
+    names += [symbolize(symbols, addrs, pc - 1) for pc in sample[1:]]
+    return names
+
+
+def print_flat(stacks, top):
+    self_counts = collections.Counter(stack[0] for stack in stacks)
+    total_counts = collections.Counter()
+    for stack in stacks:
+        total_counts.update(set(stack))
+
+    n = len(stacks)
+    print(f"{'self':>7} {'total':>7}  function")
+    for name, count in self_counts.most_common(top):
+        print(f"{100 * count / n:6.2f}% {100 * total_counts[name] / n:6.2f}%"
+              f"  {name}")
+
+
+def print_folded(stacks):
+    folded = collections.Counter(";".join(reversed(stack))
+                                 for stack in stacks)
+    for stack, count in sorted(folded.items()):
+        print(f"{stack} {count}")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("log", help="serial output containing the dump")
+    parser.add_argument("binary", help="the argir.bin that produced it")
+    parser.add_argument("--folded", action="store_true",
+                        help="print folded stacks instead of a flat profile")
+    parser.add_argument("--top", type=int, default=30)
+    parser.add_argument("--nm", default="x86_64-elf-nm")
+    args = parser.parse_args()
+
+    symbols = load_symbols(args.binary, args.nm)
+    addrs = [addr for addr, _ in symbols]
+    samples = parse_dump(args.log)
+    stacks = [stack_names(symbols, addrs, sample) for sample in samples]
+    if not stacks:
+        sys.exit("profile is empty")
+
+    if args.folded:
+        print_folded(stacks)
+    else:
+        print_flat(stacks, args.top)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+Cut the Chrome trace written by trace_dump (build with TRACE_BOOT=1) out of
+the serial log, and summarize the boot phases.
+
+    tools/trace.py tmp/serial.log trace.json
+
+Load trace.json in chrome://tracing or https://ui.perfetto.dev.
+"""
+import json
+import sys
+
+
+def extract(path):
+    """The last complete trace in the log."""
+    trace, lines = None, None
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.rstrip("\r\n")
+            if line == "TRACE BEGIN":
+                lines = []
+            elif line == "TRACE END" and lines is not None:
+                trace, lines = json.loads("".join(lines)), None
+            elif lines is not None:
+                lines.append(line)
+    if trace is None:
+        sys.exit(f"{path}: no complete trace found")
+    return trace
+
+
+def summarize(trace):
+    """Print each top-level span on CPU 0, i.e. the boot phases."""
+    depth, begins = 0, {}
+    for event in trace["traceEvents"]:
+        if event["tid"] != 0:
+            continue
+        if event["ph"] == "B":
+            if depth == 0:
+                begins[event["name"]] = event["ts"]
+            depth += 1
+        elif event["ph"] == "E":
+            depth = max(depth - 1, 0)
+            if depth == 0 and event["name"] in begins:
+                us = event["ts"] - begins.pop(event["name"])
+                print(f"{us:12.3f} us  {event['name']}")
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(f"usage: {sys.argv[0]} <serial.log> <trace.json>")
+    trace = extract(sys.argv[1])
+    with open(sys.argv[2], "w") as f:
+        json.dump(trace, f)
+    summarize(trace)
+
+
+if __name__ == "__main__":
+    main()